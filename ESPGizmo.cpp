@@ -1,12 +1,26 @@
 #include <ESPGizmo.h>
 #include <ESPGizmoHTML.h>
-#include <FS.h>
+#include <ESPGizmoUpload.h>
+#include <ESPGizmoFS.h>
+#include <ESPGizmoBroker.h>
+#include <ESPGizmoBrokerWiFi.h>
 
-#include <ESP8266mDNS.h>
 #include <ESP8266httpUpdate.h>
+#include <Updater.h>
+#include <lwip/etharp.h>
+#include <lwip/netif.h>
+#if GIZMO_WITH_MDNS
+#include <ESP8266mDNS.h>
+#endif
+#if GIZMO_WITH_OTA
 #include <ArduinoOTA.h>
+#endif
+#if GIZMO_WITH_CAPTIVE_PORTAL
 #include <DNSServer.h>
+#endif
+#if GIZMO_WITH_HEALTH
 #include <Pinger.h>
+#endif
 
 #define LED 2
 
@@ -15,55 +29,109 @@
 #define MAX_CONNECTIONS     8
 
 #define CUSTOM_PASSKEY      "/psk"
+#define FAST_CONNECT        "/cfg/fastwifi"
 #define ALWAYS_ONLINE       "/online"
 
 #define GIZMO_CONSOLE_TOPIC   "gizmo/console"
+#define GIZMO_WIFI_TOPIC      "gizmo/wifi/%s"
+#define GIZMO_BOOT_TOPIC      "gizmo/boot/%s"
+#define GIZMO_WATCHDOG_TOPIC  "gizmo/watchdog/%s"
+
+// Overruns of stages that did complete are reported at most this often.
+#define STALL_REPORT_INTERVAL   60000
 #define GIZMO_CONTROL_TOPIC  "gizmo/control"
+#define GIZMO_DEVICE_CONTROL_TOPIC  "gizmo/control/%s"
+#define GIZMO_GROUP_CONTROL_TOPIC   "gizmo/control/group/%s"
+
+// PubSubClient refuses publishes whose fixed header, topic length and topic and payload
+// exceed its buffer; the fixed header takes at most 5 bytes.
+#define MQTT_PUBLISH_OVERHEAD       7
+#define MQTT_STREAM_CHUNK           256
 
-#define MQTT_RECONNECT_FREQUENCY    5000
+// How long to wait for the cached BSSID/channel association before doing a full scan
+#define FAST_CONNECT_TIMEOUT        4000
+// How long the gateway gets to answer ARP before a cached lease is given up for DHCP
+#define LEASE_CHECK_TIMEOUT         1500
+#define LEASE_CHECK_RETRY           300
+
+// Longest a duty-cycled device stays awake before giving up and going back to sleep
+#define DUTY_CYCLE_AWAKE_TIMEOUT    8000
 
-#define MAX_TOPIC_SIZE  64
-#define MAX_TOPIC_COUNT 16
 static char topics[MAX_TOPIC_COUNT][MAX_TOPIC_SIZE];
 static int topicCount = 0;
 
+static char deviceControlTopic[MAX_TOPIC_SIZE];
+static char groupControlTopics[MAX_CONTROL_GROUPS][MAX_TOPIC_SIZE];
+static int controlGroupCount = 0;
+static boolean legacyControl = true;
+
 static boolean callAfterConnection = false;
+static boolean fastBootEnabled = false;
+static boolean servicesDeferred = false;
+static boolean captiveDeferred = false;
+static boolean bootReported = false;
 static boolean booted = false;
-static boolean disconnected = true;
+// Set from the SDK's Wi-Fi event callbacks and acted on in isNetworkAvailable()
+static volatile boolean wifiGotIP = false;
+static volatile boolean wifiLost = false;
+static volatile int wifiLostReason = 0;
+static boolean filesMigrated = false;
 static boolean wifiConfigured = false;
 static boolean mqttConfigured = false;
 static uint32_t lastReconnectAttempt = 0;
-static uint32_t restartTime = 0;
-static uint32_t updateTime = 0;
-static uint32_t fileUpdateTime = 0;
+static uint64_t restartTime = 0;
+
+// Configuration saved from the web pages is applied in place shortly after the
+// response has gone out; the outcome is reported on the console topic once online.
+#define APPLY_MQTT          0x01
+#define APPLY_NETWORK       0x02
+#define APPLY_PASSKEY       0x04
+#define CONFIG_APPLY_DELAY  1500
+static uint64_t applyTime = 0;
+static uint8_t pendingApply = 0;
+static char configReport[MAX_ANNOUNCE_MESSAGE_SIZE];
+static uint64_t updateTime = 0;
+static uint64_t fileUpdateTime = 0;
 
 static const char *scheduledTopic = NULL;
 static char *scheduledPayload = NULL;
 static boolean scheduledRetain = false;
 
-#define MAX_ANNOUNCE_MESSAGE_SIZE   128
 static char announceMessage[MAX_ANNOUNCE_MESSAGE_SIZE];
 
-#define MAX_WILL_TOPIC_SIZE     128
-static char defaultWillTopic[MAX_ANNOUNCE_MESSAGE_SIZE];
-#define MAX_WILL_MESSAGE_SIZE   128
-static char defaultWillMessage[MAX_ANNOUNCE_MESSAGE_SIZE];
+static char defaultWillTopic[MAX_WILL_TOPIC_SIZE];
+static char defaultWillMessage[MAX_WILL_MESSAGE_SIZE];
 
+#if GIZMO_WITH_CAPTIVE_PORTAL
 #define DNS_PORT    53
 
 DNSServer dnsServer;
+#endif
 
 #define OFFLINE_TIMEOUT     30000
-static uint32_t offlineTime;
+static uint64_t offlineTime;
 static bool isAlwaysOnline = false;
 
+#if GIZMO_WITH_NTPCLIENT
 WiFiUDP ntpUDP;
 
-#define PING_FREQUENCY    60000
-#define PING_THRESHOLD    3*PING_FREQUENCY
+// Legacy NTPClient only needs to refresh rarely; the time service keeps accurate time.
+#define LEGACY_NTP_UPDATE_INTERVAL  3600000
+#endif
+
+#define GIZMO_HEALTH_TOPIC  "gizmo/health/%s"
+#define HEALTH_PROBE_TOPIC  "gizmo/health/%s/probe"
+#if GIZMO_WITH_HEALTH
 Pinger *pinger = NULL;
-static uint32_t lastPingAttempt = 0;
-static uint32_t lastPingSuccess = 0;
+#endif
+static uint64_t lastProbe = 0;
+static uint64_t lastHealthPublish = 0;
+static uint64_t brokerProbeTime = 0;
+static uint32_t brokerProbeSequence = 0;
+static boolean gatewayProbePending = false;
+static char probeTopic[MAX_TOPIC_SIZE];
+
+static GizmoRTCState rtcState;
 
 ESPGizmo::ESPGizmo() {
 }
@@ -80,6 +148,11 @@ const char *ESPGizmo::getSSID() {
     return ssid;
 }
 
+const char *ESPGizmo::getActiveSSID() {
+    GizmoNetwork *network = networks.get(currentNetwork);
+    return network ? network->ssid : ssid;
+}
+
 const char *ESPGizmo::getMAC() {
     return mac;
 }
@@ -96,9 +169,28 @@ ESP8266WebServer *ESPGizmo::httpServer() {
     return server;
 }
 
+#if GIZMO_WITH_NTPCLIENT
 NTPClient *ESPGizmo::timeClient() {
+    if (!ntpClient && clock) {
+        ntpClient = new NTPClient(ntpUDP, NTP_DEFAULT_SERVER, clock->localOffset(clock->now()),
+                                  LEGACY_NTP_UPDATE_INTERVAL);
+        ntpClient->begin();
+    }
     return ntpClient;
 }
+#endif
+
+GizmoTime *ESPGizmo::timeService() {
+    return clock;
+}
+
+uint64_t ESPGizmo::now() {
+    return clock ? clock->now() : 0;
+}
+
+uint64_t ESPGizmo::uptime() {
+    return gizmoUptime();
+}
 
 void ESPGizmo::led(boolean on) {
     digitalWrite(LED, on ? LOW : HIGH);
@@ -110,12 +202,17 @@ void ESPGizmo::initToSaneValues() {
     mqttHost[0] = '\0';
     mqttUser[0] = '\0';
     mqttPass[0] = '\0';
+    mqttFingerprint[0] = '\0';
 }
 
 void ESPGizmo::setCallback(void (*callback)(char *, uint8_t *, unsigned int)) {
     mqttCallback = callback;
 }
 
+void ESPGizmo::setCBORCallback(void (*callback)(char *, GizmoCBORReader &)) {
+    cborCallback = callback;
+}
+
 void replaceSubstring(char *string, const char *sub, const char *rep) {
     int stringLen, subLen, newLen;
     int i = 0, j, k;
@@ -173,23 +270,271 @@ void ESPGizmo::publish(const char *topic, const char *payload) {
 }
 
 void ESPGizmo::publish(const char *topic, char *payload, boolean retain) {
+    sendPublish(topic, payload, retain);
+}
+
+bool ESPGizmo::sendPublish(const char *topic, const char *payload, boolean retain) {
+    bool sent = false;
+    char tt[MAX_TOPIC_SIZE];
+    if (strstr(topic, "%s")) {
+        snprintf(tt, MAX_TOPIC_SIZE, topic, getTopicPrefix());
+        topic = tt;
+    }
+
+#if GIZMO_WITH_BROKER
+    if (broker) {
+        broker->publish(topic, (uint8_t *) payload, strlen(payload), retain);
+        sent = true;
+    } else
+#endif
     if (mqttConfigured && mqtt) {
-        if (strstr(topic, "%s")) {
-            char tt[MAX_TOPIC_SIZE];
-            snprintf(tt, MAX_TOPIC_SIZE, topic, getTopicPrefix());
-            mqtt->publish(tt, payload, retain);
+        size_t length = strlen(payload);
+        size_t size = MQTT_PUBLISH_OVERHEAD + strlen(topic) + length;
+        if (size > largestPublish) {
+            largestPublish = size;
+        }
+        if (coalescer) {
+            coalescer->hold();
+        }
+        if (mqttStreamOpen()) {
+            // Another packet now would land in the middle of the streamed payload.
+            Serial.printf("Stream open; dropped publish to %s\n", topic);
+            sent = false;
+        } else if (size > mqtt->getBufferSize()) {
+            // PubSubClient would drop this outright; stream it past the buffer instead.
+            oversizePublishes++;
+            sent = mqtt->beginPublish(topic, length, retain) &&
+                   mqtt->write((const uint8_t *) payload, length) == length && mqtt->endPublish();
         } else {
-            mqtt->publish(topic, payload, retain);
+            sent = mqtt->publish(topic, payload, retain);
+        }
+        if (!sent) {
+            publishFailures++;
+        }
+        if (coalescer) {
+            coalescer->release();
         }
     } else {
+        if (mqttConfigured) {
+            publishFailures++;
+        }
         Serial.printf("no mqtt...");
     }
+
+    if (server && server->eventClients()) {
+        char event[MAX_TOPIC_SIZE + MAX_ANNOUNCE_MESSAGE_SIZE];
+        snprintf(event, sizeof(event), "%s %s", topic, payload);
+        server->sendEvent("publish", event);
+    }
+    return sent;
+}
+
+void ESPGizmo::sendStateEvent(const char *state) {
+    if (server && server->eventClients()) {
+        server->sendEvent("state", state);
+    }
 }
 
 void ESPGizmo::publish(const char *topic, const char *payload, boolean retain) {
     publish(topic, (char *) payload, retain);
 }
 
+#if GIZMO_WITH_BROKER
+// Collects an encoded payload for the local broker, which takes whole messages.
+class BufferPrint : public Print {
+public:
+    BufferPrint(uint8_t *buffer, size_t size) : buffer(buffer), size(size) {}
+
+    size_t write(uint8_t b) override {
+        return write(&b, 1);
+    }
+
+    size_t write(const uint8_t *data, size_t count) override {
+        if (length + count > size) {
+            return 0;
+        }
+        memcpy(buffer + length, data, count);
+        length += count;
+        return count;
+    }
+
+    size_t length = 0;
+
+private:
+    uint8_t *buffer;
+    size_t size;
+};
+#endif
+
+bool ESPGizmo::publishCBOR(const char *topic, GizmoCBOREncoder encode, boolean retain) {
+    char tt[MAX_TOPIC_SIZE];
+    if (strstr(topic, "%s")) {
+        snprintf(tt, MAX_TOPIC_SIZE, topic, getTopicPrefix());
+        topic = tt;
+    }
+
+    // Encode once to learn the length, then again straight into the outgoing packet.
+    GizmoCBORWriter sizer(NULL);
+    encode(sizer);
+
+    bool sent = false;
+#if GIZMO_WITH_BROKER
+    if (broker) {
+        GizmoScratch packet(sizer.length());
+        BufferPrint buffer(packet.bytes(), packet.size());
+        GizmoCBORWriter writer(&buffer);
+        encode(writer);
+        sent = packet.size() && buffer.length == sizer.length();
+        if (sent) {
+            broker->publish(topic, packet.bytes(), buffer.length, retain);
+        }
+    } else
+#endif
+    if (mqttStreamOpen()) {
+        Serial.printf("Stream open; dropped publish to %s\n", topic);
+        publishFailures++;
+    } else if (mqttConfigured && mqtt && mqtt->connected()) {
+        if (coalescer) {
+            coalescer->hold();
+        }
+        if (mqtt->beginPublish(topic, sizer.length(), retain)) {
+            GizmoCBORWriter writer(mqtt);
+            encode(writer);
+            sent = mqtt->endPublish() && writer.length() == sizer.length();
+        }
+        if (coalescer) {
+            coalescer->release();
+        }
+    } else {
+        Serial.printf("no mqtt...");
+    }
+
+    if (server && server->eventClients()) {
+        char event[MAX_TOPIC_SIZE + 24];
+        snprintf(event, sizeof(event), "%s (%u bytes of CBOR)", topic, sizer.length());
+        server->sendEvent("publish", event);
+    }
+    return sent;
+}
+
+bool ESPGizmo::mqttStreamOpen() {
+    return streaming && !streamBuffer;
+}
+
+bool ESPGizmo::beginPublish(const char *topic, unsigned int length, boolean retain) {
+    if (streaming) {
+        // Only one stream at a time; the one in progress is abandoned.
+        endPublish();
+    }
+    if (strstr(topic, "%s")) {
+        snprintf(streamTopic, MAX_TOPIC_SIZE, topic, getTopicPrefix());
+    } else {
+        streamTopic[0] = '\0';
+        strncat(streamTopic, topic, MAX_TOPIC_SIZE - 1);
+    }
+    streamLength = length;
+    streamWritten = 0;
+    streamRetain = retain;
+    uint32_t size = MQTT_PUBLISH_OVERHEAD + strlen(streamTopic) + length;
+    if (size > largestPublish) {
+        largestPublish = size;
+    }
+
+#if GIZMO_WITH_BROKER
+    if (broker) {
+        // The local broker delivers whole messages, so collect this one first.
+        streamBuffer = (uint8_t *) malloc(length ? length : 1);
+        streaming = streamBuffer != NULL;
+    } else
+#endif
+    if (mqttConfigured && mqtt && mqtt->connected()) {
+        if (coalescer) {
+            coalescer->hold();
+        }
+        streaming = mqtt->beginPublish(streamTopic, length, retain);
+        if (!streaming && coalescer) {
+            coalescer->release();
+        }
+    }
+    if (!streaming) {
+        publishFailures++;
+    }
+    return streaming;
+}
+
+size_t ESPGizmo::writePublish(const uint8_t *data, size_t length) {
+    if (!streaming || streamWritten + length > streamLength) {
+        return 0;
+    }
+    size_t written = length;
+    if (streamBuffer) {
+        memcpy(streamBuffer + streamWritten, data, length);
+    } else {
+        written = mqtt->write(data, length);
+    }
+    streamWritten += written;
+    return written;
+}
+
+bool ESPGizmo::endPublish() {
+    if (!streaming) {
+        return false;
+    }
+    streaming = false;
+    bool sent = streamWritten == streamLength;
+    if (streamBuffer) {
+#if GIZMO_WITH_BROKER
+        if (sent && broker) {
+            broker->publish(streamTopic, streamBuffer, streamLength, streamRetain);
+        }
+#endif
+        free(streamBuffer);
+        streamBuffer = NULL;
+    } else {
+        if (sent) {
+            sent = mqtt->endPublish();
+        } else {
+            // The packet header promised more than was written; the session can't recover.
+            mqtt->disconnect();
+        }
+        if (coalescer) {
+            coalescer->release();
+        }
+    }
+    if (!sent) {
+        publishFailures++;
+    }
+
+    if (server && server->eventClients()) {
+        char event[MAX_TOPIC_SIZE + 24];
+        snprintf(event, sizeof(event), "%s (%u bytes streamed)", streamTopic, streamWritten);
+        server->sendEvent("publish", event);
+    }
+    return sent;
+}
+
+bool ESPGizmo::publishFile(const char *topic, const char *path, boolean retain) {
+    File f = gizmoFS().open(path, "r");
+    if (!f) {
+        return false;
+    }
+    GizmoScratch chunk(MQTT_STREAM_CHUNK);
+    bool sent = chunk.size() && beginPublish(topic, f.size(), retain);
+    while (sent && f.available()) {
+        int l = f.read(chunk.bytes(), chunk.size());
+        sent = l > 0 && writePublish(chunk.bytes(), l) == (size_t) l;
+    }
+    f.close();
+    return endPublish() && sent;
+}
+
+void ESPGizmo::publishTimestamped(const char *topic, const char *payload, boolean retain) {
+    char stamped[MAX_ANNOUNCE_MESSAGE_SIZE];
+    char ts[21];
+    snprintf(stamped, MAX_ANNOUNCE_MESSAGE_SIZE, "%s|%s", payload, formatUint64(ts, now()));
+    publish(topic, stamped, retain);
+}
+
 void ESPGizmo::schedulePublish(const char *topic, char *payload, boolean retain) {
     scheduledRetain = retain;
     scheduledPayload = payload;
@@ -208,8 +553,107 @@ void ESPGizmo::schedulePublish(const char *topic, const char *payload) {
     schedulePublish(topic, payload, false);
 }
 
+void ESPGizmo::addControlGroup(const char *group) {
+    char groupTopic[MAX_TOPIC_SIZE];
+    snprintf(groupTopic, MAX_TOPIC_SIZE, GIZMO_GROUP_CONTROL_TOPIC, group);
+    for (int i = 0; i < controlGroupCount; i++) {
+        if (!strcmp(groupControlTopics[i], groupTopic)) {
+            return;
+        }
+    }
+    if (controlGroupCount < MAX_CONTROL_GROUPS) {
+        strncpy(groupControlTopics[controlGroupCount], groupTopic, MAX_TOPIC_SIZE - 1);
+        controlGroupCount = controlGroupCount + 1;
+        if (mqtt && mqtt->connected()) {
+            mqtt->subscribe(groupTopic);
+        }
+    }
+}
+
+void ESPGizmo::setLegacyControl(bool enabled) {
+    if (legacyControl != enabled && mqtt && mqtt->connected()) {
+        if (enabled) {
+            mqtt->subscribe(GIZMO_CONTROL_TOPIC);
+        } else {
+            mqtt->unsubscribe(GIZMO_CONTROL_TOPIC);
+        }
+    }
+    legacyControl = enabled;
+}
+
+#if GIZMO_WITH_MULTICAST
+void ESPGizmo::enableMulticastControl(const char *secret) {
+    if (!lanControl) {
+        lanControl = new GizmoMulticast(secret);
+        lanControl->setCallback([this](const char *topic, const uint8_t *payload, unsigned int length) {
+            handleLocalMessage(topic, payload, length);
+        });
+        if (networkState != NETWORK_DISCONNECTED) {
+            lanControl->begin();
+        }
+    }
+}
+
+bool ESPGizmo::multicast(const char *topic, const char *payload) {
+    char tt[MAX_TOPIC_SIZE];
+    if (strstr(topic, "%s")) {
+        snprintf(tt, MAX_TOPIC_SIZE, topic, getTopicPrefix());
+        topic = tt;
+    }
+    if (!lanControl || networkState == NETWORK_DISCONNECTED) {
+        return false;
+    }
+    bool sent = lanControl->send(topic, (const uint8_t *) payload, strlen(payload),
+                                 clock && clock->isSynced() ? clock->now() / 1000 : 0);
+    // Our own datagrams are not looped back, so act on this one here like everyone else.
+    handleLocalMessage(topic, (const uint8_t *) payload, strlen(payload));
+    return sent;
+}
+
+GizmoMulticast *ESPGizmo::multicastChannel() {
+    return lanControl;
+}
+#endif
+
+static boolean isControlTopic(const char *topic) {
+    if (!strcmp(topic, deviceControlTopic)) {
+        return true;
+    }
+    for (int i = 0; i < controlGroupCount; i++) {
+        if (!strcmp(topic, groupControlTopics[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ESPGizmo::handleControlCommand(const char *command) {
+    if (!strcmp(command, "version")) {
+        schedulePublish((char *) GIZMO_CONSOLE_TOPIC, announceMessage, false);
+    } else if (!strcmp(command, "update")) {
+        scheduleUpdate();
+    } else if (!strcmp(command, "fileUpdate")) {
+        scheduleFileUpdate();
+    } else if (!strcmp(command, "restart") || !strcmp(command, "reset")) {
+        scheduleRestart();
+    } else if (!strcmp(command, "online on")) {
+        setAlwaysOnline(true);
+    } else if (!strcmp(command, "online off")) {
+        setAlwaysOnline(false);
+    } else if (!strcmp(command, "debug=y") || !strcmp(command, "debug=n")) {
+        debugEnabled = command[6] == 'y';
+#if GIZMO_WITH_FAULTS
+    } else if (!strncmp(command, "fault ", 6)) {
+        injectFault(command + 6);
+#endif
+    }
+}
+
 void ESPGizmo::handleMQTTMessage(const char *topic, const char *value) {
-    if (!strcmp(topic, GIZMO_CONTROL_TOPIC)) {
+    if (isControlTopic(topic)) {
+        // Already addressed by topic, so the command carries no target name.
+        handleControlCommand(value);
+    } else if (legacyControl && !strcmp(topic, GIZMO_CONTROL_TOPIC)) {
         if (!strcmp(value, "version")) {
             schedulePublish((char *) GIZMO_CONSOLE_TOPIC, announceMessage, false);
         } else if (!strncmp(value, "update ", 7) &&
@@ -242,18 +686,24 @@ bool ESPGizmo::publishBinarySensor(bool nv, bool ov, const char *topic) {
 }
 
 void ESPGizmo::debug(const char *fmt, ...) {
-    if (debugEnabled) {
+    if (debugEnabled || (server && server->eventClients())) {
+        GizmoScratch line(300);
+        if (!line.size()) {
+            return;
+        }
         va_list argList;
         va_start(argList, fmt);
-        char dmsg[256];
-        dmsg[0] = '\0';
-        vsnprintf(dmsg, 255, fmt, argList);
+        int l = snprintf(line.chars(), line.size(), "%s: ", getHostname());
+        char *dmsg = line.chars() + l;
+        vsnprintf(dmsg, line.size() - l, fmt, argList);
         va_end(argList);
 
-        char line[300];
-        line[0] = '\0';
-        snprintf(line, 299, "%s: %s", getHostname(), dmsg);
-        publish("gizmo/console", line);
+        if (server && server->eventClients()) {
+            server->sendEvent("log", dmsg);
+        }
+        if (debugEnabled) {
+            publish("gizmo/console", line.chars());
+        }
     }
 }
 
@@ -265,11 +715,125 @@ void ESPGizmo::alwaysOnline() {
     isAlwaysOnline = true;
 }
 
+void ESPGizmo::asyncHTTP() {
+    asyncHTTPEnabled = true;
+}
+
+void ESPGizmo::fastBoot() {
+    fastBootEnabled = true;
+}
+
+void ESPGizmo::markBoot(const char *phase) {
+    if (!bootReported) {
+        bootMark(phase);
+    }
+}
+
+void ESPGizmo::publishBootTimeline() {
+    char topic[MAX_TOPIC_SIZE], timeline[MAX_ANNOUNCE_MESSAGE_SIZE * 2];
+    bootReported = true;
+    int l = snprintf(timeline, sizeof(timeline), "%s%s ", ESP.getResetReason().c_str(), fastBootEnabled ? " fast" : "");
+    bootTimeline(timeline + l, sizeof(timeline) - l);
+    snprintf(topic, MAX_TOPIC_SIZE, GIZMO_BOOT_TOPIC, getTopicPrefix());
+    publish(topic, timeline, false);
+}
+
+void ESPGizmo::publishStallReports() {
+    char topic[MAX_TOPIC_SIZE], report[MAX_ANNOUNCE_MESSAGE_SIZE];
+    GizmoStallRecord stall;
+    snprintf(topic, MAX_TOPIC_SIZE, GIZMO_WATCHDOG_TOPIC, getTopicPrefix());
+    if (!bootReported) {
+        // Published once, along with the boot timeline.
+        if (watchdogBlame(&stall)) {
+            // A stage that never yielded before the reset has no recorded duration.
+            snprintf(report, sizeof(report), "reset stage=%s duration=%s%u deadline=%u uptime=%u reason=%s",
+                     stall.stage, stall.duration ? "" : ">", stall.duration ? stall.duration : stall.deadline,
+                     stall.deadline, stall.started, ESP.getResetReason().c_str());
+            publish(topic, report, true);
+        }
+    } else if (gizmoUptime() - lastStallReport > STALL_REPORT_INTERVAL && watchdogTakeOverrun(&stall)) {
+        lastStallReport = gizmoUptime();
+        snprintf(report, sizeof(report), "overrun stage=%s duration=%u deadline=%u uptime=%u count=%u",
+                 stall.stage, stall.duration, stall.deadline, stall.started, watchdogOverruns());
+        publish(topic, report, false);
+    }
+}
+
+void ESPGizmo::coalescePublishes(uint16_t maxBytes, uint16_t maxDelay) {
+    coalesceBytes = maxBytes;
+    coalesceDelay = maxDelay;
+}
+
+GizmoCoalescingClient *ESPGizmo::publishCoalescer() {
+    return coalescer;
+}
+
+#if GIZMO_WITH_BROKER
+void ESPGizmo::enableLocalBroker() {
+    brokerEnabled = true;
+}
+
+GizmoBroker *ESPGizmo::localBroker() {
+    return broker;
+}
+#endif
+
+#if GIZMO_WITH_TLS
+GizmoSecureClient *ESPGizmo::mqttSecureClient() {
+    return secureClient;
+}
+#endif
+
+WiFiClient &ESPGizmo::mqttSocket() {
+#if GIZMO_WITH_TLS
+    if (secureClient) {
+        return *secureClient;
+    }
+#endif
+    return wifiClient;
+}
+
+Client &ESPGizmo::mqttTransport() {
+    if (coalescer) {
+        return *coalescer;
+    }
+    return mqttSocket();
+}
+
+void ESPGizmo::setDutyCycle(uint32_t sleepSeconds) {
+    dutyCycleSeconds = sleepSeconds;
+}
+
+void ESPGizmo::setSleepBackend(const GizmoSleepBackend *backend) {
+    sleepBackend = backend;
+}
+
+uint32_t ESPGizmo::getWakeCount() {
+    return rtcState.wakeCount;
+}
+
+uint32_t ESPGizmo::getSequence() {
+    return rtcState.sequence;
+}
+
 void ESPGizmo::beginSetup(const char *_name, const char *_version, const char *_passkey) {
     Serial.begin(115200);
     pinMode(LED, OUTPUT);
     led(true);
-    SPIFFS.begin();
+    bootMark("start");
+
+    if (dutyCycleSeconds) {
+        if (!loadRTCState(sleepBackend, &rtcState)) {
+            Serial.printf("No valid RTC state; starting cold\n");
+        }
+        rtcState.wakeCount++;
+        awakeDeadline = gizmoUptime() + DUTY_CYCLE_AWAKE_TIMEOUT;
+    }
+    watchdogBegin(sleepBackend);
+    watchdogStage("setup", WATCHDOG_LONG_DEADLINE);
+
+    filesMigrated = beginFileSystem() == FS_MIGRATED;
+    bootMark("fs");
 
     initToSaneValues();
 
@@ -279,20 +843,30 @@ void ESPGizmo::beginSetup(const char *_name, const char *_version, const char *_
     Serial.printf("\n\n%s version %s\n\n", name, version);
 
     readCustomPasskey(_passkey);
+    servicesDeferred = fastBootEnabled && !dutyCycleSeconds;
 
     setupWiFi();
+    bootMark("wifi");
 
     // Latch the WiFi as configured on first setup after booting.
     wifiConfigured = strlen(ssid);
 
     setupMQTT();
-    setupOTA();
+    bootMark("mqtt");
     setupHTTPServer();
-    setupAlwaysOnline();
+    bootMark("http");
+    if (!dutyCycleSeconds) {
+#if GIZMO_WITH_OTA
+        if (!servicesDeferred) {
+            setupOTA();
+        }
+#endif
+        setupAlwaysOnline();
+    }
 }
 
 void ESPGizmo::readCustomPasskey(const char *defaultPasskey) {
-    File f = SPIFFS.open(CUSTOM_PASSKEY, "r");
+    File f = gizmoFS().open(CUSTOM_PASSKEY, "r");
     if (f) {
         int l = f.readBytesUntil('\n', passkeyLocal, MAX_PASSKEY_SIZE - 1);
         passkeyLocal[l] = '\0';
@@ -303,35 +877,88 @@ void ESPGizmo::readCustomPasskey(const char *defaultPasskey) {
     }
 }
 
+void ESPGizmo::setupTime(const char *server, int16_t offsetMinutes, const GizmoDSTRule *dstRule) {
+    if (!clock) {
+        clock = new GizmoTime();
+    }
+    clock->addServer(server);
+    clock->setTimeZone(offsetMinutes, dstRule);
+}
+
 void ESPGizmo::setupNTPClient() {
-    ntpClient = new NTPClient(ntpUDP, "pool.ntp.org", -7 * 3600);
+    // Kept for existing sketches, which expect pool.ntp.org with a -7 hour offset.
+    setupTime(NTP_DEFAULT_SERVER, -7 * 60, NULL);
 }
 
 void ESPGizmo::endSetup() {
-    offlineTime = strlen(getSSID()) ? millis() + OFFLINE_TIMEOUT : millis();
+    if (dutyCycleSeconds) {
+        // The awake deadline replaces the offline grace period; there is no AP to fall back to.
+        offlineTime = 0;
+        return;
+    }
+    offlineTime = strlen(getSSID()) ? gizmoUptime() + OFFLINE_TIMEOUT : gizmoUptime();
     server->begin();
     Serial.println("HTTP server started");
+    bootMark("setup");
+}
+
+bool ESPGizmo::queueReading(const char *topic, const char *payload) {
+    return queueRTCReading(&rtcState, topic, payload);
+}
+
+void ESPGizmo::publishQueuedReadings() {
+    if (!(mqttConfigured && mqtt && mqtt->connected())) {
+        return;
+    }
+    uint32_t queued = rtcState.readingCount;
+    uint32_t sent = publishRTCReadings(&rtcState, [this](const char *topic, const char *payload) {
+        return sendPublish(topic, payload, false);
+    });
+    if (sent < queued) {
+        Serial.printf("Kept %u of %u queued readings for the next wake\n", queued - sent, queued);
+    }
+}
+
+void ESPGizmo::sleep() {
+    if (mqtt && mqtt->connected()) {
+        mqtt->disconnect();
+    }
+    rtcState.lastAwakeTime = millis();
+    saveRTCState(sleepBackend, &rtcState);
+    Serial.printf("Sleeping for %u seconds after %u ms awake\n", dutyCycleSeconds, rtcState.lastAwakeTime);
+    sleepBackend->deepSleep((uint64_t) dutyCycleSeconds * 1000000);
+}
+
+void ESPGizmo::handleAwakeDeadline() {
+    if (dutyCycleSeconds && awakeDeadline < gizmoUptime()) {
+        Serial.printf("Unable to get online within %u ms\n", DUTY_CYCLE_AWAKE_TIMEOUT);
+        // Distrust whatever part of the cached network state got us stuck; readings stay queued.
+        if (WiFi.status() != WL_CONNECTED) {
+            rtcState.flags &= ~RTC_FLAG_NETWORK;
+        }
+        rtcState.flags &= ~RTC_FLAG_BROKER;
+        sleep();
+    }
 }
 
 void ESPGizmo::scheduleRestart() {
     Serial.printf("Scheduling restart\n");
-    restartTime = millis() + 1500;
+    restartTime = gizmoUptime() + 1500;
 }
 
 void ESPGizmo::scheduleUpdate() {
     Serial.printf("Scheduling update\n");
-    updateTime = millis() + 1500;
+    updateTime = gizmoUptime() + 1500;
 }
 
 void ESPGizmo::scheduleFileUpdate() {
     Serial.printf("Scheduling file update\n");
-    fileUpdateTime = millis() + 1500;
+    fileUpdateTime = gizmoUptime() + 1500;
 }
 
 void ESPGizmo::handleRoot() {
-    File f = SPIFFS.open("/index.html", "r");
-    server->streamFile(f, "text/html");
-    f.close();
+    File f = gizmoFS().open("/index.html", "r");
+    server->sendFile(f, "text/html", NULL, false);
 }
 
 void ESPGizmo::handleNetworkScanPage() {
@@ -353,6 +980,7 @@ void ESPGizmo::handleNetworkScanPage() {
     fssid[0] = '\0';
 
     char cssid[64];
+    GizmoStage scan("scan", WATCHDOG_LONG_DEADLINE);
     int n = WiFi.scanNetworks();
     for (int i = 0; i < n; i++) {
         strncpy(cssid, WiFi.SSID(i).c_str(), 63);
@@ -377,21 +1005,87 @@ void ESPGizmo::handleNetworkScanPage() {
     server->sendContent(strlen(ssid) ? ssid : fssid);
     server->sendContent("\" size=\"30\"><h3>Password</h3><input type=\"password\" name=\"pass\" value=\"");
     if (strlen(passkey)) server->sendContent(passkey);
-    server->sendContent("\" size=\"30\"><p><h3>IP Address</h3>");
-    server->sendContent(disconnected ? "not connected" : WiFi.localIP().toString().c_str());
+    server->sendContent("\" size=\"30\"><p><h3>Static IP</h3><input type=\"text\" name=\"ip\" placeholder=\"DHCP\" value=\"");
+    if (staticIP.isSet()) server->sendContent(staticIP.toString().c_str());
+    server->sendContent("\" size=\"15\"><h3>Gateway</h3><input type=\"text\" name=\"gw\" value=\"");
+    if (staticIP.isSet()) server->sendContent(staticGateway.toString().c_str());
+    server->sendContent("\" size=\"15\"><h3>Subnet Mask</h3><input type=\"text\" name=\"mask\" value=\"");
+    if (staticIP.isSet()) server->sendContent(staticMask.toString().c_str());
+    server->sendContent("\" size=\"15\"><h3>DNS</h3><input type=\"text\" name=\"dns\" value=\"");
+    if (staticIP.isSet()) server->sendContent(staticDNS.toString().c_str());
+    server->sendContent("\" size=\"15\"><p><h3>IP Address</h3>");
+    server->sendContent(networkState == NETWORK_DISCONNECTED ? "not connected" : WiFi.localIP().toString().c_str());
     server->sendContent("<p><p><h3>MAC Address</h3>");
     server->sendContent(getMAC());
     server->sendContent("<p><input type=\"submit\" value=\"Apply Changes\"></form>");
+
+    server->sendContent("<h3>Known Networks</h3><pre>");
+    for (int i = 0; i < networks.count(); i++) {
+        char line[128];
+        GizmoNetwork *network = networks.get(i);
+        snprintf(line, 127, "%-32s %3d %4d dBm %u/%u %s\n", network->ssid, network->priority,
+                 network->rssi, network->attempts - network->failures, network->attempts,
+                 network->primary ? "" : "<a href=\"/netdel?net=");
+        server->sendContent(line);
+        if (!network->primary) {
+            server->sendContent(network->ssid);
+            server->sendContent("\">remove</a>");
+        }
+    }
+    server->sendContent("</pre><form action=\"/netadd\"><input type=\"text\" name=\"net\" placeholder=\"Network\" size=\"20\">");
+    server->sendContent("<input type=\"password\" name=\"pass\" placeholder=\"Password\" size=\"20\">");
+    server->sendContent("<input type=\"text\" name=\"prio\" placeholder=\"Priority\" size=\"4\">");
+    server->sendContent("<input type=\"submit\" value=\"Add\"></form>");
     server->sendContent(HTML_END);
     server->sendContent("");
 }
 
+void ESPGizmo::handleNetworkAdd() {
+    char netSSID[MAX_SSID_SIZE], netPasskey[MAX_PASSKEY_SIZE];
+    netSSID[0] = netPasskey[0] = '\0';
+    strncat(netSSID, server->arg("net").c_str(), MAX_SSID_SIZE - 1);
+    strncat(netPasskey, server->arg("pass").c_str(), MAX_PASSKEY_SIZE - 1);
+    if (strlen(netSSID) && addNetwork(netSSID, netPasskey, server->arg("prio").toInt())) {
+        Serial.printf("Added network %s\n", netSSID);
+    }
+    server->sendHeader("Location", "/nets");
+    server->send(302, "text/plain", "");
+}
+
+void ESPGizmo::handleNetworkRemove() {
+    if (removeNetwork(server->arg("net").c_str())) {
+        Serial.printf("Removed network %s\n", server->arg("net").c_str());
+    }
+    server->sendHeader("Location", "/nets");
+    server->send(302, "text/plain", "");
+}
+
 void ESPGizmo::handleNetworkConfig() {
+    char oldHostname[MAX_SSID_SIZE];
+    strncpy(oldHostname, hostname, MAX_SSID_SIZE);
     strncpy(hostname, server->arg("name").c_str(), MAX_SSID_SIZE - 1);
     strncpy(ssid, server->arg("net").c_str(), MAX_SSID_SIZE - 1);
     strncpy(passkey, server->arg("pass").c_str(), MAX_PASSKEY_SIZE - 1);
+    staticIP = IPAddress();
+    if (staticIP.fromString(server->arg("ip").c_str())) {
+        staticGateway = IPAddress();
+        staticGateway.fromString(server->arg("gw").c_str());
+        if (!staticMask.fromString(server->arg("mask").c_str())) {
+            staticMask = IPAddress(255, 255, 255, 0);
+        }
+        if (!staticDNS.fromString(server->arg("dns").c_str())) {
+            staticDNS = staticGateway;
+        }
+    } else {
+        staticIP = IPAddress();
+    }
     Serial.printf("Reconfiguring for connection to %s\n", ssid);
 
+    // A new hostname renames the access point and mDNS name, and the first network
+    // configured switches the AP from visible to hidden; both still need a restart.
+    // So does clearing the network, which brings the visible AP-only portal back.
+    bool restartNeeded = !wifiConfigured || !strlen(ssid) || strcmp(hostname, oldHostname);
+
     server->setContentLength(CONTENT_LENGTH_UNKNOWN);
     server->send(200, "text/html", HTML_HEAD);
     server->sendContent("Network Configured");
@@ -405,13 +1099,17 @@ void ESPGizmo::handleNetworkConfig() {
     server->sendContent(HTML_MENU);
     server->sendContent("<p>Reconfigured WiFi for connection to ");
     if (strlen(ssid)) server->sendContent(ssid);
-    server->sendContent(". Restarting...</p>");
+    server->sendContent(restartNeeded ? ". Restarting...</p>" : ". Reconnecting...</p>");
     server->sendContent(HTML_END);
     server->sendContent("");
 
     saveNetworkConfig();
-    WiFi.disconnect(true);
-    scheduleRestart();
+    if (restartNeeded) {
+        WiFi.disconnect(true);
+        scheduleRestart();
+    } else {
+        scheduleApply(APPLY_NETWORK);
+    }
 }
 
 void ESPGizmo::handleEraseConfig() {
@@ -432,8 +1130,10 @@ void ESPGizmo::handleEraseConfig() {
     server->sendContent(HTML_END);
     server->sendContent("");
 
-    SPIFFS.remove("/cfg/wifi");
-    SPIFFS.remove("/cfg/mqtt");
+    gizmoFS().remove("/cfg/wifi");
+    gizmoFS().remove(FAST_CONNECT);
+    gizmoFS().remove(NETWORKS_CONFIG);
+    gizmoFS().remove("/cfg/mqtt");
     WiFi.disconnect(true);
     scheduleRestart();
 }
@@ -449,6 +1149,13 @@ void ESPGizmo::handleMQTTPage() {
     server->sendContent(HTML_BODY);
     server->sendContent("MQTT Setup");
     server->sendContent(HTML_MENU);
+    server->sendContent(mqtt && mqtt->connected() ? "<p>Connected to broker</p>" :
+                        pendingApply ? "<p>Applying changes...</p>" : "<p>Not connected to broker</p>");
+#if GIZMO_WITH_TLS
+    if (secureClient && !secureClient->trusted) {
+        server->sendContent("<p>TLS needs a broker fingerprint or CA certificate; not connecting until one is set</p>");
+    }
+#endif
 
     server->sendContent("<form action=\"/mqttcfg\"><h3>MQTT Host</h3><input type=\"text\" name=\"host\" value=\"");
     if (strlen(mqttHost)) server->sendContent(mqttHost);
@@ -461,7 +1168,15 @@ void ESPGizmo::handleMQTTPage() {
     if (strlen(mqttPass)) server->sendContent(mqttPass);
     server->sendContent("\" size=\"30\"><p><h3>Topic Prefix</h3><input type=\"text\" name=\"prefix\" value=\"");
     if (strlen(topicPrefix)) server->sendContent(topicPrefix);
-    server->sendContent("\" size=\"30\"><p><input type=\"submit\" value=\"Apply Changes\"></form>");
+    server->sendContent("\" size=\"30\"><p><h3>TLS</h3><input type=\"checkbox\" name=\"tls\" value=\"1\"");
+    if (mqttTLS) server->sendContent(" checked");
+    server->sendContent("> Encrypt connection<p><h3>Broker Fingerprint (SHA-1)</h3><input type=\"text\" name=\"fp\" value=\"");
+    if (strlen(mqttFingerprint)) server->sendContent(mqttFingerprint);
+    server->sendContent("\" size=\"30\"><br><small>Leave empty to verify against " MQTT_CA_FILE "</small>");
+    server->sendContent("<p><input type=\"submit\" value=\"Apply Changes\"></form>");
+    server->sendContent("<form method=\"post\" action=\"/upload?path=" MQTT_CA_FILE "\" enctype=\"multipart/form-data\">"
+                        "<h3>Broker CA Certificate (PEM)</h3><input type=\"file\" name=\"ca\">"
+                        "<input type=\"submit\" value=\"Upload\"></form>");
     server->sendContent(HTML_END);
     server->sendContent("");
 }
@@ -474,6 +1189,8 @@ void ESPGizmo::handleMQTTConfig() {
     strncpy(mqttUser, server->arg("user").c_str(), MAX_MQTT_USER_SIZE - 1);
     strncpy(mqttPass, server->arg("pass").c_str(), MAX_MQTT_PASS_SIZE - 1);
     strncpy(topicPrefix, server->arg("prefix").c_str(), MAX_SSID_SIZE - 1);
+    mqttTLS = server->arg("tls") == "1";
+    strncpy(mqttFingerprint, server->arg("fp").c_str(), MAX_MQTT_FINGERPRINT_SIZE - 1);
     Serial.printf("Reconfiguring for connection to %s\n", mqttHost);
 
     server->setContentLength(CONTENT_LENGTH_UNKNOWN);
@@ -489,13 +1206,12 @@ void ESPGizmo::handleMQTTConfig() {
     server->sendContent(HTML_MENU);
     server->sendContent("<p>Reconfigured MQTT for connection to ");
     if (strlen(mqttHost)) server->sendContent(mqttHost);
-    server->sendContent(". Restarting...</p>");
+    server->sendContent(". Reconnecting...</p>");
     server->sendContent(HTML_END);
     server->sendContent("");
 
     saveMQTTConfig();
-    WiFi.disconnect(true);
-    scheduleRestart();
+    scheduleApply(APPLY_MQTT);
 }
 
 void ESPGizmo::handlePasskey() {
@@ -513,8 +1229,105 @@ void ESPGizmo::handlePasskey() {
     server->send(200, "text/plain", psk);
 
     savePasskey(psk);
-    WiFi.disconnect(true);
-    scheduleRestart();
+    strncpy(passkeyLocal, psk, MAX_PASSKEY_SIZE - 1);
+    scheduleApply(APPLY_PASSKEY);
+}
+
+void ESPGizmo::scheduleApply(uint8_t what) {
+    pendingApply |= what;
+    applyTime = gizmoUptime() + CONFIG_APPLY_DELAY;
+}
+
+void ESPGizmo::applyPendingConfig() {
+    uint8_t what = pendingApply;
+    pendingApply = 0;
+    applyTime = 0;
+
+    if (what & APPLY_PASSKEY) {
+        // The access point only stays up while no network is configured; otherwise the
+        // new passkey takes effect whenever it next starts.
+        if (!networks.count()) {
+            WiFi.softAP(hostname, passkeyLocal, WIFI_CHANNEL, false, MAX_CONNECTIONS);
+        }
+        snprintf(configReport, MAX_ANNOUNCE_MESSAGE_SIZE, "%s applied new passkey", hostname);
+    }
+    if (what & APPLY_NETWORK) {
+        applyNetworkConfig();
+    }
+    if (what & APPLY_MQTT) {
+        applyMQTTConfig();
+    }
+    sendStateEvent("config applied");
+
+    if (mqtt && mqtt->connected() && configReport[0]) {
+        publish(GIZMO_CONSOLE_TOPIC, configReport, false);
+        configReport[0] = '\0';
+    }
+}
+
+void ESPGizmo::applyNetworkConfig() {
+    Serial.printf("Reassociating with %s\n", ssid);
+    snprintf(configReport, MAX_ANNOUNCE_MESSAGE_SIZE, "%s applied network config for %s", hostname, ssid);
+
+    networks.clear();
+    networks.add(ssid, passkey, 0, true);
+    networks.load(gizmoFS());
+    if (!networks.count()) {
+        // Nothing left to join; only a restart brings the visible access point back.
+        Serial.printf("No networks configured; restarting\n");
+        scheduleRestart();
+        return;
+    }
+    rtcState.flags &= ~RTC_FLAG_NETWORK;
+    fastConnectDeadline = 0;
+    networkDeadline = 0;
+    triedNetworks = 0;
+    currentNetwork = -1;
+
+    // Keep the radio on; the saved network config is all that needs to change.
+    WiFi.disconnect(false);
+    selectNetwork();
+}
+
+void ESPGizmo::applyMQTTConfig() {
+    Serial.printf("Reconnecting to MQTT server %s\n", mqttHost);
+    snprintf(configReport, MAX_ANNOUNCE_MESSAGE_SIZE, "%s applied MQTT config for %s:%d%s",
+             hostname, mqttHost, mqttPort, mqttTLS ? " over TLS" : "");
+
+    if (streaming) {
+        // Finishes a stream that was fully written, or abandons it with the session.
+        endPublish();
+    }
+    if (mqtt) {
+        if (mqtt->connected()) {
+            mqtt->disconnect();
+        }
+        delete mqtt;
+        mqtt = NULL;
+    }
+    // The transport depends on the TLS settings, so rebuild it from scratch.
+    delete coalescer;
+    coalescer = NULL;
+#if GIZMO_WITH_TLS
+    delete secureClient;
+    secureClient = NULL;
+#endif
+    rtcState.flags &= ~RTC_FLAG_BROKER;
+
+    mqttConfigured = strlen(mqttHost);
+    if (mqttConfigured) {
+        if (strlen(topicPrefix)) {
+            addControlGroup(topicPrefix);
+        }
+        setupMQTTTransport();
+        if (networkState != NETWORK_DISCONNECTED) {
+            createMQTTClient();
+        }
+        lastReconnectAttempt = millis() - MQTT_RECONNECT_FREQUENCY - 1;
+    }
+    if (networkState != NETWORK_DISCONNECTED) {
+        setNetworkState(mqttConfigured ? NETWORK_WIFI : NETWORK_ONLINE);
+    }
 }
 
 void ESPGizmo::handleUpdate() {
@@ -601,12 +1414,23 @@ void ESPGizmo::handleReset() {
 }
 
 void listDir(ESP8266WebServer *server, const char *path) {
-    Dir dir = SPIFFS.openDir(path);
+    Dir dir = gizmoFS().openDir(path);
     while (dir.next()) {
         char line[128];
         char name[48];
-        name[0] = '\0';
-        strncat(name, dir.fileName().c_str(), 47);
+        String fileName = dir.fileName();
+        if (fileName.c_str()[0] == '/') {
+            name[0] = '\0';
+            strncat(name, fileName.c_str(), 47);
+        } else {
+            snprintf(name, 48, "%s%s%s", path, path[strlen(path) - 1] == '/' ? "" : "/", fileName.c_str());
+        }
+#ifdef GIZMO_LITTLEFS
+        if (dir.isDirectory()) {
+            listDir(server, name);
+            continue;
+        }
+#endif
         Serial.printf("%s\t%d\n", name, dir.fileSize());
         snprintf(line, 127, "%-32s %8d<br>", name, dir.fileSize());
         server->sendContent(line);
@@ -624,7 +1448,7 @@ void ESPGizmo::handleFiles() {
     server->sendContent(HTML_MENU);
     server->sendContent("<pre>");
 
-    listDir(server, "");
+    listDir(server, "/");
 
     server->sendContent("</pre>");
     server->sendContent("<p><form action=\"/dofileupdate\"><input type=\"submit\" value=\"Update Files\"></form>");
@@ -638,8 +1462,12 @@ void ESPGizmo::handleFiles() {
     server->sendContent("");
 }
 
-static File uploadFile;
-static uint32_t uploadSize;
+static GizmoFlashWriter *uploadWriter = NULL;
+static GizmoTarExtractor *uploadExtractor = NULL;
+static uint32_t uploadStart;
+static uint32_t uploadChunks;
+static int uploadStatus = 200;
+static bool uploadIsCA = false;
 
 void ESPGizmo::preUpload() {
     if (onUpdate) {
@@ -649,36 +1477,227 @@ void ESPGizmo::preUpload() {
 }
 
 void ESPGizmo::startUpload() {
-    server->send(200, "text/plain", "");
+    // Called once all parts of the request have been received.
+    server->send(uploadStatus, "text/plain", uploadStatus == 200 ? "" : "upload failed");
+    uploadStatus = 200;
 }
 
 void ESPGizmo::handleUpload() {
-    static char name[64];
-
     HTTPUpload &upload = server->upload();
-    snprintf(name, 63, "/%s", upload.filename.c_str());
-    Serial.printf("Uploading %s... phase %d, total=%u, current=%u, name=%s, type=%s\n",
-                  name, upload.status, upload.totalSize, upload.currentSize,
-                  upload.name.c_str(), upload.type.c_str());
 
     if (upload.status == UPLOAD_FILE_START) {
+        GizmoScratch lease(MAX_UPLOAD_NAME);
+        char *name = lease.chars();
+        if (!lease.size()) {
+            uploadStatus = 500;
+            return;
+        }
+        // Files land in the root; the broker CA is the one file that may be sent to /cfg.
+        String path = server->arg("path");
+        if (path.length()) {
+            snprintf(name, lease.size(), "%s", path.c_str());
+        } else {
+            snprintf(name, lease.size(), "/%s", upload.filename.c_str());
+        }
+        if (strcmp(name, MQTT_CA_FILE) && (path.length() || !isUserFilePath(name))) {
+            Serial.printf("Refusing upload to %s\n", name);
+            uploadStatus = 400;
+            return;
+        }
+        makeParentDirs(name);
+        uploadIsCA = !strcmp(name, MQTT_CA_FILE);
         Serial.printf("Starting upload for %s\n", name);
-        uploadFile = SPIFFS.open(name, "w");
-        if (!uploadFile) {
-            Serial.printf("Upload failed to open destination file\n");
+        // The whole upload arrives within this one request.
+        watchdogStage("upload", WATCHDOG_LONG_DEADLINE);
+        uploadStart = millis();
+        uploadChunks = 0;
+
+        if (isGzipFile(name)) {
+            // Inflating needs a 32KB window, more than we can spare.
+            Serial.printf("Compressed uploads are not supported\n");
+            uploadStatus = 415;
+        } else if (isTarFile(name)) {
+            uploadExtractor = new GizmoTarExtractor(&gizmoFS());
+        } else {
+            uploadWriter = new GizmoFlashWriter();
+            if (!uploadWriter->open(&gizmoFS(), name)) {
+                Serial.printf("Upload failed to open destination file\n");
+                delete uploadWriter;
+                uploadWriter = NULL;
+                uploadStatus = 500;
+            }
         }
-        uploadSize = 0;
 
     } else if (upload.status == UPLOAD_FILE_WRITE) {
-        if (uploadFile) {
-            uploadSize += uploadFile.write(upload.buf, upload.currentSize);
+        uploadChunks++;
+        if (uploadExtractor) {
+            uploadExtractor->write(upload.buf, upload.currentSize);
+        } else if (uploadWriter) {
+            uploadWriter->write(upload.buf, upload.currentSize);
+        }
+
+    } else if (upload.status == UPLOAD_FILE_END || upload.status == UPLOAD_FILE_ABORTED) {
+        bool aborted = upload.status == UPLOAD_FILE_ABORTED;
+        uint32_t elapsed = millis() - uploadStart;
+        if (uploadExtractor) {
+            if (aborted || !uploadExtractor->end()) {
+                uploadStatus = 500;
+            }
+            Serial.printf("Extracted %u files, skipped %u, from %u bytes in %u chunks, %u ms\n",
+                          uploadExtractor->files, uploadExtractor->skipped, upload.totalSize, uploadChunks, elapsed);
+            delete uploadExtractor;
+            uploadExtractor = NULL;
+        } else if (uploadWriter) {
+            if (aborted) {
+                uploadWriter->abort();
+            }
+            if (aborted || !uploadWriter->commit() || uploadWriter->written != upload.totalSize) {
+                uploadStatus = 500;
+            }
+            Serial.printf("Uploaded %u bytes in %u chunks, %u ms\n", uploadWriter->written, uploadChunks, elapsed);
+            delete uploadWriter;
+            uploadWriter = NULL;
+#if GIZMO_WITH_TLS
+            if (uploadIsCA && uploadStatus == 200 && secureClient) {
+                // Verify the broker against the new CA from the next connection on.
+                secureClient->setTrust(mqttFingerprint, gizmoFS(), MQTT_CA_FILE);
+            }
+#endif
+        }
+    }
+    yield();
+}
+
+// Firmware pushed as a multipart POST to /firmware?md5=<hex>[&size=<bytes>] is written
+// straight into the OTA partition as it arrives; it is only made bootable once the
+// whole image has arrived and its MD5 matches.
+#define FIRMWARE_PROGRESS_STEP  65536
+
+// A request that never delivers an image part is answered with the initial status.
+#define FIRMWARE_NO_IMAGE_STATUS    400
+#define FIRMWARE_NO_IMAGE_MESSAGE   "no image"
+
+static int firmwareStatus = FIRMWARE_NO_IMAGE_STATUS;
+static const char *firmwareMessage = FIRMWARE_NO_IMAGE_MESSAGE;
+static bool firmwareFlashed = false;
+// Only the first part of a request is taken; later ones are drained and ignored.
+static bool firmwarePartSeen = false;
+static bool firmwareIgnoring = false;
+static size_t firmwareSize = 0;
+static size_t firmwareReported = 0;
+
+static void failFirmwareUpload(int status, const char *message) {
+    if (firmwareStatus == 200) {
+        Serial.printf("Firmware upload failed: %s\n", message);
+        firmwareStatus = status;
+        firmwareMessage = message;
+    }
+}
+
+void ESPGizmo::finishFirmwareUpload() {
+    // Called once all parts of the request have been received. An image that passed
+    // Update.end() is committed and boots on restart whatever came after it.
+    if (firmwareFlashed) {
+        server->send(200, "text/plain", "OK");
+        char message[MAX_ANNOUNCE_MESSAGE_SIZE];
+        snprintf(message, sizeof(message), "%s firmware uploaded; restarting", hostname);
+        publish(GIZMO_CONSOLE_TOPIC, message, false);
+        scheduleRestart();
+    } else {
+        server->send(firmwareStatus, "text/plain", firmwareMessage);
+    }
+    firmwareStatus = FIRMWARE_NO_IMAGE_STATUS;
+    firmwareMessage = FIRMWARE_NO_IMAGE_MESSAGE;
+    firmwareFlashed = false;
+    firmwarePartSeen = false;
+    firmwareIgnoring = false;
+}
+
+void ESPGizmo::handleFirmwareUpload() {
+    HTTPUpload &upload = server->upload();
+    char progress[48];
+
+    if (upload.status == UPLOAD_FILE_START) {
+        firmwareIgnoring = firmwarePartSeen;
+        if (firmwareIgnoring) {
+            Serial.printf("Ignoring firmware part %s; one image per request\n", upload.filename.c_str());
+            return;
+        }
+        firmwarePartSeen = true;
+        watchdogStage("firmware", WATCHDOG_LONG_DEADLINE);
+        firmwareStatus = 200;
+        firmwareMessage = "OK";
+        firmwareReported = 0;
+        uploadStart = millis();
+        uploadChunks = 0;
+
+        String md5 = server->arg("md5");
+        firmwareSize = server->arg("size").toInt();
+        size_t space = (ESP.getFreeSketchSpace() - 0x1000) & 0xfffff000;
+        Serial.printf("Receiving firmware %s, %u bytes expected\n", upload.filename.c_str(), firmwareSize);
+
+        if (md5.length() != 32) {
+            failFirmwareUpload(400, "md5 digest required");
+        } else if (firmwareSize > space) {
+            failFirmwareUpload(413, "image too large");
+        } else if (Update.isRunning()) {
+            failFirmwareUpload(409, "update already in progress");
+        } else {
+            if (onUpdate) {
+                onUpdate();
+            }
+            if (!Update.begin(firmwareSize ? firmwareSize : space, U_FLASH) || !Update.setMD5(md5.c_str())) {
+                Update.printError(Serial);
+                failFirmwareUpload(500, "cannot start update");
+            }
+        }
+
+    } else if (firmwareIgnoring) {
+        // Drained without touching the outcome of the first part.
+    } else if (upload.status == UPLOAD_FILE_WRITE) {
+        uploadChunks++;
+        if (firmwareStatus == 200 && Update.write(upload.buf, upload.currentSize) != upload.currentSize) {
+            Update.printError(Serial);
+            failFirmwareUpload(500, "flash write failed");
+        }
+        if (firmwareStatus == 200 && upload.totalSize - firmwareReported >= FIRMWARE_PROGRESS_STEP) {
+            firmwareReported = upload.totalSize;
+            if (firmwareSize) {
+                snprintf(progress, sizeof(progress), "firmware %u%%", firmwareReported * 100 / firmwareSize);
+            } else {
+                snprintf(progress, sizeof(progress), "firmware %u bytes", firmwareReported);
+            }
+            Serial.printf("Received %s\n", progress);
+            if (server->eventClients()) {
+                server->sendEvent("firmware", progress);
+            }
         }
 
     } else if (upload.status == UPLOAD_FILE_END) {
-        if (uploadFile) {
-            uploadFile.close();
+        if (firmwareStatus != 200 && Update.isRunning()) {
+            Update.end(false);
+        } else if (firmwareStatus == 200 && !Update.end(true)) {
+            Update.printError(Serial);
+            if (Update.getError() == UPDATE_ERROR_MD5) {
+                failFirmwareUpload(422, "md5 digest mismatch");
+            } else {
+                failFirmwareUpload(500, "update failed");
+            }
+        } else if (firmwareStatus == 200) {
+            firmwareFlashed = true;
         }
-        Serial.printf("Uploaded %u bytes\n", uploadSize);
+        Serial.printf("Firmware upload of %u bytes in %u chunks, %u ms: %s\n",
+                      upload.totalSize, uploadChunks, millis() - uploadStart, firmwareMessage);
+        if (server->eventClients()) {
+            server->sendEvent("firmware", firmwareStatus == 200 ? "verified" : firmwareMessage);
+        }
+
+    } else if (upload.status == UPLOAD_FILE_ABORTED) {
+        if (Update.isRunning()) {
+            // Leaves the running image as the boot image.
+            Update.end(false);
+        }
+        failFirmwareUpload(500, "upload aborted");
     }
     yield();
 }
@@ -697,9 +1716,14 @@ void ESPGizmo::handleHotSpotDetect() {
         server->send(200, "text/html", "<HTML><HEAD><TITLE>Captive</TITLE></HEAD><BODY>Captive</BODY></HTML>");
         captiveCount++;
     } else if (captiveCount == 1) {
-        char buf[2048];
-        snprintf(buf, 2047, WELCOME_HTML, apIP.toString().c_str(), apIP.toString().c_str());
-        server->send(200, "text/html", buf);
+        // Room for the page and its two addresses; no more, so nested leases still fit the arena.
+        GizmoScratch buf(sizeof(WELCOME_HTML) + 2 * 16);
+        if (!buf.size()) {
+            server->send(503, "text/plain", "out of memory");
+            return;
+        }
+        snprintf(buf.chars(), buf.size(), WELCOME_HTML, apIP.toString().c_str(), apIP.toString().c_str());
+        server->send(200, "text/html", buf.chars());
         captiveCount++;
     } else {
         server->send(200, "text/html", "<HTML><HEAD><TITLE>Success</TITLE></HEAD><BODY>Success</BODY></HTML>");
@@ -732,15 +1756,38 @@ void ESPGizmo::setupWiFi() {
     WiFi.setAutoConnect(false);
     ssid[0] = '\0';
 
+    gotIPHandler = WiFi.onStationModeGotIP([](const WiFiEventStationModeGotIP &event) {
+        wifiGotIP = true;
+    });
+    disconnectedHandler = WiFi.onStationModeDisconnected([](const WiFiEventStationModeDisconnected &event) {
+        wifiLostReason = event.reason;
+        wifiLost = true;
+    });
+
     if (strlen(networkConfig)) {
         loadNetworkConfig();
     }
 
-    boolean isStation = strlen(ssid);
+    networks.clear();
+    currentNetwork = 0;
+    if (strlen(ssid)) {
+        networks.add(ssid, passkey, 0, true);
+        networks.load(gizmoFS());
+    }
+
+    boolean isStation = networks.count();
     if (isStation) {
-        Serial.printf("Attempting connection to %s\n", ssid);
         WiFi.persistent(false);
-        WiFi.begin(ssid, passkey);
+        if (loadFastConnect()) {
+            GizmoNetwork *network = networks.get(currentNetwork);
+            Serial.printf("Attempting fast connection to %s on channel %d\n", network->ssid, fastChannel);
+            network->attempts++;
+            applyIPConfig(true);
+            WiFi.begin(network->ssid, network->passkey, fastChannel, fastBSSID);
+            fastConnectDeadline = gizmoUptime() + FAST_CONNECT_TIMEOUT;
+        } else {
+            selectNetwork();
+        }
     } else {
         Serial.printf("No WiFi connection configured\n");
     }
@@ -761,6 +1808,16 @@ void ESPGizmo::setupWiFi() {
     snprintf(defaultWillTopic, MAX_WILL_TOPIC_SIZE, "%s", GIZMO_CONSOLE_TOPIC);
     snprintf(defaultWillMessage, MAX_WILL_MESSAGE_SIZE, "%s disconnected ", hostname);
 
+#if GIZMO_WITH_BROKER
+    setupLocalBroker(!isStation && !dutyCycleSeconds);
+#endif
+
+    if (dutyCycleSeconds && isStation) {
+        // Duty-cycled devices only ever publish; skip the AP and captive DNS entirely.
+        WiFi.mode(WIFI_STA);
+        return;
+    }
+
     // If we don't have an SSID configured to which to connect to,
     // start as a visible access point otherwise, start as a hidden access point/station
     WiFi.mode(isStation ? WIFI_AP_STA : WIFI_AP);
@@ -770,10 +1827,18 @@ void ESPGizmo::setupWiFi() {
     WiFi.softAPConfig(apIP, apIP, netMask);
     WiFi.softAP(hostname, passkeyLocal, WIFI_CHANNEL, isStation, MAX_CONNECTIONS);
 
-    dnsServer.start(DNS_PORT, "*", apIP);
+#if GIZMO_WITH_CAPTIVE_PORTAL
+    // Without a network to join, the captive portal is the only way in; never defer it.
+    captiveDeferred = servicesDeferred && isStation;
+    if (!captiveDeferred) {
+        dnsServer.start(DNS_PORT, "*", apIP);
+    }
+#endif
 
     Serial.printf("WiFi %s started with gateway IP %d.%d.%d.%d\n", hostname, apIP[0], apIP[1], apIP[2], apIP[3]);
-    delay(100);
+    if (!fastBootEnabled) {
+        delay(100);
+    }
 
     if (isStation) {
         Serial.printf("WiFi is hidden\n");
@@ -781,30 +1846,126 @@ void ESPGizmo::setupWiFi() {
     }
 }
 
+#if GIZMO_WITH_BROKER
+void ESPGizmo::setupLocalBroker(bool apOnly) {
+    if (brokerEnabled && apOnly && !broker) {
+        // Peers on the soft AP talk to us directly until a network is configured.
+        snprintf(deviceControlTopic, MAX_TOPIC_SIZE, GIZMO_DEVICE_CONTROL_TOPIC, hostname);
+        broker = new GizmoBroker(new GizmoWiFiBrokerListener(BROKER_PORT));
+        broker->setLocalCallback([this](const char *topic, const uint8_t *payload, unsigned int length) {
+            handleLocalMessage(topic, payload, length);
+        });
+        broker->begin();
+    } else if (!apOnly && broker) {
+        broker->stop();
+        delete broker;
+        broker = NULL;
+        Serial.println("Local MQTT broker stopped");
+    }
+}
+#endif
+
+// Messages that arrive without passing through the MQTT client: from the local broker
+// or the multicast channel.
+void ESPGizmo::handleLocalMessage(const char *topic, const uint8_t *payload, unsigned int length) {
+    // Hand over only what the device would have subscribed to on a real broker.
+    boolean subscribed = isControlTopic(topic) || (legacyControl && !strcmp(topic, GIZMO_CONTROL_TOPIC));
+    for (int i = 0; i < topicCount && !subscribed; i++) {
+        subscribed = gizmoTopicMatches(topics[i], topic);
+    }
+    if (!subscribed) {
+        return;
+    }
+
+    // Callbacks expect writable copies with room for a terminator, as PubSubClient gives them.
+    char tt[MAX_TOPIC_SIZE];
+    strncpy(tt, topic, MAX_TOPIC_SIZE - 1);
+    tt[MAX_TOPIC_SIZE - 1] = '\0';
+    GizmoScratch copy(length + 1);
+    if (copy.size()) {
+        memcpy(copy.bytes(), payload, length);
+        copy.bytes()[length] = '\0';
+        dispatchMQTTMessage(tt, copy.bytes(), length);
+    }
+}
+
 void ESPGizmo::setupMQTT() {
     loadMQTTConfig();
     if (mqttHost && strlen(mqttHost)) {
         Serial.printf("Attempting connection to MQTT server %s\n", mqttHost);
         mqttConfigured = true;
+        if (strlen(topicPrefix)) {
+            // Devices sharing a topic prefix form a control group, as legacy commands assumed.
+            addControlGroup(topicPrefix);
+        }
+        setupMQTTTransport();
     } else {
         Serial.println("No MQTT server configured");
     }
-    delay(100);
+    if (!dutyCycleSeconds && !fastBootEnabled) {
+        delay(100);
+    }
+}
+
+void ESPGizmo::setupMQTTTransport() {
+#if GIZMO_WITH_TLS
+    if (mqttTLS && !secureClient) {
+        secureClient = new GizmoSecureClient();
+        secureClient->setTrust(mqttFingerprint, gizmoFS(), MQTT_CA_FILE);
+    }
+#else
+    if (mqttTLS) {
+        Serial.println("TLS not included in this build; MQTT connection is not encrypted");
+    }
+#endif
+    if (coalesceBytes && !coalescer) {
+        coalescer = new GizmoCoalescingClient(mqttSocket(), coalesceBytes, coalesceDelay);
+    }
+}
+
+void ESPGizmo::createMQTTClient() {
+    // One client for the life of the transport; reconnects only point it at the broker again.
+    if (!mqtt) {
+        mqtt = new PubSubClient(mqttTransport());
+        if (mqttBufferSize && !mqtt->setBufferSize(mqttBufferSize)) {
+            Serial.printf("Unable to allocate a %u byte MQTT buffer\n", mqttBufferSize);
+        }
+        mqtt->setCallback([this](char *topic, uint8_t *payload, unsigned int length) {
+            dispatchMQTTMessage(topic, payload, length);
+        });
+    }
+    if (dutyCycleSeconds && (rtcState.flags & RTC_FLAG_BROKER) &&
+        rtcState.brokerHostCRC == gizmoCRC32(mqttHost, strlen(mqttHost))) {
+        mqtt->setServer(IPAddress(rtcState.brokerIP), mqttPort);
+    } else {
+        mqtt->setServer(mqttHost, mqttPort);
+    }
 }
 
 void ESPGizmo::setupHTTPServer() {
-    server = new ESP8266WebServer(80);
+    server = new GizmoWebServer(80, asyncHTTPEnabled);
+#if GIZMO_WITH_CONFIG_PAGES
     server->on("/nets", std::bind(&ESPGizmo::handleNetworkScanPage, this));
     server->on("/netcfg", std::bind(&ESPGizmo::handleNetworkConfig, this));
+    server->on("/netadd", std::bind(&ESPGizmo::handleNetworkAdd, this));
+    server->on("/netdel", std::bind(&ESPGizmo::handleNetworkRemove, this));
     server->on("/mqtt", std::bind(&ESPGizmo::handleMQTTPage, this));
     server->on("/mqttcfg", std::bind(&ESPGizmo::handleMQTTConfig, this));
     server->on("/passkey", std::bind(&ESPGizmo::handlePasskey, this));
     server->on("/uploadprep", std::bind(&ESPGizmo::preUpload, this));
     server->on("/upload", HTTP_POST, std::bind(&ESPGizmo::startUpload, this), std::bind(&ESPGizmo::handleUpload, this));
+    server->on("/firmware", HTTP_POST, std::bind(&ESPGizmo::finishFirmwareUpload, this),
+               std::bind(&ESPGizmo::handleFirmwareUpload, this));
     server->on("/reset", std::bind(&ESPGizmo::handleReset, this));
     server->on("/files", std::bind(&ESPGizmo::handleFiles, this));
     server->on("/erase", std::bind(&ESPGizmo::handleEraseConfig, this));
+#else
+    server->on("/reset", std::bind(&ESPGizmo::handleReset, this));
+#endif
+#if GIZMO_WITH_CAPTIVE_PORTAL
     server->on("/hotspot-detect.html", std::bind(&ESPGizmo::handleHotSpotDetect, this));
+#endif
+    server->on("/events", std::bind(&GizmoWebServer::beginEvents, server));
 }
 
 void ESPGizmo::setUpdateURL(const char *url) {
@@ -814,20 +1975,72 @@ void ESPGizmo::setUpdateURL(const char *url) {
 void ESPGizmo::setUpdateURL(const char *url, void (*callback)()) {
     onUpdate = callback;
     updateUrl = (char *) url;
+#if GIZMO_WITH_CONFIG_PAGES
     if (strlen(updateUrl)) {
         server->on("/update", std::bind(&ESPGizmo::handleUpdate, this));
         server->on("/doupdate", std::bind(&ESPGizmo::handleDoUpdate, this));
         server->on("/dofileupdate", std::bind(&ESPGizmo::handleDoFileUpdate, this));
     }
+#endif
+}
+
+#if GIZMO_WITH_TRANSFER
+void ESPGizmo::enableFileTransfer() {
+    transferEnabled = true;
+    // Chunks arrive whole, so the buffer must hold the largest one.
+    if (mqttBufferSize < TRANSFER_BUFFER_SIZE) {
+        setMQTTBufferSize(TRANSFER_BUFFER_SIZE);
+    }
 }
 
+GizmoFileTransfer *ESPGizmo::fileTransfer() {
+    return transfer;
+}
+#endif
+
 void ESPGizmo::setupWebRoot() {
     server->on("/", std::bind(&ESPGizmo::handleRoot, this));
-    server->serveStatic("/", SPIFFS, "/", "max-age=86400");
+    if (server->isAsync()) {
+        server->addHandler(new GizmoStaticHandler(server, gizmoFS(), "/", "/", "max-age=86400"));
+    } else {
+        server->serveStatic("/", gizmoFS(), "/", "max-age=86400");
+    }
+}
+
+void ESPGizmo::benchmarkFileSystem(Print &out) {
+    ::benchmarkFileSystem(out);
+}
+
+void ESPGizmo::sizeReport(Print &out) {
+    out.printf("Features:%s%s%s%s%s%s%s%s%s\n",
+               GIZMO_WITH_OTA ? " ota" : "", GIZMO_WITH_MDNS ? " mdns" : "",
+               GIZMO_WITH_CAPTIVE_PORTAL ? " captive" : "", GIZMO_WITH_HEALTH ? " health" : "",
+               GIZMO_WITH_NTPCLIENT ? " ntpclient" : "", GIZMO_WITH_BROKER ? " broker" : "",
+               GIZMO_WITH_MULTICAST ? " multicast" : "", GIZMO_WITH_TRANSFER ? " transfer" : "",
+               GIZMO_WITH_CONFIG_PAGES ? " pages" : "");
+    out.printf("Static RAM: gizmo %u, topics %u (%ux%u), announce/will %u, rtc state %u bytes\n",
+               sizeof(ESPGizmo), sizeof(topics), MAX_TOPIC_COUNT, MAX_TOPIC_SIZE,
+               sizeof(announceMessage) + sizeof(defaultWillTopic) + sizeof(defaultWillMessage),
+               sizeof(rtcState));
+    out.printf("Heap tables: %u http connections, %u event streams of %u bytes\n",
+               server && server->isAsync() ? MAX_HTTP_CONNECTIONS : 0, server ? server->eventClients() : 0,
+               EVENT_BUFFER_SIZE);
+#if GIZMO_WITH_BROKER
+    if (broker) {
+        out.printf("Local broker: %d sessions, %u delivered, %u rejected, %u dropped\n",
+                   broker->sessions(), broker->delivered, broker->rejected, broker->dropped);
+    }
+#endif
+    out.printf("MQTT: %u byte buffer, largest publish %u bytes, %u streamed as oversize\n",
+               mqtt ? mqtt->getBufferSize() : mqttBufferSize, largestPublish, oversizePublishes);
+    out.printf("Scratch: %u of %u bytes at peak, %u heap fallbacks\n",
+               scratchHighWater(), SCRATCH_ARENA_SIZE, scratchHeapFallbacks());
+    out.printf("Flash: sketch %u bytes, %u free; heap %u free, largest block %u\n",
+               ESP.getSketchSize(), ESP.getFreeSketchSpace(), ESP.getFreeHeap(), ESP.getMaxFreeBlockSize());
 }
 
 void ESPGizmo::setupAlwaysOnline() {
-    isAlwaysOnline = SPIFFS.exists(ALWAYS_ONLINE);
+    isAlwaysOnline = gizmoFS().exists(ALWAYS_ONLINE);
     if (isAlwaysOnline) {
         Serial.printf("Always expected online...");
         setupPinger();
@@ -835,26 +2048,185 @@ void ESPGizmo::setupAlwaysOnline() {
 }
 
 void ESPGizmo::setupPinger() {
+    setupHealthMonitor();
+}
+
+void ESPGizmo::setupHealthMonitor() {
+#if GIZMO_WITH_HEALTH
+    if (health) {
+        return;
+    }
+    health = new GizmoHealth();
+    snprintf(probeTopic, MAX_TOPIC_SIZE, HEALTH_PROBE_TOPIC, hostname);
+
     pinger = new Pinger();
-    pinger->OnReceive([](const PingerResponse &response) {
+    pinger->OnReceive([this](const PingerResponse &response) {
+        gatewayProbePending = false;
         if (response.ReceivedResponse) {
-            lastPingSuccess = millis();
+            health->gateway.record(response.ResponseTime);
+            health->pendingReassociations = 0;
+        } else {
+            health->gateway.lost();
         }
         return false;
     });
+#else
+    Serial.println("Health monitor not included in this build");
+#endif
+}
+
+GizmoHealth *ESPGizmo::healthMonitor() {
+    return health;
+}
+
+void ESPGizmo::setRecoveryPolicy(GizmoRecoveryPolicy policy) {
+    recoveryPolicy = policy;
 }
 
 void ESPGizmo::handlePinger() {
-    if (pinger && lastPingSuccess + PING_THRESHOLD < millis()) {
-        scheduleRestart();
-    } else if (pinger && lastPingAttempt + PING_FREQUENCY < millis()) {
-        if (pinger->Ping(WiFi.gatewayIP()) == false) {
-            Serial.println("Unable to ping gateway");
+    if (health && lastProbe + HEALTH_PROBE_INTERVAL < gizmoUptime()) {
+        lastProbe = gizmoUptime();
+        probeHealth();
+        applyRecovery(recoveryPolicy(health));
+    }
+
+    if (health && mqttConfigured && lastHealthPublish + HEALTH_PUBLISH_INTERVAL < gizmoUptime()) {
+        char topic[MAX_TOPIC_SIZE], summary[MAX_ANNOUNCE_MESSAGE_SIZE * 2];
+        lastHealthPublish = gizmoUptime();
+        snprintf(topic, MAX_TOPIC_SIZE, GIZMO_HEALTH_TOPIC, getTopicPrefix());
+        health->summary(summary, sizeof(summary));
+        publish(topic, summary, false);
+    }
+}
+
+void ESPGizmo::probeHealth() {
+#if GIZMO_WITH_HEALTH
+    health->recordRSSI(WiFi.RSSI());
+
+    // A probe still unanswered after a full interval counts as lost.
+    if (gatewayProbePending) {
+        health->gateway.lost();
+    }
+    health->gateway.sent++;
+    gatewayProbePending = pinger->Ping(WiFi.gatewayIP(), 1, HEALTH_PROBE_TIMEOUT);
+    if (!gatewayProbePending) {
+        Serial.println("Unable to ping gateway");
+        health->gateway.lost();
+    }
+
+    IPAddress resolved;
+    if (mqttConfigured && !resolved.fromString(mqttHost)) {
+        uint32_t start = millis();
+        health->dns.sent++;
+        if (WiFi.hostByName(mqttHost, resolved, HEALTH_PROBE_TIMEOUT)) {
+            health->dns.record(millis() - start);
+        } else {
+            health->dns.lost();
         }
-        lastPingAttempt = millis();
+    }
+
+    if (mqttConfigured && !mqttStreamOpen()) {
+        if (brokerProbeTime) {
+            health->broker.lost();
+            brokerProbeTime = 0;
+        }
+        health->broker.sent++;
+        char seq[12];
+        snprintf(seq, sizeof(seq), "%u", ++brokerProbeSequence);
+        if (mqtt && mqtt->connected() && mqtt->publish(probeTopic, seq, false)) {
+            brokerProbeTime = gizmoUptime();
+        } else {
+            health->broker.lost();
+        }
+    }
+#endif
+}
+
+void ESPGizmo::applyRecovery(GizmoRecovery recovery) {
+    switch (recovery) {
+        case RECOVERY_REASSOCIATE:
+            Serial.printf("Gateway unreachable; reassociating with %s\n", ssid);
+            health->reassociations++;
+            health->pendingReassociations++;
+            health->gateway.consecutiveLosses = 0;
+            WiFi.reconnect();
+            break;
+        case RECOVERY_RECONNECT_MQTT:
+            Serial.printf("Broker unreachable; reconnecting to %s\n", mqttHost);
+            health->mqttReconnects++;
+            health->broker.consecutiveLosses = 0;
+            if (mqtt) {
+                mqtt->disconnect();
+            }
+            lastReconnectAttempt = 0;
+            break;
+        case RECOVERY_RESTART:
+            health->restarts++;
+            scheduleRestart();
+            break;
+        case RECOVERY_NONE:
+            break;
     }
 }
 
+void ESPGizmo::dispatchMQTTMessage(char *topic, uint8_t *payload, unsigned int length) {
+    if (health && brokerProbeTime && !strcmp(topic, probeTopic)) {
+        char seq[12];
+        seq[0] = '\0';
+        strncat(seq, (char *) payload, length < sizeof(seq) - 1 ? length : sizeof(seq) - 1);
+        if ((uint32_t) atol(seq) == brokerProbeSequence) {
+            health->broker.record(gizmoUptime() - brokerProbeTime);
+            brokerProbeTime = 0;
+        }
+        return;
+    }
+#if GIZMO_WITH_TRANSFER
+    if (transfer) {
+        GizmoStage stage("transfer");
+        if (transfer->handleMessage(topic, payload, length)) {
+            return;
+        }
+    }
+#endif
+    GizmoStage stage("app-message", WATCHDOG_CALLBACK_DEADLINE);
+    if (cborCallback && isCBORMap(payload, length)) {
+        GizmoCBORReader reader(payload, length);
+        cborCallback(topic, reader);
+    } else if (mqttCallback) {
+        mqttCallback(topic, payload, length);
+    }
+}
+
+void ESPGizmo::startNetworkServices() {
+#if GIZMO_WITH_OTA
+    ArduinoOTA.begin();
+#endif
+#if GIZMO_WITH_MDNS
+    if (MDNS.begin(hostname)) {
+        MDNS.addService("http", "tcp", 80);
+    }
+#endif
+}
+
+void ESPGizmo::startDeferredServices() {
+    if (!servicesDeferred) {
+        return;
+    }
+    servicesDeferred = false;
+#if GIZMO_WITH_OTA
+    setupOTA();
+#endif
+#if GIZMO_WITH_CAPTIVE_PORTAL
+    if (captiveDeferred) {
+        captiveDeferred = false;
+        dnsServer.start(DNS_PORT, "*", apIP);
+    }
+#endif
+    startNetworkServices();
+    markBoot("services");
+}
+
+#if GIZMO_WITH_OTA
 void ESPGizmo::setupOTA() {
     ArduinoOTA.setHostname(hostname);
     ArduinoOTA.onStart([]() {
@@ -875,6 +2247,7 @@ void ESPGizmo::setupOTA() {
         else if (error == OTA_END_ERROR) Serial.println("End Failed");
     });
 }
+#endif
 
 int ESPGizmo::updateSoftware(const char *url) {
     Serial.printf("Updating software from %s; current version %s\n", url, version);
@@ -897,7 +2270,7 @@ int ESPGizmo::updateSoftware(const char *url) {
 bool isUpTodate(const char *file, const char *etag) {
     char efn[48], et[32];
     snprintf(efn, 47, "/etags%s", file);
-    File f = SPIFFS.open(efn, "r");
+    File f = gizmoFS().open(efn, "r");
     if (f) {
         int l = f.readBytesUntil('\n', et, 31);
         et[l] = '\0';
@@ -910,7 +2283,8 @@ bool isUpTodate(const char *file, const char *etag) {
 void saveEtag(const char *file, const char *etag) {
     char efn[48];
     snprintf(efn, 47, "/etags%s", file);
-    File f = SPIFFS.open(efn, "w");
+    makeParentDirs(efn);
+    File f = gizmoFS().open(efn, "w");
     if (f) {
         f.printf("%s\n", etag);
         f.close();
@@ -918,19 +2292,29 @@ void saveEtag(const char *file, const char *etag) {
 }
 
 int ESPGizmo::downloadAndSave(const char *url, const char *file) {
-    char xurl[256];
-    snprintf(xurl, 255, "%s.data%s", url, file);
+    GizmoScratch xurl(256);
+    if (!xurl.size()) {
+        return 0;
+    }
+    snprintf(xurl.chars(), xurl.size(), "%s.data%s", url, file);
     Serial.printf("Starting download of %s...\n", file);
 
     HTTPClient httpClient;
-    httpClient.begin(xurl);
+    httpClient.begin(xurl.chars());
 
     const char *headerKeys[] = {"Content-Length", "ETag"};
     httpClient.collectHeaders(headerKeys, 2);
 
+#if GIZMO_WITH_FAULTS
+    if (faults.active(FAULT_DNS, gizmoUptime())) {
+        Serial.printf("Unable to resolve %s by injected fault\n", xurl.chars());
+        return 0;
+    }
+    uint32_t downloadLimit = faults.take(FAULT_DOWNLOAD);
+#endif
     int code = httpClient.GET();
     if (code != HTTP_CODE_OK) {
-        Serial.printf("Unable to download %s\n", xurl);
+        Serial.printf("Unable to download %s\n", xurl.chars());
         return 0;
     }
 
@@ -939,14 +2323,20 @@ int ESPGizmo::downloadAndSave(const char *url, const char *file) {
         int downloaded = 0;
         WiFiClient *stream = httpClient.getStreamPtr();
         if (stream) {
-            File f = SPIFFS.open(file, "w");
+            GizmoScratch buf(1024);
+            File f = buf.size() ? gizmoFS().open(file, "w") : File();
             if (f) {
                 Serial.printf("Downloading %d bytes of %s ... ", length, file);
-                uint8_t buf[1024];
                 size_t rl;
-                while ((rl = stream->read(buf, 1024)) > 0) {
-                    f.write(buf, rl);
+                while ((rl = stream->read(buf.bytes(), buf.size())) > 0) {
+                    f.write(buf.bytes(), rl);
                     downloaded += rl;
+#if GIZMO_WITH_FAULTS
+                    if (downloadLimit && downloaded >= (int) downloadLimit) {
+                        Serial.printf("cut short by injected fault ... ");
+                        break;
+                    }
+#endif
                     delay(20);
                     yield();
                 }
@@ -967,17 +2357,17 @@ int ESPGizmo::downloadAndSave(const char *url, const char *file) {
 int ESPGizmo::updateFiles(const char *url) {
     updatingFiles = true;
     fileUploadFailed = !downloadAndSave(url, "/catalog");
-    File cat = SPIFFS.open("/catalog", "r");
+    File cat = gizmoFS().open("/catalog", "r");
     if (cat && !fileUploadFailed) {
         char file[32];
         int l;
         while ((l = cat.readBytesUntil('\n', file, 31)) > 0) {
             file[l] = '\0';
-            int t = 10;
+            int t = FILE_UPDATE_RETRIES;
             while (!downloadAndSave(url, file) && t > 0) {
                 Serial.printf("Failed to download file %s completely; retrying\n", file);
                 t--;
-                delay(500);
+                delay(FILE_UPDATE_RETRY_DELAY);
             }
             if (t == 0) {
                 Serial.printf("Failed to download file %s\n", file);
@@ -991,6 +2381,19 @@ int ESPGizmo::updateFiles(const char *url) {
 }
 
 boolean ESPGizmo::mqttReconnect() {
+#if GIZMO_WITH_FAULTS
+    if (faults.active(FAULT_BROKER, gizmoUptime()) || faults.active(FAULT_DNS, gizmoUptime())) {
+        Serial.printf("MQTT server %s unreachable by injected fault\n", mqttHost);
+        return false;
+    }
+#endif
+#if GIZMO_WITH_TLS
+    if (secureClient && !secureClient->trusted) {
+        // Without a fingerprint or CA anyone could pose as the broker and collect the credentials.
+        // setTrust() already said why; an uploaded CA or new settings will retry it.
+        return false;
+    }
+#endif
     Serial.printf("Attempting connection to MQTT server %s as %s/%s\n",
                   mqttHost, mqttUser, mqttPass);
     if (!willTopic || !willMessage) {
@@ -999,17 +2402,60 @@ boolean ESPGizmo::mqttReconnect() {
 //        Serial.printf("dt=%s; dm=%s\n", willTopic, willMessage);
     }
 
+#if GIZMO_WITH_TLS
+    if (secureClient && clock && clock->isSynced()) {
+        // Certificate validity is checked against this; fingerprints don't need it.
+        secureClient->setX509Time(clock->now() / 1000);
+    }
+#endif
     if (mqtt->connect(defaultHostname, mqttUser, mqttPass, willTopic, willQos, willRetain, willMessage)) {
 //    if (mqtt->connect(defaultHostname, mqttUser, mqttPass)) {
         // Once connected, publish an announcement and subscribe...
         mqtt->publish(GIZMO_CONSOLE_TOPIC, announceMessage, false);
+        if (configReport[0]) {
+            mqtt->publish(GIZMO_CONSOLE_TOPIC, configReport, false);
+            configReport[0] = '\0';
+        }
+        markBoot("connected");
+        startDeferredServices();
         booted = true;
         updateAnnounceMessage();
 
-        mqtt->subscribe(GIZMO_CONTROL_TOPIC);
+        if (legacyControl) {
+            mqtt->subscribe(GIZMO_CONTROL_TOPIC);
+        }
+        snprintf(deviceControlTopic, MAX_TOPIC_SIZE, GIZMO_DEVICE_CONTROL_TOPIC, hostname);
+        mqtt->subscribe(deviceControlTopic);
+        for (int i = 0; i < controlGroupCount; i++) {
+            mqtt->subscribe(groupControlTopics[i]);
+        }
         for (int i = 0; i < topicCount; i++) {
             mqtt->subscribe(topics[i]);
         }
+        if (health) {
+            mqtt->subscribe(probeTopic);
+        }
+#if GIZMO_WITH_TRANSFER
+        if (transferEnabled) {
+            if (!transfer) {
+                // Created here, once the topic prefix is known.
+                transfer = new GizmoFileTransfer(&gizmoFS(), topicPrefix, hostname);
+                transfer->setStatusCallback([this](const char *status) {
+                    char topic[MAX_TOPIC_SIZE * 2];
+                    publish(transfer->statusTopic(topic, sizeof(topic), hostname), status, false);
+                });
+            }
+            mqtt->subscribe(transfer->manifestTopic());
+            mqtt->subscribe(transfer->chunkTopic());
+        }
+#endif
+        setNetworkState(NETWORK_ONLINE);
+        publishNetworkReport();
+
+        // Remember the resolved broker address so the next wake can skip the DNS lookup.
+        rtcState.brokerIP = mqttSocket().remoteIP();
+        rtcState.brokerHostCRC = gizmoCRC32(mqttHost, strlen(mqttHost));
+        rtcState.flags |= RTC_FLAG_BROKER;
     }
     return mqtt->connected();
 }
@@ -1020,28 +2466,239 @@ void ESPGizmo::updateAnnounceMessage() {
              booted ? "reconnect" : "boot");
 }
 
+void ESPGizmo::setNetworkStateCallback(void (*callback)(GizmoNetworkState, GizmoNetworkState)) {
+    networkStateCallback = callback;
+}
+
+GizmoNetworkState ESPGizmo::getNetworkState() {
+    return networkState;
+}
+
+uint32_t ESPGizmo::getLastReconnectTime() {
+    return lastReconnectTime;
+}
+
+uint32_t ESPGizmo::getReconnects() {
+    return reconnects;
+}
+
+uint32_t ESPGizmo::getPublishFailures() {
+    return publishFailures;
+}
+
+uint32_t ESPGizmo::getOversizePublishes() {
+    return oversizePublishes;
+}
+
+uint32_t ESPGizmo::getLargestPublish() {
+    return largestPublish;
+}
+
+bool ESPGizmo::setMQTTBufferSize(uint16_t size) {
+    mqttBufferSize = size;
+    if (mqtt && !mqtt->setBufferSize(size)) {
+        Serial.printf("Unable to allocate a %u byte MQTT buffer\n", size);
+        return false;
+    }
+    return true;
+}
+
+#if GIZMO_WITH_FAULTS
+bool ESPGizmo::injectFault(const char *spec) {
+    return faults.inject(spec, gizmoUptime());
+}
+
+void ESPGizmo::handleFaults() {
+    if (faults.take(FAULT_WIFI)) {
+        WiFi.disconnect(false);
+        wifiFaultHeld = true;
+    }
+    if (wifiFaultHeld && !faults.active(FAULT_WIFI, gizmoUptime())) {
+        wifiFaultHeld = false;
+        currentNetwork = -1;
+        triedNetworks = 0;
+        selectNetwork();
+    }
+    if (faults.take(FAULT_BROKER)) {
+        // Drop the socket without a DISCONNECT, as a broker restart would.
+        mqttSocket().stop();
+    }
+    uint32_t stall = faults.take(FAULT_STALL);
+    if (stall) {
+        delay(stall);
+    }
+    bool online = networkState == NETWORK_ONLINE && (!mqttConfigured || (mqtt && mqtt->connected()));
+    faults.settle(gizmoUptime(), online);
+
+    faults.sampleHeap(ESP.getFreeHeap());
+    if (mqtt && mqtt->connected() && lastSoakReport + SOAK_REPORT_INTERVAL < gizmoUptime()) {
+        publishSoakReport();
+    }
+}
+
+void ESPGizmo::publishSoakReport() {
+    char topic[MAX_TOPIC_SIZE], report[MAX_ANNOUNCE_MESSAGE_SIZE];
+    lastSoakReport = gizmoUptime();
+    faults.report(report, sizeof(report), publishFailures);
+    snprintf(topic, MAX_TOPIC_SIZE, SOAK_TOPIC, getTopicPrefix());
+    publish(topic, report, false);
+}
+#endif
+
+void ESPGizmo::setNetworkState(GizmoNetworkState state) {
+    GizmoNetworkState from = networkState;
+    if (state == from) {
+        return;
+    }
+    networkState = state;
+
+    if (from == NETWORK_ONLINE) {
+        outageStart = gizmoUptime();
+    } else if (state == NETWORK_ONLINE && outageStart) {
+        lastReconnectTime = gizmoUptime() - outageStart;
+        outageStart = 0;
+        reconnects++;
+        Serial.printf("Back online after %u ms\n", lastReconnectTime);
+    }
+#if GIZMO_WITH_FAULTS
+    if (state == NETWORK_ONLINE) {
+        faults.recovered(gizmoUptime());
+        lastSoakReport = 0;
+    }
+#endif
+
+    sendStateEvent(state == NETWORK_DISCONNECTED ? "wifi disconnected" :
+                   state == NETWORK_ONLINE ? (mqttConfigured ? "mqtt connected" : "wifi connected") :
+                   from == NETWORK_ONLINE ? "mqtt disconnected" : "wifi connected");
+    if (networkStateCallback) {
+        GizmoStage stage("app-state", WATCHDOG_CALLBACK_DEADLINE);
+        networkStateCallback(from, state);
+    }
+}
+
+void ESPGizmo::handleWiFiEvents() {
+    // A drop and a reconnect can both land between two loops; the lost event is always
+    // handled first and the got-IP one only if the station is still associated.
+    if (wifiLost) {
+        wifiLost = false;
+        if (networkState != NETWORK_DISCONNECTED) {
+            handleWiFiLost();
+        }
+    }
+    if (wifiGotIP) {
+        wifiGotIP = false;
+        if (networkState == NETWORK_DISCONNECTED && WiFi.status() == WL_CONNECTED) {
+            handleWiFiConnected();
+        }
+    }
+}
+
+// A cached lease can be stale, on another subnet or handed to another host since, and
+// association succeeds regardless. Confirm the gateway answers ARP before trusting it.
+void ESPGizmo::handleLeaseCheck() {
+    if (!leaseCheckDeadline) {
+        return;
+    }
+    if (networkState == NETWORK_DISCONNECTED) {
+        leaseCheckDeadline = 0;
+        return;
+    }
+
+    ip4_addr_t gateway;
+    ip4_addr_set_u32(&gateway, (uint32_t) WiFi.gatewayIP());
+    struct eth_addr *mac;
+    const ip4_addr_t *ip;
+    if (netif_default && etharp_find_addr(netif_default, &gateway, &mac, &ip) >= 0) {
+        leaseCheckDeadline = 0;
+        leaseInUse = false;
+        saveFastConnect();
+        return;
+    }
+
+    uint64_t now = gizmoUptime();
+    if (now > leaseCheckDeadline) {
+        Serial.printf("Gateway %s unreachable on cached lease; falling back to DHCP\n",
+                      WiFi.gatewayIP().toString().c_str());
+        leaseCheckDeadline = 0;
+        forgetFastConnect();
+        WiFi.disconnect();
+        connectToNetwork(currentNetwork);
+    } else if (netif_default && now - leaseCheckSent >= LEASE_CHECK_RETRY) {
+        leaseCheckSent = now;
+        etharp_request(netif_default, &gateway);
+    }
+}
+
+void ESPGizmo::handleWiFiConnected() {
+    callAfterConnection = true;
+    fastConnectDeadline = 0;
+    networkDeadline = 0;
+    triedNetworks = 0;
+    Serial.printf("Connected to %s with IP %s at %d dBm\n", getActiveSSID(),
+                  WiFi.localIP().toString().c_str(), WiFi.RSSI());
+    if (leaseInUse) {
+        // Only cache this association again once the gateway is known to answer.
+        leaseCheckDeadline = gizmoUptime() + LEASE_CHECK_TIMEOUT;
+        leaseCheckSent = 0;
+    } else {
+        saveFastConnect();
+    }
+
+    updateAnnounceMessage();
+    createMQTTClient();
+    setNetworkState(mqttConfigured ? NETWORK_WIFI : NETWORK_ONLINE);
+#if GIZMO_WITH_MULTICAST
+    if (lanControl) {
+        lanControl->begin();
+    }
+#endif
+
+    markBoot("online");
+    if (!dutyCycleSeconds) {
+        if (!servicesDeferred) {
+            startNetworkServices();
+        } else if (!mqttConfigured) {
+            startDeferredServices();
+        }
+    }
+}
+
+void ESPGizmo::handleWiFiLost() {
+    Serial.printf("Disconnected from %s, reason %d\n", getActiveSSID(), wifiLostReason);
+    if (mqtt && mqtt->connected()) {
+        // The socket is gone with the link; drop it now rather than on the next write.
+        mqtt->disconnect();
+    }
+    setNetworkState(NETWORK_DISCONNECTED);
+}
+
 bool ESPGizmo::isNetworkAvailable(void (*afterConnection)()) {
-    boolean wifiReady = WiFi.status() == WL_CONNECTED;
+    watchdogStage("wifi");
+    handleWiFiEvents();
+    handleLeaseCheck();
+#if GIZMO_WITH_FAULTS
+    if (!dutyCycleSeconds) {
+        handleFaults();
+    }
+#endif
+    boolean wifiReady = networkState != NETWORK_DISCONNECTED;
     boolean mqttReady = (mqttConfigured && mqtt && mqtt->connected()) || !mqttConfigured;
 
     if (wifiReady) {
-        if (disconnected) {
-            disconnected = false;
-            callAfterConnection = true;
-            Serial.printf("Connected to %s with IP %s\n", ssid, WiFi.localIP().toString().c_str());
-
-            updateAnnounceMessage();
-            mqtt = new PubSubClient(mqttHost, mqttPort, wifiClient);
-            mqtt->setCallback(mqttCallback);
-
-            ArduinoOTA.begin();
-            if (MDNS.begin(hostname)) {
-                MDNS.addService("http", "tcp", 80);
-            }
+#if GIZMO_WITH_MULTICAST
+        if (lanControl) {
+            watchdogStage("multicast");
+            lanControl->loop(clock && clock->isSynced() ? clock->now() / 1000 : 0);
         }
-
+#endif
         if (mqtt && mqttConfigured) {
+            watchdogStage("mqtt");
             if (!mqtt->connected()) {
+                setNetworkState(NETWORK_WIFI);
+                if (mqttStreamOpen()) {
+                    // The rest of the payload must not end up in the next session.
+                    endPublish();
+                }
                 uint32_t now = millis();
                 if (now - lastReconnectAttempt > MQTT_RECONNECT_FREQUENCY) {
                     lastReconnectAttempt = now;
@@ -1049,37 +2706,105 @@ bool ESPGizmo::isNetworkAvailable(void (*afterConnection)()) {
                         lastReconnectAttempt = 0;
                     }
                 }
-            } else {
+            } else if (!mqttStreamOpen()) {
+                // While the application streams a publish across loop iterations, nothing
+                // else may write to the socket, keep-alive pings included.
                 if (scheduledTopic) {
                     publish(scheduledTopic, scheduledPayload, scheduledRetain);
                     scheduledTopic = NULL;
                     scheduledPayload = NULL;
                 }
+                if (rtcState.readingCount) {
+                    publishQueuedReadings();
+                }
                 mqtt->loop();
+                if (coalescer) {
+                    coalescer->loop();
+                }
+            }
+        }
+
+        if (!dutyCycleSeconds && mqttConfigured && mqttReady &&
+            (!callAfterConnection || !afterConnection)) {
+            watchdogStage("reports");
+            publishStallReports();
+            if (!bootReported) {
+                publishBootTimeline();
             }
         }
 
         if (callAfterConnection && mqttReady && afterConnection) {
-            if (ntpClient) {
-                ntpClient->begin();
+            if (clock) {
+                clock->begin();
+            }
+            if (filesMigrated && updateUrl) {
+                // Only configuration survives the move to LittleFS; fetch the rest again.
+                filesMigrated = false;
+                scheduleFileUpdate();
             }
             callAfterConnection = false;
             offlineTime = 0;
+            watchdogStage("app-connected", WATCHDOG_CALLBACK_DEADLINE);
             afterConnection();
+            markBoot("ready");
             led(false);
         }
 
+        if (dutyCycleSeconds) {
+            // Whatever the application published after connecting is out; go back to sleep.
+            if (mqttReady && (!callAfterConnection || !afterConnection)) {
+                publishQueuedReadings();
+                sleep();
+            }
+            handleAwakeDeadline();
+            watchdogStage("loop", WATCHDOG_LOOP_DEADLINE);
+            return wifiReady && mqttReady;
+        }
+
+#if GIZMO_WITH_OTA
+        watchdogStage("ota");
         ArduinoOTA.handle();
+#endif
+        watchdogStage("health");
         handlePinger();
+        watchdogStage("roaming");
+        handleRoaming();
+        handleNetworkSelection();
     }
+
+    if (dutyCycleSeconds) {
+        watchdogStage("connect");
+        handleFastConnectTimeout();
+        handleNetworkSelection();
+        handleAwakeDeadline();
+        watchdogStage("loop", WATCHDOG_LOOP_DEADLINE);
+        return false;
+    }
+
+    watchdogStage("http");
+#if GIZMO_WITH_CAPTIVE_PORTAL
     dnsServer.processNextRequest();
+#endif
     server->handleClient();
-
-    if (ntpClient) {
-        ntpClient->update();
+#if GIZMO_WITH_BROKER
+    if (broker) {
+        watchdogStage("broker");
+        broker->loop();
+    }
+#endif
+
+    if (clock) {
+        watchdogStage("clock");
+        clock->loop(wifiReady);
+#if GIZMO_WITH_NTPCLIENT
+        if (ntpClient) {
+            ntpClient->update();
+        }
+#endif
     }
 
-    if (updateTime && updateTime < millis()) {
+    if (updateTime && updateTime < gizmoUptime()) {
+        watchdogStage("update", WATCHDOG_LONG_DEADLINE);
         if (onUpdate) {
             onUpdate();
         }
@@ -1088,7 +2813,8 @@ bool ESPGizmo::isNetworkAvailable(void (*afterConnection)()) {
         updateTime = 0;
     }
 
-    if (fileUpdateTime && fileUpdateTime < millis()) {
+    if (fileUpdateTime && fileUpdateTime < gizmoUptime()) {
+        watchdogStage("file-update", WATCHDOG_LONG_DEADLINE);
         if (onUpdate) {
             onUpdate();
         }
@@ -1096,27 +2822,37 @@ bool ESPGizmo::isNetworkAvailable(void (*afterConnection)()) {
         fileUpdateTime = 0;
     }
 
-    if (restartTime && restartTime < millis()) {
+    if (restartTime && restartTime < gizmoUptime()) {
         restart();
     }
 
+    if (applyTime && applyTime < gizmoUptime()) {
+        watchdogStage("apply");
+        applyPendingConfig();
+    }
+
     if (!wifiReady) {
-        disconnected = true;
+        watchdogStage("connect");
+        handleFastConnectTimeout();
+        handleNetworkSelection();
         led(wifiConfigured); // Turn on the LED only if WiFi is marked as configured.
     }
 
     // If we're still not ready and the offline time grace period ran-out, run without WiFi.
-    if (!(wifiReady && mqttReady) && offlineTime && offlineTime < millis()) {
+    if (!(wifiReady && mqttReady) && offlineTime && offlineTime < gizmoUptime()) {
         if (!isAlwaysOnline) {
+            watchdogStage("offline");
             setNoNetworkConfig();
             callAfterConnection = false;
             offlineTime = 0;
+            watchdogStage("app-connected", WATCHDOG_CALLBACK_DEADLINE);
             afterConnection();
         } else {
             restart();
         }
     }
 
+    watchdogStage("loop", WATCHDOG_LOOP_DEADLINE);
     return wifiReady && mqttReady;
 }
 
@@ -1139,8 +2875,30 @@ char *trimWhiteSpace(char *str) {
     return str;
 }
 
+void readIPField(File &f, IPAddress &ip) {
+    char field[16];
+    int l = f.readBytesUntil('|', field, 15);
+    field[l] = '\0';
+    ip = IPAddress();
+    if (l) {
+        ip.fromString(trimWhiteSpace(field));
+    }
+}
+
+bool parseMAC(const char *str, uint8_t *mac) {
+    for (int i = 0; i < 6; i++) {
+        char *end;
+        mac[i] = strtoul(str, &end, 16);
+        if (end == str || (i < 5 && *end != ':')) {
+            return false;
+        }
+        str = end + 1;
+    }
+    return true;
+}
+
 void ESPGizmo::loadNetworkConfig() {
-    File f = SPIFFS.open(normalizeFile(networkConfig), "r");
+    File f = gizmoFS().open(normalizeFile(networkConfig), "r");
     if (f) {
         int l = f.readBytesUntil('|', ssid, MAX_SSID_SIZE - 1);
         ssid[l] = '\0';
@@ -1149,25 +2907,278 @@ void ESPGizmo::loadNetworkConfig() {
         l = f.readBytesUntil('|', hostname, MAX_SSID_SIZE - 1);
         hostname[l] = '\0';
         trimWhiteSpace(hostname);
+        readIPField(f, staticIP);
+        readIPField(f, staticGateway);
+        readIPField(f, staticMask);
+        readIPField(f, staticDNS);
         f.close();
     }
 }
 
 void ESPGizmo::saveNetworkConfig() {
-    File f = SPIFFS.open("/cfg/wifi", "w");
+    makeParentDirs("/cfg/wifi");
+    File f = gizmoFS().open("/cfg/wifi", "w");
     if (f) {
-        f.printf("%s|%s|%s|\n", ssid, passkey, hostname);
+        f.printf("%s|%s|%s|", ssid, passkey, hostname);
+        if (staticIP.isSet()) {
+            f.printf("%s|", staticIP.toString().c_str());
+            f.printf("%s|", staticGateway.toString().c_str());
+            f.printf("%s|", staticMask.toString().c_str());
+            f.printf("%s|", staticDNS.toString().c_str());
+        }
+        f.printf("\n");
         f.close();
     }
 }
 
+bool ESPGizmo::loadFastConnect() {
+    if (dutyCycleSeconds) {
+        if (!(rtcState.flags & RTC_FLAG_NETWORK) || !networks.get(rtcState.network)) {
+            return false;
+        }
+        currentNetwork = rtcState.network;
+        memcpy(fastBSSID, rtcState.bssid, 6);
+        fastChannel = rtcState.channel;
+        fastIP = IPAddress(rtcState.ip);
+        fastGateway = IPAddress(rtcState.gateway);
+        fastMask = IPAddress(rtcState.mask);
+        fastDNS = IPAddress(rtcState.dns);
+        return true;
+    }
+
+    File f = gizmoFS().open(FAST_CONNECT, "r");
+    if (!f) {
+        return false;
+    }
+
+    char cssid[MAX_SSID_SIZE], bssid[MAX_MAC_SIZE], channel[8];
+    int l = f.readBytesUntil('|', cssid, MAX_SSID_SIZE - 1);
+    cssid[l] = '\0';
+    l = f.readBytesUntil('|', bssid, MAX_MAC_SIZE - 1);
+    bssid[l] = '\0';
+    l = f.readBytesUntil('|', channel, 7);
+    channel[l] = '\0';
+    fastChannel = atoi(channel);
+    readIPField(f, fastIP);
+    readIPField(f, fastGateway);
+    readIPField(f, fastMask);
+    readIPField(f, fastDNS);
+    f.close();
+
+    // Only trust the cache if it was recorded for one of the networks we know.
+    currentNetwork = networks.find(cssid);
+    if (currentNetwork < 0) {
+        currentNetwork = 0;
+        return false;
+    }
+    return parseMAC(bssid, fastBSSID) && fastChannel > 0;
+}
+
+void ESPGizmo::saveFastConnect() {
+    const uint8_t *bssid = WiFi.BSSID();
+    if (!bssid) {
+        return;
+    }
+
+    // Avoid wearing the flash when nothing changed since the last boot.
+    if (fastChannel == WiFi.channel() && !memcmp(fastBSSID, bssid, 6) &&
+        fastIP == WiFi.localIP() && fastGateway == WiFi.gatewayIP()) {
+        return;
+    }
+
+    memcpy(fastBSSID, bssid, 6);
+    fastChannel = WiFi.channel();
+    fastIP = WiFi.localIP();
+    fastGateway = WiFi.gatewayIP();
+    fastMask = WiFi.subnetMask();
+    fastDNS = WiFi.dnsIP();
+
+    if (dutyCycleSeconds) {
+        // Keep the flash out of the wake path; RTC memory is good enough between sleeps.
+        memcpy(rtcState.bssid, fastBSSID, 6);
+        rtcState.channel = fastChannel;
+        rtcState.network = currentNetwork;
+        rtcState.ip = fastIP;
+        rtcState.gateway = fastGateway;
+        rtcState.mask = fastMask;
+        rtcState.dns = fastDNS;
+        rtcState.flags |= RTC_FLAG_NETWORK;
+        return;
+    }
+
+    makeParentDirs(FAST_CONNECT);
+    File f = gizmoFS().open(FAST_CONNECT, "w");
+    if (f) {
+        f.printf("%s|%02X:%02X:%02X:%02X:%02X:%02X|%d|", getActiveSSID(),
+                 fastBSSID[0], fastBSSID[1], fastBSSID[2], fastBSSID[3], fastBSSID[4], fastBSSID[5],
+                 fastChannel);
+        f.printf("%s|", fastIP.toString().c_str());
+        f.printf("%s|", fastGateway.toString().c_str());
+        f.printf("%s|", fastMask.toString().c_str());
+        f.printf("%s|\n", fastDNS.toString().c_str());
+        f.close();
+    }
+}
+
+void ESPGizmo::forgetFastConnect() {
+    fastChannel = 0;
+    fastIP = IPAddress();
+    leaseInUse = false;
+    rtcState.flags &= ~RTC_FLAG_NETWORK;
+    gizmoFS().remove(FAST_CONNECT);
+}
+
+void ESPGizmo::applyIPConfig(bool useLease) {
+    GizmoNetwork *network = networks.get(currentNetwork);
+    leaseInUse = false;
+    if (staticIP.isSet() && network && network->primary) {
+        WiFi.config(staticIP, staticGateway, staticMask, staticDNS);
+    } else if (useLease && fastIP.isSet()) {
+        // Re-use the last DHCP lease to skip the DHCP round; the full scan path goes back to DHCP.
+        WiFi.config(fastIP, fastGateway, fastMask, fastDNS);
+        leaseInUse = true;
+    } else {
+        WiFi.config(0U, 0U, 0U);
+    }
+}
+
+void ESPGizmo::handleFastConnectTimeout() {
+    if (fastConnectDeadline && fastConnectDeadline < gizmoUptime()) {
+        Serial.printf("Fast connection to %s failed; falling back to full scan\n", getActiveSSID());
+        fastConnectDeadline = 0;
+        networks.get(currentNetwork)->failures++;
+        forgetFastConnect();
+        WiFi.disconnect();
+        selectNetwork();
+    }
+}
+
+void ESPGizmo::selectNetwork() {
+    if (networks.count() == 1) {
+        connectToNetwork(0);
+    } else if (networks.isScanFresh(gizmoUptime()) && networks.best(triedNetworks) >= 0) {
+        connectToNetwork(networks.best(triedNetworks));
+    } else if (!scanning) {
+        Serial.printf("Scanning for %d known networks\n", networks.count());
+        scanning = WiFi.scanNetworks(true) == WIFI_SCAN_RUNNING;
+    }
+}
+
+void ESPGizmo::connectToNetwork(int index) {
+    GizmoNetwork *network = networks.get(index);
+    currentNetwork = index;
+    network->attempts++;
+    applyIPConfig(false);
+    if (network->rssi != RSSI_NOT_SEEN) {
+        Serial.printf("Attempting connection to %s at %d dBm\n", network->ssid, network->rssi);
+        WiFi.begin(network->ssid, network->passkey, network->channel, network->bssid);
+    } else {
+        Serial.printf("Attempting connection to %s\n", network->ssid);
+        WiFi.begin(network->ssid, network->passkey);
+    }
+    networkDeadline = networks.count() > 1 ? gizmoUptime() + NETWORK_CONNECT_TIMEOUT : 0;
+}
+
+void ESPGizmo::handleNetworkSelection() {
+    if (scanning) {
+        int found = WiFi.scanComplete();
+        if (found == WIFI_SCAN_RUNNING) {
+            return;
+        }
+        scanning = false;
+        networks.updateFromScan(found > 0 ? found : 0, gizmoUptime());
+        WiFi.scanDelete();
+
+        int best = networks.best(triedNetworks);
+        if (best < 0) {
+            // Nothing known in range, or everything failed; start over with a fresh scan.
+            triedNetworks = 0;
+            currentNetwork = -1;
+            networkDeadline = gizmoUptime() + NETWORK_CONNECT_TIMEOUT;
+        } else if (WiFi.status() != WL_CONNECTED) {
+            connectToNetwork(best);
+        } else {
+            GizmoNetwork *network = networks.get(best);
+            if (network->rssi >= WiFi.RSSI() + ROAM_HYSTERESIS && memcmp(network->bssid, WiFi.BSSID(), 6)) {
+                Serial.printf("Roaming to %s at %d dBm from %d dBm\n", network->ssid, network->rssi, WiFi.RSSI());
+                roams++;
+                connectToNetwork(best);
+            }
+        }
+
+    } else if (networkDeadline && networkDeadline < gizmoUptime() && WiFi.status() != WL_CONNECTED) {
+        GizmoNetwork *network = networks.get(currentNetwork);
+        if (network) {
+            Serial.printf("Unable to connect to %s\n", network->ssid);
+            network->failures++;
+            triedNetworks |= 1 << currentNetwork;
+        }
+        networkDeadline = 0;
+        selectNetwork();
+    }
+}
+
+void ESPGizmo::handleRoaming() {
+    if (networks.count() < 2 || scanning || lastRoamCheck + ROAM_CHECK_INTERVAL > gizmoUptime()) {
+        return;
+    }
+    lastRoamCheck = gizmoUptime();
+
+    weakSamples = WiFi.RSSI() < ROAM_RSSI_THRESHOLD ? weakSamples + 1 : 0;
+    if (weakSamples >= ROAM_SAMPLES) {
+        Serial.printf("Signal from %s is weak at %d dBm; looking for a better network\n", getActiveSSID(), WiFi.RSSI());
+        weakSamples = 0;
+        triedNetworks = 0;
+        scanning = WiFi.scanNetworks(true) == WIFI_SCAN_RUNNING;
+    }
+}
+
+void ESPGizmo::publishNetworkReport() {
+    char topic[MAX_TOPIC_SIZE], report[MAX_ANNOUNCE_MESSAGE_SIZE];
+    int l = snprintf(report, MAX_ANNOUNCE_MESSAGE_SIZE, "%s %d dBm ch %d roams %u reconnects %u last %u ms;",
+                     getActiveSSID(), WiFi.RSSI(), WiFi.channel(), roams, reconnects, lastReconnectTime);
+#if GIZMO_WITH_TLS
+    if (secureClient) {
+        l += snprintf(report + l, MAX_ANNOUNCE_MESSAGE_SIZE - l, " tls %u ms %s %u/%u;",
+                      secureClient->lastHandshakeTime, secureClient->lastHandshakeResumed ? "session" : "full",
+                      secureClient->handshakes, secureClient->handshakes + secureClient->failures);
+    }
+#endif
+    for (int i = 0; i < networks.count() && l < MAX_ANNOUNCE_MESSAGE_SIZE; i++) {
+        GizmoNetwork *network = networks.get(i);
+        l += snprintf(report + l, MAX_ANNOUNCE_MESSAGE_SIZE - l, " %s %u/%u",
+                      network->ssid, network->attempts - network->failures, network->attempts);
+    }
+    snprintf(topic, MAX_TOPIC_SIZE, GIZMO_WIFI_TOPIC, getTopicPrefix());
+    publish(topic, report, false);
+}
+
+bool ESPGizmo::addNetwork(const char *netSSID, const char *netPasskey, uint8_t priority) {
+    if (!networks.add(netSSID, netPasskey, priority ? priority : 1, false)) {
+        return false;
+    }
+    networks.save(gizmoFS());
+    return true;
+}
+
+bool ESPGizmo::removeNetwork(const char *netSSID) {
+    if (!networks.remove(netSSID)) {
+        return false;
+    }
+    if (currentNetwork >= networks.count()) {
+        currentNetwork = 0;
+    }
+    networks.save(gizmoFS());
+    return true;
+}
+
 void ESPGizmo::setMQTTLastWill(const char *willTopic, const char *willMessage,
                                uint8_t willQos, bool willRetain) {
     Serial.printf("Not implemented yet: %s, %s, %d, %d", willTopic, willMessage, willQos, willRetain);
 }
 
 void ESPGizmo::loadMQTTConfig() {
-    File f = SPIFFS.open(normalizeFile("cfg/mqtt"), "r");
+    File f = gizmoFS().open(normalizeFile("cfg/mqtt"), "r");
     if (f) {
         int l = f.readBytesUntil('|', mqttHost, MAX_MQTT_HOST_SIZE - 1);
         char port[8];
@@ -1181,20 +3192,28 @@ void ESPGizmo::loadMQTTConfig() {
         mqttPass[l] = '\0';
         l = f.readBytesUntil('|', topicPrefix, MAX_SSID_SIZE - 1);
         topicPrefix[l] = '\0';
+        char tls[4];
+        l = f.readBytesUntil('|', tls, 3);
+        tls[l] = '\0';
+        mqttTLS = tls[0] == '1';
+        l = f.readBytesUntil('|', mqttFingerprint, MAX_MQTT_FINGERPRINT_SIZE - 1);
+        mqttFingerprint[l] = '\0';
         f.close();
     }
 }
 
 void ESPGizmo::saveMQTTConfig() {
-    File f = SPIFFS.open("/cfg/mqtt", "w");
+    makeParentDirs("/cfg/mqtt");
+    File f = gizmoFS().open("/cfg/mqtt", "w");
     if (f) {
-        f.printf("%s|%d|%s|%s|%s|\n", mqttHost, mqttPort, mqttUser, mqttPass, topicPrefix);
+        f.printf("%s|%d|%s|%s|%s|%d|%s|\n", mqttHost, mqttPort, mqttUser, mqttPass, topicPrefix,
+                 mqttTLS, mqttFingerprint);
         f.close();
     }
 }
 
 void ESPGizmo::savePasskey(const char *psk) {
-    File f = SPIFFS.open(CUSTOM_PASSKEY, "w");
+    File f = gizmoFS().open(CUSTOM_PASSKEY, "w");
     if (f) {
         f.printf("%s\n", psk);
         f.close();
@@ -1204,13 +3223,13 @@ void ESPGizmo::savePasskey(const char *psk) {
 void ESPGizmo::setAlwaysOnline(bool on) {
     isAlwaysOnline = on;
     if (on) {
-        File f = SPIFFS.open(ALWAYS_ONLINE, "w");
+        File f = gizmoFS().open(ALWAYS_ONLINE, "w");
         if (f) {
             f.printf("true\n");
             f.close();
         }
     } else {
-        SPIFFS.remove(ALWAYS_ONLINE);
+        gizmoFS().remove(ALWAYS_ONLINE);
     }
 }
 
@@ -1221,9 +3240,9 @@ char *normalizeFile(const char *file) {
         return (char *) file;
     }
     snprintf(normalized, 32, "/%s", file);
-    if (SPIFFS.exists(file)) {
+    if (gizmoFS().exists(file)) {
         Serial.printf("Normalizing %s\n", file);
-        SPIFFS.rename(file, normalized);
+        gizmoFS().rename(file, normalized);
     }
     return normalized;
 }
@@ -1,10 +1,37 @@
 #pragma once
 
+#include <ESPGizmoConfig.h>
 #include <ESP8266WiFi.h>
 #include <PubSubClient.h>
 #include <ESP8266WebServer.h>
+#include <ESPGizmoWebServer.h>
 #include <ESP8266HTTPClient.h>
+#if GIZMO_WITH_NTPCLIENT
 #include <NTPClient.h>
+#endif
+#include <ESPGizmoSleep.h>
+#include <ESPGizmoTime.h>
+#include <ESPGizmoHealth.h>
+#include <ESPGizmoCoalesce.h>
+#include <ESPGizmoCBOR.h>
+#include <ESPGizmoBoot.h>
+#include <ESPGizmoWatchdog.h>
+#include <ESPGizmoScratch.h>
+#if GIZMO_WITH_FAULTS
+#include <ESPGizmoFaults.h>
+#endif
+#if GIZMO_WITH_TLS
+#include <ESPGizmoTLS.h>
+#endif
+#if GIZMO_WITH_BROKER
+#include <ESPGizmoBroker.h>
+#endif
+#if GIZMO_WITH_MULTICAST
+#include <ESPGizmoMulticast.h>
+#endif
+#if GIZMO_WITH_TRANSFER
+#include <ESPGizmoTransfer.h>
+#endif
 
 #define MAX_NAME_SIZE       64
 #define MAX_VERSION_SIZE    16
@@ -15,6 +42,17 @@
 #define MAX_MQTT_HOST_SIZE  32
 #define MAX_MQTT_USER_SIZE  32
 #define MAX_MQTT_PASS_SIZE  32
+#define MAX_MQTT_FINGERPRINT_SIZE   64
+#define MQTT_CA_FILE        "/cfg/mqttca.pem"
+
+#include <ESPGizmoNetworks.h>
+
+// Online means the broker is connected too, or that no broker is configured.
+typedef enum {
+    NETWORK_DISCONNECTED,
+    NETWORK_WIFI,
+    NETWORK_ONLINE
+} GizmoNetworkState;
 
 class ESPGizmo {
 public:
@@ -24,21 +62,57 @@ public:
     void setNoNetworkConfig();
     void suggestIP(IPAddress ipAddress);
     void alwaysOnline();
+    void asyncHTTP();
+    // Skip the fixed setup delays and hold OTA, mDNS and captive DNS until MQTT is up
+    void fastBoot();
+    void markBoot(const char *phase);
+    void coalescePublishes(uint16_t maxBytes, uint16_t maxDelay);
+    // Largest MQTT packet that can be received, or published without streaming
+    bool setMQTTBufferSize(uint16_t size);
+#if GIZMO_WITH_BROKER
+    // Serve MQTT on the soft AP whenever no Wi-Fi network is configured
+    void enableLocalBroker();
+#endif
     void beginSetup(const char *name, const char *version, const char *passkey);
     void endSetup();
 
+    // Duty-cycle mode; must be selected before beginSetup()
+    void setDutyCycle(uint32_t sleepSeconds);
+    void setSleepBackend(const GizmoSleepBackend *backend);
+    bool queueReading(const char *topic, const char *payload);
+    uint32_t getWakeCount();
+    uint32_t getSequence();
+    void sleep();
+
     const IPAddress getIP();
     const char *getName();
     const char *getHostname();
     const char *getTopicPrefix();
     const char *getSSID();
+    const char *getActiveSSID();
+    bool addNetwork(const char *ssid, const char *passkey, uint8_t priority);
+    bool removeNetwork(const char *ssid);
     const char *getMAC();
 
     void led(boolean on);
 
     void setCallback(void (*callback)(char*, uint8_t*, unsigned int));
+    // CBOR map payloads go here instead of the callback above once set
+    void setCBORCallback(void (*callback)(char*, GizmoCBORReader&));
     void addTopic(const char *topic);
     void addTopic(const char *topic, const char *uniqueName);
+
+    // Commands addressed to gizmo/control/<hostname> or gizmo/control/group/<group>;
+    // the broadcast gizmo/control topic is still honoured unless disabled.
+    void addControlGroup(const char *group);
+    void setLegacyControl(bool enabled);
+#if GIZMO_WITH_MULTICAST
+    // Also take commands and messages over LAN multicast signed with the given secret;
+    // multicast() sends to every such device at once, this one included.
+    void enableMulticastControl(const char *secret);
+    bool multicast(const char *topic, const char *payload);
+    GizmoMulticast *multicastChannel();
+#endif
     void publish(const char *topic, char *payload);
     void publish(const char *topic, char *payload, boolean retain);
     void schedulePublish(const char *topic, char *payload);
@@ -46,6 +120,14 @@ public:
 
     void publish(const char *topic, const char *payload);
     void publish(const char *topic, const char *payload, boolean retain);
+    bool publishCBOR(const char *topic, GizmoCBOREncoder encode, boolean retain);
+
+    // Streams a payload of a known total length in chunks, bypassing the MQTT buffer.
+    // Until endPublish(), other publishes fail and MQTT keep-alive is paused.
+    bool beginPublish(const char *topic, unsigned int length, boolean retain);
+    size_t writePublish(const uint8_t *data, size_t length);
+    bool endPublish();
+    bool publishFile(const char *topic, const char *path, boolean retain);
     void schedulePublish(const char *topic, const char *payload);
     void schedulePublish(const char *topic, const char *payload, boolean retain);
 
@@ -54,16 +136,55 @@ public:
     ESP8266WebServer *httpServer();
     void setUpdateURL(const char *url);
     void setUpdateURL(const char *url, void (*callback)());
+#if GIZMO_WITH_TRANSFER
+    // Accept files pushed over MQTT to gizmo/files/<topic prefix>; see ESPGizmoTransfer.h
+    void enableFileTransfer();
+    GizmoFileTransfer *fileTransfer();
+#endif
     void setupWebRoot();
+    void benchmarkFileSystem(Print &out);
+    void sizeReport(Print &out);
 
     void setupPinger();
     void handlePinger();
 
+    void setupHealthMonitor();
+    GizmoHealth *healthMonitor();
+    void setRecoveryPolicy(GizmoRecoveryPolicy policy);
+
+    void setupTime(const char *server, int16_t offsetMinutes, const GizmoDSTRule *dstRule);
+    GizmoTime *timeService();
+    uint64_t now();
+    uint64_t uptime();
+    GizmoCoalescingClient *publishCoalescer();
+#if GIZMO_WITH_TLS
+    GizmoSecureClient *mqttSecureClient();
+#endif
+#if GIZMO_WITH_BROKER
+    GizmoBroker *localBroker();
+#endif
+    void publishTimestamped(const char *topic, const char *payload, boolean retain);
+
+    // Legacy NTPClient access; prefer timeService()
     void setupNTPClient();
+#if GIZMO_WITH_NTPCLIENT
     NTPClient *timeClient();
+#endif
 
     bool isNetworkAvailable(void (*afterConnection)());
 
+    // Called on every connection state transition
+    void setNetworkStateCallback(void (*callback)(GizmoNetworkState from, GizmoNetworkState to));
+    GizmoNetworkState getNetworkState();
+    uint32_t getLastReconnectTime();
+    uint32_t getReconnects();
+    uint32_t getPublishFailures();
+    uint32_t getOversizePublishes();
+    uint32_t getLargestPublish();
+#if GIZMO_WITH_FAULTS
+    bool injectFault(const char *spec);
+#endif
+
     void scheduleRestart();
     void scheduleUpdate();
     void scheduleFileUpdate();
@@ -72,6 +193,7 @@ public:
     int updateFiles(const char *url);
 
     void handleMQTTMessage(const char *topic, const char *value);
+    void handleControlCommand(const char *command);
 
     // Not implemented yet
     void setMQTTLastWill(const char* willTopic, const char* willMessage,
@@ -96,11 +218,47 @@ private:
     char ssid[MAX_SSID_SIZE];
     char passkey[MAX_PASSKEY_SIZE];
 
+    // Optional static IP configuration; unset address means DHCP.
+    IPAddress staticIP;
+    IPAddress staticGateway;
+    IPAddress staticMask;
+    IPAddress staticDNS;
+
+    // Last successful association, used for the fast connect path.
+    uint8_t fastBSSID[6];
+    int32_t fastChannel = 0;
+    IPAddress fastIP;
+    IPAddress fastGateway;
+    IPAddress fastMask;
+    IPAddress fastDNS;
+    uint64_t fastConnectDeadline = 0;
+    // Set while associated on a cached lease whose gateway has not answered yet
+    bool leaseInUse = false;
+    uint64_t leaseCheckDeadline = 0;
+    uint64_t leaseCheckSent = 0;
+
+    // Known networks; the one from the network config is primary.
+    GizmoNetworks networks;
+    int currentNetwork = 0;
+    uint32_t triedNetworks = 0;
+    uint64_t networkDeadline = 0;
+    bool scanning = false;
+    uint64_t lastRoamCheck = 0;
+    int weakSamples = 0;
+    uint32_t roams = 0;
+
+    uint32_t dutyCycleSeconds = 0;
+    uint64_t awakeDeadline = 0;
+    const GizmoSleepBackend *sleepBackend = &espSleepBackend;
+
     char mqttHost[MAX_MQTT_HOST_SIZE];
     char mqttUser[MAX_MQTT_USER_SIZE];
     char mqttPass[MAX_MQTT_PASS_SIZE];
+    bool mqttTLS = false;
+    char mqttFingerprint[MAX_MQTT_FINGERPRINT_SIZE];
     int mqttPort = 1883;
     void (*mqttCallback)(char*, uint8_t*, unsigned int);
+    void (*cborCallback)(char*, GizmoCBORReader&) = NULL;
     char topicPrefix[MAX_SSID_SIZE];
 
     const char *willTopic = NULL;
@@ -113,15 +271,74 @@ private:
 
     WiFiClient wifiClient;
     PubSubClient *mqtt = NULL;
-    ESP8266WebServer *server = NULL;
+    GizmoCoalescingClient *coalescer = NULL;
+    uint16_t coalesceBytes = 0;
+    uint16_t coalesceDelay = 0;
+#if GIZMO_WITH_TLS
+    GizmoSecureClient *secureClient = NULL;
+#endif
+#if GIZMO_WITH_BROKER
+    GizmoBroker *broker = NULL;
+    bool brokerEnabled = false;
+    void setupLocalBroker(bool apOnly);
+#endif
+#if GIZMO_WITH_MULTICAST
+    GizmoMulticast *lanControl = NULL;
+#endif
+#if GIZMO_WITH_TRANSFER
+    GizmoFileTransfer *transfer = NULL;
+    bool transferEnabled = false;
+#endif
+    void handleLocalMessage(const char *topic, const uint8_t *payload, unsigned int length);
+    GizmoWebServer *server = NULL;
+    bool asyncHTTPEnabled = false;
+#if GIZMO_WITH_NTPCLIENT
     NTPClient *ntpClient = NULL;
+#endif
+    GizmoTime *clock = NULL;
+    GizmoHealth *health = NULL;
+    GizmoRecoveryPolicy recoveryPolicy = defaultRecoveryPolicy;
+
+    GizmoNetworkState networkState = NETWORK_DISCONNECTED;
+    void (*networkStateCallback)(GizmoNetworkState, GizmoNetworkState) = NULL;
+    WiFiEventHandler gotIPHandler;
+    WiFiEventHandler disconnectedHandler;
+    uint64_t outageStart = 0;
+    uint32_t lastReconnectTime = 0;
+    uint32_t reconnects = 0;
+    uint32_t publishFailures = 0;
+    uint32_t oversizePublishes = 0;
+    uint32_t largestPublish = 0;
+    uint16_t mqttBufferSize = 0;
+
+    char streamTopic[MAX_TOPIC_SIZE];
+    bool streaming = false;
+    bool streamRetain = false;
+    uint32_t streamLength = 0;
+    uint32_t streamWritten = 0;
+    uint8_t *streamBuffer = NULL;
+    bool mqttStreamOpen();
+#if GIZMO_WITH_FAULTS
+    GizmoFaults faults;
+    bool wifiFaultHeld = false;
+    uint64_t lastSoakReport = 0;
+    void handleFaults();
+    void publishSoakReport();
+#endif
 
     char *updateUrl = NULL;
 
     void setupWiFi();
     void setupMQTT();
+    void setupMQTTTransport();
+    void createMQTTClient();
     void setupOTA();
     void setupHTTPServer();
+    void startNetworkServices();
+    void startDeferredServices();
+    void publishBootTimeline();
+    void publishStallReports();
+    uint64_t lastStallReport = 0;
 
     void (*onUpdate)();
     int downloadAndSave(const char *url, const char *file);
@@ -129,6 +346,26 @@ private:
     void loadNetworkConfig();
     void saveNetworkConfig();
 
+    bool loadFastConnect();
+    void saveFastConnect();
+    void forgetFastConnect();
+    void applyIPConfig(bool useLease);
+    void handleFastConnectTimeout();
+    void handleLeaseCheck();
+
+    void selectNetwork();
+    void connectToNetwork(int index);
+    void handleNetworkSelection();
+    void handleRoaming();
+    void publishNetworkReport();
+    void handleNetworkAdd();
+    void handleNetworkRemove();
+
+    void scheduleApply(uint8_t what);
+    void applyPendingConfig();
+    void applyNetworkConfig();
+    void applyMQTTConfig();
+
     void loadMQTTConfig();
     void savePasskey(const char *psk);
     void saveMQTTConfig();
@@ -151,11 +388,27 @@ private:
     void preUpload();
     void startUpload();
     void handleUpload();
+    void finishFirmwareUpload();
+    void handleFirmwareUpload();
     void updateAnnounceMessage();
     void readCustomPasskey(const char *defaultPasskey);
 
+    WiFiClient &mqttSocket();
+    Client &mqttTransport();
     void restart();
     boolean mqttReconnect();
+    void dispatchMQTTMessage(char *topic, uint8_t *payload, unsigned int length);
+    void probeHealth();
+    void applyRecovery(GizmoRecovery recovery);
+    bool sendPublish(const char *topic, const char *payload, boolean retain);
+    void publishQueuedReadings();
+    void sendStateEvent(const char *state);
+    void handleAwakeDeadline();
+
+    void handleWiFiEvents();
+    void handleWiFiConnected();
+    void handleWiFiLost();
+    void setNetworkState(GizmoNetworkState state);
 
     void initToSaneValues();
 
@@ -0,0 +1,26 @@
+#include <ESPGizmoBoot.h>
+
+typedef struct {
+    const char *phase;
+    uint32_t time;
+} GizmoBootMark;
+
+static GizmoBootMark marks[MAX_BOOT_PHASES];
+static int markCount = 0;
+
+void bootMark(const char *phase) {
+    if (markCount < MAX_BOOT_PHASES) {
+        marks[markCount].phase = phase;
+        marks[markCount].time = millis();
+        markCount++;
+    }
+}
+
+int bootTimeline(char *buf, size_t size) {
+    int l = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < markCount && l < (int) size; i++) {
+        l += snprintf(buf + l, size - l, "%s%s:%u", i ? " " : "", marks[i].phase, marks[i].time);
+    }
+    return l;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <Arduino.h>
+
+#ifndef MAX_BOOT_PHASES
+#define MAX_BOOT_PHASES     16
+#endif
+
+// Records when each boot phase finished, in ms since reset. Phase names are kept by
+// pointer, so they must be string literals; marks beyond MAX_BOOT_PHASES are dropped.
+void bootMark(const char *phase);
+
+// Formats the timeline as "phase:ms" pairs, e.g. "start:72 fs:95 wifi:130 ..."
+int bootTimeline(char *buf, size_t size);
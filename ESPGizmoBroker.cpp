@@ -0,0 +1,456 @@
+#include <ESPGizmoBroker.h>
+#include <ESPGizmoScratch.h>
+
+#define MQTT_CONNECT        0x10
+#define MQTT_CONNACK        0x20
+#define MQTT_PUBLISH        0x30
+#define MQTT_PUBACK         0x40
+#define MQTT_PUBREC         0x50
+#define MQTT_PUBREL         0x60
+#define MQTT_PUBCOMP        0x70
+#define MQTT_SUBSCRIBE      0x80
+#define MQTT_SUBACK         0x90
+#define MQTT_UNSUBSCRIBE    0xa0
+#define MQTT_UNSUBACK       0xb0
+#define MQTT_PINGREQ        0xc0
+#define MQTT_PINGRESP       0xd0
+#define MQTT_DISCONNECT     0xe0
+
+#define MAX_PUBLISH_TOPIC_SIZE  128
+
+bool gizmoTopicMatches(const char *filter, const char *topic) {
+    // Wildcards never match the $SYS style topics at the first level.
+    if (*topic == '$' && (*filter == '+' || *filter == '#')) {
+        return false;
+    }
+    while (*filter) {
+        if (*filter == '#') {
+            return true;
+        }
+        if (*filter == '+') {
+            while (*topic && *topic != '/') {
+                topic++;
+            }
+            filter++;
+        } else {
+            if (*filter != *topic) {
+                // "a/#" also matches "a" itself.
+                return !*topic && filter[0] == '/' && filter[1] == '#' && !filter[2];
+            }
+            filter++;
+            topic++;
+        }
+    }
+    return !*topic;
+}
+
+static bool readLength(const uint8_t *body, uint32_t length, uint32_t &pos, uint16_t &value) {
+    if (pos + 2 > length) {
+        return false;
+    }
+    value = (body[pos] << 8) | body[pos + 1];
+    pos += 2;
+    return true;
+}
+
+static bool readString(const uint8_t *body, uint32_t length, uint32_t &pos, char *out, size_t size) {
+    uint16_t l;
+    if (!readLength(body, length, pos, l) || pos + l > length || l >= size) {
+        return false;
+    }
+    memcpy(out, body + pos, l);
+    out[l] = '\0';
+    pos += l;
+    return true;
+}
+
+GizmoBroker::GizmoBroker(GizmoBrokerListener *listener) : listener(listener) {
+    for (int i = 0; i < MAX_RETAINED_MESSAGES; i++) {
+        retained[i].topic[0] = '\0';
+    }
+}
+
+GizmoBroker::~GizmoBroker() {
+    stop();
+    delete listener;
+}
+
+void GizmoBroker::begin() {
+    listener->begin();
+    Serial.printf("Local MQTT broker started\n");
+}
+
+void GizmoBroker::stop() {
+    for (int i = 0; i < MAX_BROKER_SESSIONS; i++) {
+        if (slots[i].active) {
+            close(&slots[i]);
+        }
+    }
+    listener->stop();
+}
+
+void GizmoBroker::setLocalCallback(GizmoBrokerCallback callback) {
+    localCallback = callback;
+}
+
+int GizmoBroker::sessions() {
+    int n = 0;
+    for (int i = 0; i < MAX_BROKER_SESSIONS; i++) {
+        n += slots[i].connected;
+    }
+    return n;
+}
+
+void GizmoBroker::loop() {
+    accept();
+    uint32_t now = millis();
+    for (int i = 0; i < MAX_BROKER_SESSIONS; i++) {
+        GizmoBrokerSession *session = &slots[i];
+        if (!session->active) {
+            continue;
+        }
+        receive(session);
+        if (!session->active) {
+            continue;
+        }
+        if (!session->link->connected() ||
+            (!session->connected && now - session->lastSeen > BROKER_CONNECT_TIMEOUT) ||
+            (session->keepAlive && now - session->lastSeen > session->keepAlive * 1500UL)) {
+            close(session);
+        }
+    }
+}
+
+void GizmoBroker::accept() {
+    GizmoBrokerLink *link;
+    while ((link = listener->accept())) {
+        GizmoBrokerSession *session = NULL;
+        for (int i = 0; i < MAX_BROKER_SESSIONS && !session; i++) {
+            if (!slots[i].active) {
+                session = &slots[i];
+            }
+        }
+        if (!session) {
+            rejected++;
+            link->stop();
+            delete link;
+            continue;
+        }
+        session->link = link;
+        session->active = true;
+        session->connected = false;
+        session->keepAlive = 0;
+        session->lastSeen = millis();
+        session->rxLength = 0;
+        for (int f = 0; f < MAX_BROKER_SUBSCRIPTIONS; f++) {
+            session->filters[f][0] = '\0';
+        }
+    }
+}
+
+void GizmoBroker::close(GizmoBrokerSession *session) {
+    if (!session->active) {
+        return;
+    }
+    session->link->stop();
+    delete session->link;
+    session->link = NULL;
+    session->active = false;
+    session->connected = false;
+}
+
+void GizmoBroker::receive(GizmoBrokerSession *session) {
+    while (session->active && session->link->available()) {
+        int n = session->link->read(session->rx + session->rxLength, BROKER_PACKET_SIZE - session->rxLength);
+        if (n <= 0) {
+            return;
+        }
+        session->rxLength += n;
+        session->lastSeen = millis();
+
+        // Handle every complete packet in the buffer.
+        while (session->active && session->rxLength >= 2) {
+            uint32_t length = 0;
+            uint32_t header = 1;
+            uint8_t b = 0;
+            do {
+                if (header >= session->rxLength) {
+                    break;
+                }
+                b = session->rx[header];
+                length |= (uint32_t) (b & 0x7f) << (7 * (header - 1));
+                header++;
+            } while ((b & 0x80) && header < 5);
+
+            if (b & 0x80) {
+                if (header >= 5) {
+                    close(session);
+                    return;
+                }
+                break;
+            }
+            if (header + length > BROKER_PACKET_SIZE) {
+                Serial.printf("Local broker dropping peer with %u byte packet\n", header + length);
+                dropped++;
+                close(session);
+                return;
+            }
+            if (header + length > session->rxLength) {
+                break;
+            }
+            if (!handlePacket(session, session->rx[0], session->rx + header, length)) {
+                close(session);
+                return;
+            }
+            session->rxLength -= header + length;
+            memmove(session->rx, session->rx + header + length, session->rxLength);
+        }
+        if (session->rxLength == BROKER_PACKET_SIZE) {
+            close(session);
+            return;
+        }
+    }
+}
+
+bool GizmoBroker::handlePacket(GizmoBrokerSession *session, uint8_t type, uint8_t *body, uint32_t length) {
+    if (!session->connected) {
+        // The first packet must be CONNECT.
+        return (type & 0xf0) == MQTT_CONNECT && handleConnect(session, body, length);
+    }
+    switch (type & 0xf0) {
+        case MQTT_PUBLISH:
+            return handlePublish(session, type & 0x0f, body, length);
+        case MQTT_PUBREL:
+            return length >= 2 && sendAck(session, MQTT_PUBCOMP, body, 2);
+        case MQTT_SUBSCRIBE:
+            return handleSubscribe(session, body, length);
+        case MQTT_UNSUBSCRIBE:
+            return handleUnsubscribe(session, body, length);
+        case MQTT_PINGREQ:
+            return sendAck(session, MQTT_PINGRESP, NULL, 0);
+        case MQTT_PUBACK:
+        case MQTT_PUBREC:
+        case MQTT_PUBCOMP:
+            // Everything is sent at QoS 0, so there's nothing to acknowledge.
+            return true;
+        default:
+            // DISCONNECT, a second CONNECT, or something we don't speak
+            return false;
+    }
+}
+
+bool GizmoBroker::handleConnect(GizmoBrokerSession *session, uint8_t *body, uint32_t length) {
+    char protocol[8];
+    uint32_t pos = 0;
+    if (!readString(body, length, pos, protocol, sizeof(protocol)) || pos + 4 > length) {
+        return false;
+    }
+    uint8_t level = body[pos];
+    session->keepAlive = (body[pos + 2] << 8) | body[pos + 3];
+
+    uint8_t ack[2] = {0, 0};
+    if (!((!strcmp(protocol, "MQTT") && level == 4) || (!strcmp(protocol, "MQIsdp") && level == 3))) {
+        // Unacceptable protocol version
+        ack[1] = 1;
+        sendAck(session, MQTT_CONNACK, ack, 2);
+        return false;
+    }
+    session->connected = true;
+    return sendAck(session, MQTT_CONNACK, ack, 2);
+}
+
+bool GizmoBroker::handlePublish(GizmoBrokerSession *session, uint8_t flags, uint8_t *body, uint32_t length) {
+    char topic[MAX_PUBLISH_TOPIC_SIZE];
+    uint32_t pos = 0;
+    uint8_t qos = (flags >> 1) & 0x03;
+    if (!readString(body, length, pos, topic, sizeof(topic)) || qos == 3 || (qos && pos + 2 > length)) {
+        return false;
+    }
+    uint8_t *id = body + pos;
+    if (qos) {
+        pos += 2;
+    }
+    route(topic, body + pos, length - pos, flags & 0x01);
+    if (!session->active) {
+        // The echo to the sender's own subscription failed and closed it.
+        return false;
+    }
+    if (qos == 1) {
+        return sendAck(session, MQTT_PUBACK, id, 2);
+    } else if (qos == 2) {
+        return sendAck(session, MQTT_PUBREC, id, 2);
+    }
+    return true;
+}
+
+bool GizmoBroker::handleSubscribe(GizmoBrokerSession *session, uint8_t *body, uint32_t length) {
+    uint8_t reply[2 + MAX_BROKER_SUBACK_CODES];
+    int8_t granted[MAX_BROKER_SUBACK_CODES];
+    char filter[MAX_BROKER_FILTER_SIZE];
+    uint32_t pos = 2;
+    int count = 0;
+    if (length < 2) {
+        return false;
+    }
+    reply[0] = body[0];
+    reply[1] = body[1];
+
+    // Every filter gets a return code, in order; those that can't be held get 0x80.
+    while (pos < length) {
+        uint16_t l;
+        if (count == MAX_BROKER_SUBACK_CODES || !readLength(body, length, pos, l) || pos + l >= length) {
+            return false;
+        }
+        int slot = -1;
+        if (l && l < sizeof(filter)) {
+            memcpy(filter, body + pos, l);
+            filter[l] = '\0';
+            for (int f = 0; f < MAX_BROKER_SUBSCRIPTIONS; f++) {
+                if (!strcmp(session->filters[f], filter)) {
+                    slot = f;
+                    break;
+                } else if (slot < 0 && !session->filters[f][0]) {
+                    slot = f;
+                }
+            }
+        }
+        pos += l + 1;  // the filter and its requested QoS; everything is granted at 0
+        if (slot >= 0) {
+            strcpy(session->filters[slot], filter);
+        }
+        granted[count] = slot;
+        reply[2 + count] = slot >= 0 ? 0x00 : 0x80;
+        count++;
+    }
+    if (!count || !sendAck(session, MQTT_SUBACK, reply, 2 + count)) {
+        return false;
+    }
+    // Replay the matching retained messages for each accepted filter.
+    for (int i = 0; i < count; i++) {
+        if (granted[i] >= 0) {
+            sendRetained(session, session->filters[granted[i]]);
+        }
+    }
+    return true;
+}
+
+bool GizmoBroker::handleUnsubscribe(GizmoBrokerSession *session, uint8_t *body, uint32_t length) {
+    char filter[MAX_BROKER_FILTER_SIZE];
+    uint32_t pos = 2;
+    if (length < 2) {
+        return false;
+    }
+    while (pos < length && readString(body, length, pos, filter, sizeof(filter))) {
+        for (int f = 0; f < MAX_BROKER_SUBSCRIPTIONS; f++) {
+            if (!strcmp(session->filters[f], filter)) {
+                session->filters[f][0] = '\0';
+            }
+        }
+    }
+    return sendAck(session, MQTT_UNSUBACK, body, 2);
+}
+
+void GizmoBroker::publish(const char *topic, const uint8_t *payload, unsigned int length, bool retain) {
+    route(topic, payload, length, retain);
+}
+
+void GizmoBroker::route(const char *topic, const uint8_t *payload, unsigned int length, bool retainMessage) {
+    if (retainMessage) {
+        retain(topic, payload, length);
+    }
+    for (int i = 0; i < MAX_BROKER_SESSIONS; i++) {
+        GizmoBrokerSession *session = &slots[i];
+        if (!session->connected) {
+            continue;
+        }
+        for (int f = 0; f < MAX_BROKER_SUBSCRIPTIONS; f++) {
+            if (session->filters[f][0] && gizmoTopicMatches(session->filters[f], topic)) {
+                if (!send(session, topic, payload, length, false)) {
+                    close(session);
+                }
+                break;
+            }
+        }
+    }
+    // Anything the local handler publishes in response still reaches the peers,
+    // but is not handed back to it.
+    if (localCallback && !routing) {
+        routing = true;
+        localCallback(topic, payload, length);
+        routing = false;
+    }
+}
+
+void GizmoBroker::retain(const char *topic, const uint8_t *payload, unsigned int length) {
+    GizmoRetainedMessage *slot = NULL;
+    for (int i = 0; i < MAX_RETAINED_MESSAGES; i++) {
+        if (!strcmp(retained[i].topic, topic)) {
+            slot = &retained[i];
+            break;
+        } else if (!slot && !retained[i].topic[0]) {
+            slot = &retained[i];
+        }
+    }
+    if (!length) {
+        // An empty retained message clears the topic.
+        if (slot && !strcmp(slot->topic, topic)) {
+            slot->topic[0] = '\0';
+        }
+        return;
+    }
+    if (!slot || strlen(topic) >= MAX_RETAINED_TOPIC_SIZE || length > MAX_RETAINED_PAYLOAD_SIZE) {
+        dropped++;
+        return;
+    }
+    strcpy(slot->topic, topic);
+    memcpy(slot->payload, payload, length);
+    slot->length = length;
+}
+
+void GizmoBroker::sendRetained(GizmoBrokerSession *session, const char *filter) {
+    for (int i = 0; i < MAX_RETAINED_MESSAGES; i++) {
+        if (retained[i].topic[0] && gizmoTopicMatches(filter, retained[i].topic)) {
+            send(session, retained[i].topic, retained[i].payload, retained[i].length, true);
+        }
+    }
+}
+
+bool GizmoBroker::send(GizmoBrokerSession *session, const char *topic, const uint8_t *payload,
+                       unsigned int length, bool retainFlag) {
+    size_t topicLength = strlen(topic);
+    uint32_t remaining = 2 + topicLength + length;
+
+    // Build the whole packet so it leaves in one segment.
+    GizmoScratch packet(5 + remaining);
+    uint8_t *p = packet.bytes();
+    if (!packet.size()) {
+        return false;
+    }
+    *p++ = MQTT_PUBLISH | (retainFlag ? 0x01 : 0x00);
+    uint32_t l = remaining;
+    do {
+        *p = l & 0x7f;
+        l >>= 7;
+        *p++ |= l ? 0x80 : 0x00;
+    } while (l);
+    *p++ = topicLength >> 8;
+    *p++ = topicLength & 0xff;
+    memcpy(p, topic, topicLength);
+    p += topicLength;
+    memcpy(p, payload, length);
+    p += length;
+
+    size_t size = p - packet.bytes();
+    delivered++;
+    return session->link->write(packet.bytes(), size) == size;
+}
+
+bool GizmoBroker::sendAck(GizmoBrokerSession *session, uint8_t type, const uint8_t *data, int count) {
+    uint8_t packet[2 + 2 + MAX_BROKER_SUBACK_CODES];
+    packet[0] = type;
+    packet[1] = count;
+    if (count) {
+        memcpy(packet + 2, data, count);
+    }
+    return session->link->write(packet, 2 + count) == (size_t) (2 + count);
+}
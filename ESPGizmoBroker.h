@@ -0,0 +1,117 @@
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+
+// Minimal MQTT 3.1.1 broker for peers on the soft AP while there is no uplink.
+// Deliveries are QoS 0; QoS 1 and 2 publishes are acknowledged and then delivered
+// at QoS 0. Will messages and persistent sessions are not supported. The session
+// logic only sees the transport below, so it runs on the host over plain sockets.
+#define BROKER_PORT                 1883
+
+#ifndef MAX_BROKER_SESSIONS
+#define MAX_BROKER_SESSIONS         4
+#endif
+#define MAX_BROKER_SUBSCRIPTIONS    6
+#define MAX_BROKER_FILTER_SIZE      48
+#ifndef MAX_RETAINED_MESSAGES
+#define MAX_RETAINED_MESSAGES       8
+#endif
+#define MAX_RETAINED_TOPIC_SIZE     48
+#define MAX_RETAINED_PAYLOAD_SIZE   64
+
+// Largest packet a peer may send; anything bigger closes its session.
+#define BROKER_PACKET_SIZE          320
+#define BROKER_CONNECT_TIMEOUT      5000
+// A SUBSCRIBE that fits in a packet carries at most this many filters, each of at
+// least a length, one character and a QoS byte.
+#define MAX_BROKER_SUBACK_CODES     (BROKER_PACKET_SIZE / 4)
+
+static_assert(2 + MAX_BROKER_SUBACK_CODES < 128, "SUBACK length must fit in one byte");
+
+typedef std::function<void(const char *topic, const uint8_t *payload, unsigned int length)> GizmoBrokerCallback;
+
+// One peer connection; closed and deleted by the broker when its session ends.
+class GizmoBrokerLink {
+public:
+    virtual ~GizmoBrokerLink() {}
+    virtual int available() = 0;
+    virtual int read(uint8_t *buffer, size_t size) = 0;
+    virtual size_t write(const uint8_t *data, size_t length) = 0;
+    virtual bool connected() = 0;
+    virtual void stop() = 0;
+};
+
+// Where peer connections come from; owned by the broker.
+class GizmoBrokerListener {
+public:
+    virtual ~GizmoBrokerListener() {}
+    virtual void begin() = 0;
+    virtual void stop() = 0;
+    // The next pending connection, or NULL
+    virtual GizmoBrokerLink *accept() = 0;
+};
+
+class GizmoBrokerSession {
+public:
+    GizmoBrokerLink *link = NULL;
+    bool active = false;
+    bool connected = false;
+    uint16_t keepAlive = 0;
+    uint32_t lastSeen = 0;
+    uint16_t rxLength = 0;
+    uint8_t rx[BROKER_PACKET_SIZE];
+    char filters[MAX_BROKER_SUBSCRIPTIONS][MAX_BROKER_FILTER_SIZE];
+};
+
+typedef struct {
+    char topic[MAX_RETAINED_TOPIC_SIZE];
+    uint8_t payload[MAX_RETAINED_PAYLOAD_SIZE];
+    uint16_t length;
+} GizmoRetainedMessage;
+
+class GizmoBroker {
+public:
+    GizmoBroker(GizmoBrokerListener *listener);
+    ~GizmoBroker();
+
+    void begin();
+    void stop();
+    void loop();
+
+    // Messages published by peers or locally are also handed to this callback.
+    void setLocalCallback(GizmoBrokerCallback callback);
+    void publish(const char *topic, const uint8_t *payload, unsigned int length, bool retain);
+
+    int sessions();
+
+    uint32_t delivered = 0;
+    uint32_t rejected = 0;
+    uint32_t dropped = 0;
+
+private:
+    void accept();
+    void receive(GizmoBrokerSession *session);
+    bool handlePacket(GizmoBrokerSession *session, uint8_t type, uint8_t *body, uint32_t length);
+    bool handleConnect(GizmoBrokerSession *session, uint8_t *body, uint32_t length);
+    bool handlePublish(GizmoBrokerSession *session, uint8_t flags, uint8_t *body, uint32_t length);
+    bool handleSubscribe(GizmoBrokerSession *session, uint8_t *body, uint32_t length);
+    bool handleUnsubscribe(GizmoBrokerSession *session, uint8_t *body, uint32_t length);
+    void close(GizmoBrokerSession *session);
+
+    void route(const char *topic, const uint8_t *payload, unsigned int length, bool retain);
+    void retain(const char *topic, const uint8_t *payload, unsigned int length);
+    void sendRetained(GizmoBrokerSession *session, const char *filter);
+    bool send(GizmoBrokerSession *session, const char *topic, const uint8_t *payload,
+              unsigned int length, bool retain);
+    bool sendAck(GizmoBrokerSession *session, uint8_t type, const uint8_t *id, int count);
+
+    GizmoBrokerListener *listener;
+    GizmoBrokerSession slots[MAX_BROKER_SESSIONS];
+    GizmoRetainedMessage retained[MAX_RETAINED_MESSAGES];
+    GizmoBrokerCallback localCallback = NULL;
+    bool routing = false;
+};
+
+// MQTT topic filter matching with + and # wildcards
+bool gizmoTopicMatches(const char *filter, const char *topic);
@@ -0,0 +1,50 @@
+#include <ESPGizmoBrokerWiFi.h>
+
+class GizmoWiFiBrokerLink : public GizmoBrokerLink {
+public:
+    GizmoWiFiBrokerLink(const WiFiClient &client) : client(client) {
+        this->client.setNoDelay(true);
+    }
+
+    int available() override {
+        return client.available();
+    }
+
+    int read(uint8_t *buffer, size_t size) override {
+        return client.read(buffer, size);
+    }
+
+    size_t write(const uint8_t *data, size_t length) override {
+        return client.write(data, length);
+    }
+
+    bool connected() override {
+        return client.connected();
+    }
+
+    void stop() override {
+        client.stop();
+    }
+
+private:
+    WiFiClient client;
+};
+
+GizmoWiFiBrokerListener::GizmoWiFiBrokerListener(uint16_t port) : server(port) {
+}
+
+void GizmoWiFiBrokerListener::begin() {
+    server.begin();
+    server.setNoDelay(true);
+}
+
+void GizmoWiFiBrokerListener::stop() {
+    server.stop();
+}
+
+GizmoBrokerLink *GizmoWiFiBrokerListener::accept() {
+    if (!server.hasClient()) {
+        return NULL;
+    }
+    return new GizmoWiFiBrokerLink(server.available());
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <ESP8266WiFi.h>
+#include <ESPGizmoBroker.h>
+
+// The local broker's transport on the device: a TCP server on the soft AP.
+class GizmoWiFiBrokerListener : public GizmoBrokerListener {
+public:
+    GizmoWiFiBrokerListener(uint16_t port = BROKER_PORT);
+
+    void begin() override;
+    void stop() override;
+    GizmoBrokerLink *accept() override;
+
+private:
+    WiFiServer server;
+};
@@ -0,0 +1,305 @@
+#include <ESPGizmoCBOR.h>
+
+GizmoCBORWriter::GizmoCBORWriter(Print *out) : out(out) {
+}
+
+void GizmoCBORWriter::put(const uint8_t *data, size_t size) {
+    if (out) {
+        out->write(data, size);
+    }
+    written += size;
+}
+
+void GizmoCBORWriter::head(uint8_t major, uint64_t value) {
+    uint8_t buf[9];
+    size_t l;
+    major <<= 5;
+    if (value < 24) {
+        buf[0] = major | value;
+        l = 1;
+    } else if (value <= 0xff) {
+        buf[0] = major | 24;
+        l = 2;
+    } else if (value <= 0xffff) {
+        buf[0] = major | 25;
+        l = 3;
+    } else if (value <= 0xffffffff) {
+        buf[0] = major | 26;
+        l = 5;
+    } else {
+        buf[0] = major | 27;
+        l = 9;
+    }
+    // Argument follows the initial byte in network byte order.
+    for (size_t i = l - 1; i > 0; i--) {
+        buf[i] = value & 0xff;
+        value >>= 8;
+    }
+    put(buf, l);
+}
+
+void GizmoCBORWriter::beginMap(uint32_t pairs) {
+    head(CBOR_MAP, pairs);
+}
+
+void GizmoCBORWriter::beginArray(uint32_t items) {
+    head(CBOR_ARRAY, items);
+}
+
+void GizmoCBORWriter::text(const char *s) {
+    size_t l = strlen(s);
+    head(CBOR_TEXT, l);
+    put((const uint8_t *) s, l);
+}
+
+void GizmoCBORWriter::bytes(const uint8_t *data, size_t size) {
+    head(CBOR_BYTES, size);
+    put(data, size);
+}
+
+void GizmoCBORWriter::uint(uint64_t value) {
+    head(CBOR_UINT, value);
+}
+
+void GizmoCBORWriter::integer(int64_t value) {
+    if (value < 0) {
+        head(CBOR_NINT, (uint64_t) (-1 - value));
+    } else {
+        head(CBOR_UINT, value);
+    }
+}
+
+void GizmoCBORWriter::boolean(bool value) {
+    uint8_t b = value ? 0xf5 : 0xf4;
+    put(&b, 1);
+}
+
+void GizmoCBORWriter::null() {
+    uint8_t b = 0xf6;
+    put(&b, 1);
+}
+
+void GizmoCBORWriter::number(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint8_t buf[5] = {0xfa, (uint8_t) (bits >> 24), (uint8_t) (bits >> 16), (uint8_t) (bits >> 8), (uint8_t) bits};
+    put(buf, sizeof(buf));
+}
+
+size_t GizmoCBORWriter::length() {
+    return written;
+}
+
+
+GizmoCBORReader::GizmoCBORReader(const uint8_t *data, size_t size) : data(data), size(size) {
+}
+
+bool GizmoCBORReader::fail() {
+    failed = true;
+    return false;
+}
+
+bool GizmoCBORReader::ok() {
+    return !failed;
+}
+
+bool GizmoCBORReader::atEnd() {
+    return pos >= size;
+}
+
+bool GizmoCBORReader::head(uint8_t &major, uint64_t &value, uint8_t &info) {
+    if (failed || pos >= size) {
+        return fail();
+    }
+    major = data[pos] >> 5;
+    info = data[pos] & 0x1f;
+    pos++;
+    if (info < 24) {
+        value = info;
+        return true;
+    }
+    if (info > 27) {
+        // Reserved, or an indefinite length
+        return fail();
+    }
+    size_t l = 1 << (info - 24);
+    if (pos + l > size) {
+        return fail();
+    }
+    value = 0;
+    for (size_t i = 0; i < l; i++) {
+        value = (value << 8) | data[pos++];
+    }
+    return true;
+}
+
+uint8_t GizmoCBORReader::peekType() {
+    return failed || pos >= size ? CBOR_INVALID : data[pos] >> 5;
+}
+
+bool GizmoCBORReader::readMap(uint32_t &pairs) {
+    uint8_t major, info;
+    uint64_t value;
+    if (!head(major, value, info) || major != CBOR_MAP) {
+        return fail();
+    }
+    pairs = value;
+    return true;
+}
+
+bool GizmoCBORReader::readArray(uint32_t &items) {
+    uint8_t major, info;
+    uint64_t value;
+    if (!head(major, value, info) || major != CBOR_ARRAY) {
+        return fail();
+    }
+    items = value;
+    return true;
+}
+
+bool GizmoCBORReader::readBytes(const uint8_t *&bytes, size_t &length) {
+    uint8_t major, info;
+    uint64_t value;
+    if (!head(major, value, info) || (major != CBOR_BYTES && major != CBOR_TEXT) || value > size - pos) {
+        return fail();
+    }
+    bytes = data + pos;
+    length = value;
+    pos += value;
+    return true;
+}
+
+bool GizmoCBORReader::readText(char *buf, size_t bufSize) {
+    if (peekType() != CBOR_TEXT) {
+        return fail();
+    }
+    const uint8_t *text;
+    size_t length;
+    if (!readBytes(text, length) || length >= bufSize) {
+        return fail();
+    }
+    memcpy(buf, text, length);
+    buf[length] = '\0';
+    return true;
+}
+
+bool GizmoCBORReader::readUint(uint64_t &value) {
+    uint8_t major, info;
+    if (!head(major, value, info) || major != CBOR_UINT) {
+        return fail();
+    }
+    return true;
+}
+
+bool GizmoCBORReader::readInt(int64_t &value) {
+    uint8_t major, info;
+    uint64_t v;
+    if (!head(major, v, info) || (major != CBOR_UINT && major != CBOR_NINT) || v > INT64_MAX) {
+        return fail();
+    }
+    value = major == CBOR_NINT ? -1 - (int64_t) v : (int64_t) v;
+    return true;
+}
+
+bool GizmoCBORReader::readBool(bool &value) {
+    if (failed || pos >= size || (data[pos] != 0xf4 && data[pos] != 0xf5)) {
+        return fail();
+    }
+    value = data[pos++] == 0xf5;
+    return true;
+}
+
+bool GizmoCBORReader::readFloat(float &value) {
+    uint8_t major, info;
+    uint64_t v;
+    if (peekType() == CBOR_UINT || peekType() == CBOR_NINT) {
+        // Senders may shorten whole numbers to integers.
+        int64_t i;
+        if (!readInt(i)) {
+            return false;
+        }
+        value = i;
+        return true;
+    }
+    if (!head(major, v, info) || major != CBOR_SIMPLE || info < 25) {
+        return fail();
+    }
+    if (info == 25) {
+        // Half precision
+        int exponent = (v >> 10) & 0x1f;
+        float mantissa = v & 0x3ff;
+        if (exponent == 0) {
+            value = ldexpf(mantissa, -24);
+        } else if (exponent == 31) {
+            value = mantissa ? NAN : INFINITY;
+        } else {
+            value = ldexpf(mantissa + 1024, exponent - 25);
+        }
+        if (v & 0x8000) {
+            value = -value;
+        }
+    } else if (info == 26) {
+        uint32_t bits = v;
+        memcpy(&value, &bits, sizeof(value));
+    } else {
+        double d;
+        memcpy(&d, &v, sizeof(d));
+        value = d;
+    }
+    return true;
+}
+
+bool GizmoCBORReader::skip() {
+    // Items still to skip at each nesting level
+    uint64_t pending[CBOR_MAX_DEPTH];
+    int depth = 0;
+    pending[0] = 1;
+    while (depth >= 0) {
+        if (!pending[depth]) {
+            depth--;
+            continue;
+        }
+        pending[depth]--;
+
+        uint8_t major, info;
+        uint64_t value;
+        if (!head(major, value, info)) {
+            return false;
+        }
+        if (major == CBOR_BYTES || major == CBOR_TEXT) {
+            if (value > size - pos) {
+                return fail();
+            }
+            pos += value;
+        } else if (major == CBOR_ARRAY || major == CBOR_MAP || major == CBOR_TAG) {
+            uint64_t items = major == CBOR_MAP ? value * 2 : major == CBOR_ARRAY ? value : 1;
+            if (depth + 1 >= CBOR_MAX_DEPTH) {
+                return fail();
+            }
+            pending[++depth] = items;
+        }
+    }
+    return true;
+}
+
+bool GizmoCBORReader::find(uint32_t pairs, const char *key) {
+    size_t keyLength = strlen(key);
+    for (uint32_t i = 0; i < pairs; i++) {
+        const uint8_t *name;
+        size_t length;
+        if (peekType() != CBOR_TEXT || !readBytes(name, length)) {
+            return fail();
+        }
+        if (length == keyLength && !memcmp(name, key, length)) {
+            return true;
+        }
+        if (!skip()) {
+            return false;
+        }
+    }
+    return false;
+}
+
+bool isCBORMap(const uint8_t *payload, unsigned int length) {
+    return length && (payload[0] >> 5) == CBOR_MAP;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+
+// CBOR (RFC 8949) major types
+#define CBOR_UINT       0
+#define CBOR_NINT       1
+#define CBOR_BYTES      2
+#define CBOR_TEXT       3
+#define CBOR_ARRAY      4
+#define CBOR_MAP        5
+#define CBOR_TAG        6
+#define CBOR_SIMPLE     7
+#define CBOR_INVALID    0xff
+
+// Nesting accepted by GizmoCBORReader::skip()
+#define CBOR_MAX_DEPTH  8
+
+// Streaming CBOR encoder. Writes straight to a Print, such as the MQTT client between
+// beginPublish() and endPublish(); without one it only counts the bytes it would write,
+// which is how the packet length is found before publishing.
+class GizmoCBORWriter {
+public:
+    GizmoCBORWriter(Print *out);
+
+    void beginMap(uint32_t pairs);
+    void beginArray(uint32_t items);
+    void text(const char *s);
+    void bytes(const uint8_t *data, size_t size);
+    void uint(uint64_t value);
+    void integer(int64_t value);
+    void boolean(bool value);
+    void null();
+    void number(float value);
+
+    size_t length();
+
+private:
+    void head(uint8_t major, uint64_t value);
+    void put(const uint8_t *data, size_t size);
+
+    Print *out;
+    size_t written = 0;
+};
+
+typedef std::function<void(GizmoCBORWriter &)> GizmoCBOREncoder;
+
+// Pull decoder over a received payload. Each read consumes one item and returns false,
+// leaving the reader failed, if the next item is not of the requested type.
+// Indefinite-length items are not supported.
+class GizmoCBORReader {
+public:
+    GizmoCBORReader(const uint8_t *data, size_t size);
+
+    uint8_t peekType();
+    bool readMap(uint32_t &pairs);
+    bool readArray(uint32_t &items);
+    bool readText(char *buf, size_t size);
+    bool readBytes(const uint8_t *&data, size_t &size);
+    bool readUint(uint64_t &value);
+    bool readInt(int64_t &value);
+    bool readBool(bool &value);
+    bool readFloat(float &value);
+    bool skip();
+
+    // Within a map of the given number of pairs, positions the reader at the value for key.
+    bool find(uint32_t pairs, const char *key);
+
+    bool ok();
+    bool atEnd();
+
+private:
+    bool head(uint8_t &major, uint64_t &value, uint8_t &info);
+    bool fail();
+
+    const uint8_t *data;
+    size_t size;
+    size_t pos = 0;
+    bool failed = false;
+};
+
+// Valid UTF-8 text never starts with 0xa0-0xbf, the first byte of every CBOR map.
+bool isCBORMap(const uint8_t *payload, unsigned int length);
@@ -0,0 +1,111 @@
+#include <ESPGizmoCoalesce.h>
+
+GizmoCoalescingClient::GizmoCoalescingClient(Client &client, uint16_t maxBytes, uint16_t maxDelay)
+        : client(client), maxBytes(maxBytes), maxDelay(maxDelay) {
+    buffer = (uint8_t *) malloc(maxBytes);
+    if (!buffer) {
+        Serial.printf("Unable to allocate %u byte publish buffer\n", maxBytes);
+        this->maxBytes = 0;
+    }
+}
+
+GizmoCoalescingClient::~GizmoCoalescingClient() {
+    free(buffer);
+}
+
+void GizmoCoalescingClient::hold() {
+    holding = true;
+    packets++;
+}
+
+void GizmoCoalescingClient::release() {
+    holding = false;
+}
+
+void GizmoCoalescingClient::loop() {
+    if (used && millis() - heldSince >= maxDelay) {
+        flushHeld();
+    }
+}
+
+bool GizmoCoalescingClient::flushHeld() {
+    if (!used) {
+        return true;
+    }
+    size_t sent = client.write(buffer, used);
+    bool ok = sent == used;
+    writes++;
+    if (!ok) {
+        droppedBytes += used - sent;
+    }
+    used = 0;
+    return ok;
+}
+
+int GizmoCoalescingClient::connect(IPAddress ip, uint16_t port) {
+    droppedBytes += used;
+    used = 0;
+    return client.connect(ip, port);
+}
+
+int GizmoCoalescingClient::connect(const char *host, uint16_t port) {
+    droppedBytes += used;
+    used = 0;
+    return client.connect(host, port);
+}
+
+size_t GizmoCoalescingClient::write(uint8_t b) {
+    return write(&b, 1);
+}
+
+size_t GizmoCoalescingClient::write(const uint8_t *buf, size_t size) {
+    if (!holding || size > maxBytes) {
+        // Not a held publish, or one too big to ever buffer; keep the wire order.
+        flushHeld();
+        writes++;
+        return client.write(buf, size);
+    }
+    if (used + size > maxBytes) {
+        flushHeld();
+    }
+    if (!used) {
+        heldSince = millis();
+    }
+    memcpy(buffer + used, buf, size);
+    used += size;
+    return size;
+}
+
+int GizmoCoalescingClient::available() {
+    return client.available();
+}
+
+int GizmoCoalescingClient::read() {
+    return client.read();
+}
+
+int GizmoCoalescingClient::read(uint8_t *buf, size_t size) {
+    return client.read(buf, size);
+}
+
+int GizmoCoalescingClient::peek() {
+    return client.peek();
+}
+
+void GizmoCoalescingClient::flush() {
+    flushHeld();
+    client.flush();
+}
+
+void GizmoCoalescingClient::stop() {
+    flushHeld();
+    client.stop();
+}
+
+uint8_t GizmoCoalescingClient::connected() {
+    return client.connected();
+}
+
+GizmoCoalescingClient::operator bool() {
+    return client;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Client.h>
+
+// Client wrapper that holds PUBLISH packets written while holding() and sends them
+// together in one write. Anything written outside a hold (CONNECT, SUBSCRIBE, PINGREQ,
+// DISCONNECT) first flushes what is buffered, so packet order on the wire is kept.
+// Only QoS 0 publishes are held; they expect no reply, so reads never wait on the buffer.
+class GizmoCoalescingClient : public Client {
+public:
+    GizmoCoalescingClient(Client &client, uint16_t maxBytes, uint16_t maxDelay);
+    ~GizmoCoalescingClient();
+
+    // Buffer writes until release(); the buffer is flushed once full or when loop()
+    // finds the oldest held packet older than maxDelay ms.
+    void hold();
+    void release();
+    void loop();
+    bool flushHeld();
+
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char *host, uint16_t port);
+    size_t write(uint8_t b);
+    size_t write(const uint8_t *buf, size_t size);
+    int available();
+    int read();
+    int read(uint8_t *buf, size_t size);
+    int peek();
+    void flush();
+    void stop();
+    uint8_t connected();
+    operator bool();
+
+    uint32_t packets = 0;
+    uint32_t writes = 0;
+    uint32_t droppedBytes = 0;
+
+private:
+    Client &client;
+    uint8_t *buffer;
+    uint16_t maxBytes;
+    uint16_t maxDelay;
+    uint16_t used = 0;
+    uint32_t heldSince = 0;
+    bool holding = false;
+};
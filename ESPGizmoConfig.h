@@ -0,0 +1,65 @@
+#pragma once
+
+// Compile-time configuration of the gizmo core. Every option can be overridden from
+// the build, e.g. PlatformIO build_flags = -DGIZMO_WITH_OTA=0 -DMAX_TOPIC_COUNT=4.
+// The library is compiled separately from the sketch, so defining these in the
+// sketch itself has no effect; they must be global build flags.
+
+// Optional subsystems; disabling one drops its library and its code from the image.
+#ifndef GIZMO_WITH_OTA
+#define GIZMO_WITH_OTA              1       // ArduinoOTA push updates
+#endif
+#ifndef GIZMO_WITH_MDNS
+#define GIZMO_WITH_MDNS             1       // <hostname>.local advertisement
+#endif
+#ifndef GIZMO_WITH_CAPTIVE_PORTAL
+#define GIZMO_WITH_CAPTIVE_PORTAL   1       // DNSServer and the hotspot detection page
+#endif
+#ifndef GIZMO_WITH_HEALTH
+#define GIZMO_WITH_HEALTH           1       // Pinger-based link health monitor
+#endif
+#ifndef GIZMO_WITH_NTPCLIENT
+#define GIZMO_WITH_NTPCLIENT        1       // legacy NTPClient behind timeClient()
+#endif
+#ifndef GIZMO_WITH_TLS
+#define GIZMO_WITH_TLS              1       // BearSSL MQTT transport
+#endif
+#ifndef GIZMO_WITH_FAULTS
+#define GIZMO_WITH_FAULTS           0       // MQTT-scripted fault injection for soak runs
+#endif
+#ifndef GIZMO_WITH_BROKER
+#define GIZMO_WITH_BROKER           1       // local MQTT broker while running as an AP only
+#endif
+#ifndef GIZMO_WITH_MULTICAST
+#define GIZMO_WITH_MULTICAST        1       // authenticated UDP multicast control channel
+#endif
+#ifndef GIZMO_WITH_TRANSFER
+#define GIZMO_WITH_TRANSFER         1       // chunked file transfer over MQTT
+#endif
+#ifndef GIZMO_WITH_CONFIG_PAGES
+#define GIZMO_WITH_CONFIG_PAGES     1       // network, MQTT, files and update pages
+#endif
+
+// Static table sizes
+#ifndef MAX_TOPIC_COUNT
+#define MAX_TOPIC_COUNT             16
+#endif
+#ifndef MAX_TOPIC_SIZE
+#define MAX_TOPIC_SIZE              64
+#endif
+#ifndef MAX_CONTROL_GROUPS
+#define MAX_CONTROL_GROUPS          4
+#endif
+#ifndef MAX_ANNOUNCE_MESSAGE_SIZE
+#define MAX_ANNOUNCE_MESSAGE_SIZE   128
+#endif
+#ifndef MAX_WILL_TOPIC_SIZE
+#define MAX_WILL_TOPIC_SIZE         128
+#endif
+#ifndef MAX_WILL_MESSAGE_SIZE
+#define MAX_WILL_MESSAGE_SIZE       128
+#endif
+
+// Subsystem tables can be sized the same way; see MAX_NETWORKS, MAX_HTTP_CONNECTIONS,
+// MAX_EVENT_CLIENTS, EVENT_BUFFER_SIZE, MAX_QUEUED_READINGS, SCRATCH_ARENA_SIZE, MAX_BROKER_SESSIONS,
+// MAX_RETAINED_MESSAGES and MAX_MULTICAST_PEERS.
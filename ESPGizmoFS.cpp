@@ -0,0 +1,168 @@
+#include <ESPGizmoFS.h>
+
+#ifdef GIZMO_LITTLEFS
+#include <LittleFS.h>
+#endif
+
+FS &gizmoFS() {
+#ifdef GIZMO_LITTLEFS
+    return LittleFS;
+#else
+    return SPIFFS;
+#endif
+}
+
+#ifdef GIZMO_LITTLEFS
+
+static bool isMigrated(const char *name) {
+    if (name[0] == '/') {
+        name++;
+    }
+    return !strncmp(name, "cfg/", 4) || !strcmp(name, "psk") || !strcmp(name, "online");
+}
+
+typedef struct {
+    char name[32];
+    size_t size;
+    uint8_t *data;
+} MigratedFile;
+
+static int migrateFromSPIFFS() {
+    MigratedFile files[FS_MIGRATE_MAX_FILES];
+    int count = 0;
+
+    if (SPIFFS.begin()) {
+        Dir dir = SPIFFS.openDir("/");
+        while (dir.next() && count < FS_MIGRATE_MAX_FILES) {
+            String fileName = dir.fileName();
+            const char *name = fileName.c_str();
+            if (!isMigrated(name) || dir.fileSize() > FS_MIGRATE_MAX_SIZE) {
+                continue;
+            }
+            MigratedFile *mf = &files[count];
+            snprintf(mf->name, sizeof(mf->name), name[0] == '/' ? "%s" : "/%s", name);
+            mf->size = dir.fileSize();
+            mf->data = (uint8_t *) malloc(mf->size + 1);
+            File f = dir.openFile("r");
+            if (mf->data && f) {
+                f.read(mf->data, mf->size);
+                count++;
+            } else {
+                free(mf->data);
+            }
+            f.close();
+        }
+        SPIFFS.end();
+    }
+
+    Serial.printf("Migrating %d configuration files from SPIFFS to LittleFS\n", count);
+    int result = LittleFS.format() && LittleFS.begin() ? FS_MIGRATED : FS_MOUNT_FAILED;
+    for (int i = 0; i < count; i++) {
+        if (result == FS_MIGRATED) {
+            makeParentDirs(files[i].name);
+            File f = LittleFS.open(files[i].name, "w");
+            if (f) {
+                f.write(files[i].data, files[i].size);
+                f.close();
+            }
+        }
+        free(files[i].data);
+    }
+    return result;
+}
+
+bool isUserFilePath(const char *path) {
+    if (path[0] != '/' || !strncmp(path, "/cfg/", 5) || !strcmp(path, "/cfg")) {
+        return false;
+    }
+    for (const char *p = path; p; p = strchr(p + 1, '/')) {
+        if (p[1] == '\0' || p[1] == '/' || p[1] == '.') {
+            return false;
+        }
+    }
+    return true;
+}
+
+void makeParentDirs(const char *path) {
+    char dir[64];
+    for (const char *p = strchr(path + 1, '/'); p && p - path < (int) sizeof(dir); p = strchr(p + 1, '/')) {
+        memcpy(dir, path, p - path);
+        dir[p - path] = '\0';
+        LittleFS.mkdir(dir);
+    }
+}
+
+int beginFileSystem() {
+    // Don't let LittleFS format a SPIFFS partition before we had a chance to read it.
+    LittleFS.setConfig(LittleFSConfig(false));
+    if (LittleFS.begin()) {
+        return FS_MOUNTED;
+    }
+    return migrateFromSPIFFS();
+}
+
+#else
+
+bool isUserFilePath(const char *path) {
+    if (path[0] != '/' || !strncmp(path, "/cfg/", 5) || !strcmp(path, "/cfg")) {
+        return false;
+    }
+    for (const char *p = path; p; p = strchr(p + 1, '/')) {
+        if (p[1] == '\0' || p[1] == '/' || p[1] == '.') {
+            return false;
+        }
+    }
+    return true;
+}
+
+void makeParentDirs(const char *path) {
+}
+
+int beginFileSystem() {
+    return SPIFFS.begin() ? FS_MOUNTED : FS_MOUNT_FAILED;
+}
+
+#endif
+
+#define FS_BENCH_ROUNDS     20
+
+void benchmarkFileSystem(Print &out) {
+    FS &fs = gizmoFS();
+    uint8_t buf[256];
+
+    File f = fs.open("/.bench", "w");
+    for (int i = 0; i < 16 && f; i++) {
+        memset(buf, i, sizeof(buf));
+        f.write(buf, sizeof(buf));
+    }
+    f.close();
+
+    uint32_t start = micros();
+    for (int i = 0; i < FS_BENCH_ROUNDS; i++) {
+        f = fs.open("/.bench", "r");
+        f.close();
+    }
+    uint32_t openTime = (micros() - start) / FS_BENCH_ROUNDS;
+
+    start = micros();
+    for (int i = 0; i < FS_BENCH_ROUNDS; i++) {
+        f = fs.open("/.bench", "r");
+        while (f.read(buf, sizeof(buf)) > 0);
+        f.close();
+    }
+    uint32_t readTime = (micros() - start) / FS_BENCH_ROUNDS;
+
+    int entries = 0;
+    start = micros();
+    for (int i = 0; i < FS_BENCH_ROUNDS; i++) {
+        Dir dir = fs.openDir("/");
+        while (dir.next()) {
+            entries++;
+        }
+    }
+    uint32_t listTime = (micros() - start) / FS_BENCH_ROUNDS;
+    fs.remove("/.bench");
+
+    out.printf("open %u us, read 4KB %u us, list %d entries %u us\n",
+               openTime, readTime, entries / FS_BENCH_ROUNDS, listTime);
+}
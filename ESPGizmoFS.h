@@ -0,0 +1,26 @@
+#pragma once
+
+#include <FS.h>
+
+// SPIFFS stays the default backend; build with -DGIZMO_LITTLEFS to switch to LittleFS.
+// The first boot on LittleFS carries the configuration files over from SPIFFS.
+#define FS_MOUNT_FAILED     0
+#define FS_MOUNTED          1
+#define FS_MIGRATED         2
+
+// Files smaller than this, under the configuration paths, survive a migration.
+#define FS_MIGRATE_MAX_SIZE 256
+#define FS_MIGRATE_MAX_FILES 16
+
+FS &gizmoFS();
+int beginFileSystem();
+
+// Whether uploads and transfers may write the given path: it must be absolute, with no
+// empty or hidden components (which rules out ".." and the temporary files), and must
+// not be the configuration under /cfg.
+bool isUserFilePath(const char *path);
+
+// Creates the parent directories of the given path; no-op on SPIFFS.
+void makeParentDirs(const char *path);
+
+void benchmarkFileSystem(Print &out);
@@ -0,0 +1,95 @@
+#include <ESPGizmoFaults.h>
+
+static const char *faultNames[FAULT_TYPES] = {"wifi", "broker", "dns", "download", "stall"};
+
+GizmoFaults::GizmoFaults() {
+    clear();
+}
+
+void GizmoFaults::clear() {
+    for (int i = 0; i < FAULT_TYPES; i++) {
+        until[i] = 0;
+        values[i] = 0;
+        pending[i] = false;
+    }
+}
+
+bool GizmoFaults::inject(const char *spec, uint64_t now) {
+    if (!strcmp(spec, "clear")) {
+        clear();
+        return true;
+    }
+    for (int i = 0; i < FAULT_TYPES; i++) {
+        size_t l = strlen(faultNames[i]);
+        if (!strncmp(spec, faultNames[i], l) && (spec[l] == ' ' || spec[l] == '\0')) {
+            values[i] = atol(spec + l);
+            until[i] = now + values[i];
+            pending[i] = true;
+            injected++;
+            // Recovery is timed from the first fault of a burst that takes the device offline.
+            if (!faultStart && breaksLink((GizmoFaultType) i)) {
+                faultStart = now;
+            }
+            Serial.printf("Injecting %s fault (%u)\n", faultNames[i], values[i]);
+            return true;
+        }
+    }
+    Serial.printf("Unknown fault %s\n", spec);
+    return false;
+}
+
+bool GizmoFaults::breaksLink(GizmoFaultType type) {
+    return type == FAULT_WIFI || type == FAULT_BROKER;
+}
+
+void GizmoFaults::settle(uint64_t now, bool online) {
+    if (!faultStart || !online) {
+        return;
+    }
+    for (int i = 0; i < FAULT_TYPES; i++) {
+        if (breaksLink((GizmoFaultType) i) && (pending[i] || active((GizmoFaultType) i, now))) {
+            return;
+        }
+    }
+    // The burst passed without the device going offline; there is nothing to recover from.
+    faultStart = 0;
+}
+
+bool GizmoFaults::active(GizmoFaultType type, uint64_t now) {
+    return until[type] > now;
+}
+
+uint32_t GizmoFaults::take(GizmoFaultType type) {
+    if (!pending[type]) {
+        return 0;
+    }
+    pending[type] = false;
+    return values[type] ? values[type] : 1;
+}
+
+void GizmoFaults::recovered(uint64_t now) {
+    if (faultStart) {
+        lastRecovery = now - faultStart;
+        if (lastRecovery > maxRecovery) {
+            maxRecovery = lastRecovery;
+        }
+        recoveries++;
+        faultStart = 0;
+    }
+}
+
+void GizmoFaults::sampleHeap(uint32_t freeHeap) {
+    if (!startHeap) {
+        startHeap = minHeap = freeHeap;
+    }
+    if (freeHeap < minHeap) {
+        minHeap = freeHeap;
+    }
+    lastHeap = freeHeap;
+}
+
+int GizmoFaults::report(char *buf, size_t size, uint32_t messagesLost) {
+    return snprintf(buf, size, "faults %u recovered %u last %u max %u ms lost %u heap %u min %u drift %d",
+                    injected, recoveries, lastRecovery, maxRecovery, messagesLost,
+                    lastHeap, minHeap, (int) (startHeap - lastHeap));
+}
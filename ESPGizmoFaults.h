@@ -0,0 +1,62 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Fault injection for soak runs, compiled in with GIZMO_WITH_FAULTS. Faults are
+// scripted over MQTT with "fault <type> [value]" on the device control topic:
+//   wifi <ms>       drop the station link and stay off for ms
+//   broker <ms>     reset the broker connection and hold off reconnects for ms
+//   dns <ms>        fail every broker and update server lookup for ms
+//   download <n>    cut the next file download short after n bytes
+//   stall <ms>      block the loop once for ms
+//   clear           end all faults
+// The same script runs on the host against stand-ins for the network, broker and update
+// server in test/host/soak.cpp, which models the device loop rather than running it.
+#define SOAK_TOPIC              "gizmo/soak/%s"
+#define SOAK_REPORT_INTERVAL    60000
+
+typedef enum {
+    FAULT_WIFI,
+    FAULT_BROKER,
+    FAULT_DNS,
+    FAULT_DOWNLOAD,
+    FAULT_STALL,
+    FAULT_TYPES
+} GizmoFaultType;
+
+class GizmoFaults {
+public:
+    GizmoFaults();
+
+    bool inject(const char *spec, uint64_t now);
+    void clear();
+
+    // Whether a timed fault is still in effect
+    bool active(GizmoFaultType type, uint64_t now);
+    // Returns the fault's value the first time it is asked after injection, else 0
+    uint32_t take(GizmoFaultType type);
+
+    // Call when the device comes back online, and from the loop with whether it is online
+    // right now; recovery is only timed for wifi and broker faults that took it offline.
+    void recovered(uint64_t now);
+    void settle(uint64_t now, bool online);
+    void sampleHeap(uint32_t freeHeap);
+    int report(char *buf, size_t size, uint32_t messagesLost);
+
+    uint32_t injected = 0;
+    uint32_t recoveries = 0;
+    uint32_t lastRecovery = 0;
+    uint32_t maxRecovery = 0;
+
+private:
+    bool breaksLink(GizmoFaultType type);
+
+    uint64_t until[FAULT_TYPES];
+    uint32_t values[FAULT_TYPES];
+    bool pending[FAULT_TYPES];
+    uint64_t faultStart = 0;
+
+    uint32_t startHeap = 0;
+    uint32_t minHeap = 0;
+    uint32_t lastHeap = 0;
+};
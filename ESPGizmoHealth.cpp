@@ -0,0 +1,77 @@
+#include <ESPGizmoHealth.h>
+
+void GizmoRTTHistogram::record(uint32_t rtt) {
+    int bucket = 0;
+    while (bucket < HEALTH_HISTOGRAM_BUCKETS - 1 && rtt >= (2U << bucket)) {
+        bucket++;
+    }
+    buckets[bucket]++;
+    received++;
+    consecutiveLosses = 0;
+    lastRTT = rtt;
+    if (received == 1 || rtt < minRTT) {
+        minRTT = rtt;
+    }
+    if (rtt > maxRTT) {
+        maxRTT = rtt;
+    }
+}
+
+void GizmoRTTHistogram::lost() {
+    consecutiveLosses++;
+}
+
+void GizmoRTTHistogram::clear() {
+    sent = received = consecutiveLosses = 0;
+    minRTT = maxRTT = lastRTT = 0;
+    memset(buckets, 0, sizeof(buckets));
+}
+
+int GizmoRTTHistogram::summary(char *buf, size_t size, const char *label) {
+    int l = snprintf(buf, size, " %s %u/%u %u..%u ms [", label, received, sent, minRTT, maxRTT);
+    for (int i = 0; i < HEALTH_HISTOGRAM_BUCKETS && l < (int) size; i++) {
+        l += snprintf(buf + l, size - l, i ? ",%u" : "%u", buckets[i]);
+    }
+    if (l < (int) size) {
+        l += snprintf(buf + l, size - l, "]");
+    }
+    return l;
+}
+
+GizmoHealth::GizmoHealth() {
+    gateway.clear();
+    dns.clear();
+    broker.clear();
+}
+
+void GizmoHealth::recordRSSI(int32_t value) {
+    if (!avgRSSI) {
+        avgRSSI = minRSSI = value;
+    }
+    rssi = value;
+    minRSSI = value < minRSSI ? value : minRSSI;
+    avgRSSI = (avgRSSI * 7 + value) / 8;
+}
+
+int GizmoHealth::summary(char *buf, size_t size) {
+    int l = snprintf(buf, size, "rssi %d/%d/%d", rssi, avgRSSI, minRSSI);
+    if (l < (int) size) l += gateway.summary(buf + l, size - l, "gw");
+    if (l < (int) size) l += dns.summary(buf + l, size - l, "dns");
+    if (l < (int) size) l += broker.summary(buf + l, size - l, "mqtt");
+    if (l < (int) size) {
+        l += snprintf(buf + l, size - l, " recovery %u/%u/%u", reassociations, mqttReconnects, restarts);
+    }
+    return l;
+}
+
+GizmoRecovery defaultRecoveryPolicy(GizmoHealth *health) {
+    if (health->gateway.consecutiveLosses >= HEALTH_LOSS_THRESHOLD) {
+        // The access point looks bad; reassociate a couple of times before giving up.
+        return health->pendingReassociations < HEALTH_MAX_REASSOCIATIONS ? RECOVERY_REASSOCIATE : RECOVERY_RESTART;
+    }
+    if (health->broker.consecutiveLosses >= HEALTH_LOSS_THRESHOLD) {
+        // Gateway answers but the broker does not; a restart would not fix that.
+        return RECOVERY_RECONNECT_MQTT;
+    }
+    return RECOVERY_NONE;
+}
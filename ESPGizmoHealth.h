@@ -0,0 +1,69 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Buckets cover RTTs of <2, <4, <8 ... <1024 ms and everything slower.
+#define HEALTH_HISTOGRAM_BUCKETS    11
+
+#define HEALTH_PROBE_INTERVAL       30000
+#define HEALTH_PUBLISH_INTERVAL     300000
+#define HEALTH_PROBE_TIMEOUT        1000
+
+// Consecutive losses before the default policy acts
+#define HEALTH_LOSS_THRESHOLD       3
+#define HEALTH_MAX_REASSOCIATIONS   2
+
+// How often the broker connection is retried, and how many times a short file download
+// is retried during updateFiles(); test/host/soak.cpp models both with these values.
+#define MQTT_RECONNECT_FREQUENCY    5000
+#define FILE_UPDATE_RETRIES         10
+#define FILE_UPDATE_RETRY_DELAY     500
+
+typedef enum {
+    RECOVERY_NONE,
+    RECOVERY_REASSOCIATE,
+    RECOVERY_RECONNECT_MQTT,
+    RECOVERY_RESTART
+} GizmoRecovery;
+
+class GizmoRTTHistogram {
+public:
+    void record(uint32_t rtt);
+    void lost();
+    void clear();
+    int summary(char *buf, size_t size, const char *label);
+
+    uint32_t sent = 0;
+    uint32_t received = 0;
+    uint32_t consecutiveLosses = 0;
+    uint32_t minRTT = 0;
+    uint32_t maxRTT = 0;
+    uint32_t lastRTT = 0;
+    uint16_t buckets[HEALTH_HISTOGRAM_BUCKETS];
+};
+
+class GizmoHealth {
+public:
+    GizmoHealth();
+
+    void recordRSSI(int32_t rssi);
+    int summary(char *buf, size_t size);
+
+    GizmoRTTHistogram gateway;
+    GizmoRTTHistogram dns;
+    GizmoRTTHistogram broker;
+
+    int32_t rssi = 0;
+    int32_t minRSSI = 0;
+    int32_t avgRSSI = 0;
+
+    // Recovery actions taken, and reassociations since connectivity was last healthy
+    uint32_t reassociations = 0;
+    uint32_t mqttReconnects = 0;
+    uint32_t restarts = 0;
+    uint32_t pendingReassociations = 0;
+};
+
+typedef GizmoRecovery (*GizmoRecoveryPolicy)(GizmoHealth *health);
+
+GizmoRecovery defaultRecoveryPolicy(GizmoHealth *health);
@@ -0,0 +1,189 @@
+#include <ESPGizmoMulticast.h>
+#include <ESPGizmoFS.h>
+
+// Datagram layout; all integers big-endian:
+//   0  'G' 'Z' version
+//   3  sender id, 4 bytes
+//   7  sender boot epoch, 4 bytes
+//  11  sequence, 4 bytes
+//  15  send time in epoch seconds or 0, 4 bytes
+//  19  topic length, 1 byte
+//  20  topic, then payload
+//  ..  HMAC tag over everything before it
+#define MULTICAST_VERSION   1
+#define HEADER_SIZE         20
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+GizmoMulticast::GizmoMulticast(const char *secret, IPAddress group, uint16_t port) : group(group), port(port) {
+    br_hmac_key_init(&key, &br_sha256_vtable, secret, strnlen(secret, MAX_MULTICAST_SECRET_SIZE));
+    id = ESP.getChipId();
+    memset(peers, 0, sizeof(peers));
+}
+
+// A higher epoch per boot lets peers tell a restart from a replay of old sequence numbers.
+// It is taken on the first begin(), when the file system is certain to be mounted.
+void GizmoMulticast::nextEpoch() {
+    File f = gizmoFS().open(MULTICAST_EPOCH_FILE, "r");
+    if (f) {
+        char count[12];
+        int l = f.readBytesUntil('\n', count, sizeof(count) - 1);
+        count[l] = '\0';
+        epoch = strtoul(count, NULL, 10);
+        f.close();
+    }
+    epoch++;
+    makeParentDirs(MULTICAST_EPOCH_FILE);
+    f = gizmoFS().open(MULTICAST_EPOCH_FILE, "w");
+    if (!f || f.printf("%u\n", epoch) <= 0) {
+        Serial.printf("Unable to save multicast epoch %u; peers may drop our datagrams\n", epoch);
+    }
+    f.close();
+}
+
+void GizmoMulticast::begin() {
+    if (!epoch) {
+        nextEpoch();
+    }
+    udp.stop();
+    udp.beginMulticast(WiFi.localIP(), group, port);
+}
+
+void GizmoMulticast::setCallback(GizmoMulticastCallback callback) {
+    this->callback = callback;
+}
+
+void GizmoMulticast::sign(const uint8_t *data, size_t length, uint8_t *tag) {
+    br_hmac_context hmac;
+    br_hmac_init(&hmac, &key, MULTICAST_TAG_SIZE);
+    br_hmac_update(&hmac, data, length);
+    br_hmac_out(&hmac, tag);
+}
+
+bool GizmoMulticast::send(const char *topic, const uint8_t *payload, unsigned int length, uint32_t time) {
+    uint8_t packet[MULTICAST_PACKET_SIZE];
+    size_t topicLength = strlen(topic);
+    size_t size = HEADER_SIZE + topicLength + length;
+    if (topicLength > 255 || size + MULTICAST_TAG_SIZE > sizeof(packet)) {
+        return false;
+    }
+
+    packet[0] = 'G';
+    packet[1] = 'Z';
+    packet[2] = MULTICAST_VERSION;
+    put32(packet + 3, id);
+    put32(packet + 7, epoch);
+    put32(packet + 11, ++sequence);
+    put32(packet + 15, time);
+    packet[19] = topicLength;
+    memcpy(packet + HEADER_SIZE, topic, topicLength);
+    memcpy(packet + HEADER_SIZE + topicLength, payload, length);
+    sign(packet, size, packet + size);
+    size += MULTICAST_TAG_SIZE;
+
+    bool ok = false;
+    for (int i = 0; i < MULTICAST_REPEATS; i++) {
+        if (udp.beginPacketMulticast(group, port, WiFi.localIP()) &&
+            udp.write(packet, size) == size && udp.endPacket()) {
+            ok = true;
+        }
+    }
+    sent++;
+    return ok;
+}
+
+void GizmoMulticast::loop(uint32_t time) {
+    uint8_t packet[MULTICAST_PACKET_SIZE];
+    int size;
+    while ((size = udp.parsePacket()) > 0) {
+        if (size > (int) sizeof(packet)) {
+            udp.flush();
+            rejected++;
+            continue;
+        }
+        receive(packet, udp.read(packet, size), time);
+    }
+}
+
+void GizmoMulticast::receive(uint8_t *packet, int length, uint32_t time) {
+    if (length < HEADER_SIZE + MULTICAST_TAG_SIZE || packet[0] != 'G' || packet[1] != 'Z' ||
+        packet[2] != MULTICAST_VERSION) {
+        rejected++;
+        return;
+    }
+    uint32_t sender = get32(packet + 3);
+    if (sender == id) {
+        // Our own datagram looped back
+        return;
+    }
+
+    size_t signedLength = length - MULTICAST_TAG_SIZE;
+    uint8_t tag[MULTICAST_TAG_SIZE];
+    sign(packet, signedLength, tag);
+    uint8_t diff = 0;
+    for (int i = 0; i < MULTICAST_TAG_SIZE; i++) {
+        diff |= tag[i] ^ packet[signedLength + i];
+    }
+    size_t topicLength = packet[19];
+    if (diff || HEADER_SIZE + topicLength > signedLength) {
+        rejected++;
+        return;
+    }
+
+    uint32_t sentTime = get32(packet + 15);
+    if (time && sentTime && (sentTime + MULTICAST_MAX_AGE < time || time + MULTICAST_MAX_AGE < sentTime)) {
+        rejected++;
+        return;
+    }
+    if (!accept(sender, get32(packet + 7), get32(packet + 11))) {
+        duplicates++;
+        return;
+    }
+
+    // Slide the topic over its length byte to terminate it in place; the payload is
+    // not terminated, as with MQTT.
+    char *topic = (char *) packet + HEADER_SIZE - 1;
+    memmove(topic, packet + HEADER_SIZE, topicLength);
+    topic[topicLength] = '\0';
+    received++;
+    if (callback) {
+        callback(topic, packet + HEADER_SIZE + topicLength, signedLength - HEADER_SIZE - topicLength);
+    }
+}
+
+bool GizmoMulticast::accept(uint32_t sender, uint32_t senderEpoch, uint32_t senderSequence) {
+    GizmoMulticastPeer *peer = NULL;
+    GizmoMulticastPeer *oldest = &peers[0];
+    for (int i = 0; i < MAX_MULTICAST_PEERS; i++) {
+        if (peers[i].sender == sender) {
+            peer = &peers[i];
+            break;
+        }
+        if (peers[i].lastSeen < oldest->lastSeen) {
+            oldest = &peers[i];
+        }
+    }
+    // Epochs only go up, so anything from a superseded boot is a replay.
+    if (peer && (senderEpoch < peer->epoch ||
+                 (senderEpoch == peer->epoch && (int32_t) (senderSequence - peer->sequence) <= 0))) {
+        return false;
+    }
+    if (!peer) {
+        // Forget the longest silent sender to make room.
+        peer = oldest;
+        peer->sender = sender;
+    }
+    peer->epoch = senderEpoch;
+    peer->sequence = senderSequence;
+    peer->lastSeen = millis();
+    return true;
+}
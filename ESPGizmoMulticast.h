@@ -0,0 +1,77 @@
+#pragma once
+
+#include <ESP8266WiFi.h>
+#include <WiFiUdp.h>
+#include <bearssl/bearssl.h>
+#include <functional>
+
+// Authenticated UDP multicast for commands that must land on many devices at once,
+// bypassing the broker. Each datagram carries a topic and payload exactly as they
+// would be published over MQTT, plus the sender's id, boot epoch and sequence number,
+// and is sealed with HMAC-SHA256 (truncated to 128 bits) under a shared secret.
+#define MULTICAST_GROUP             IPAddress(239, 255, 42, 42)
+#define MULTICAST_PORT              4242
+
+#define MULTICAST_PACKET_SIZE       256
+#define MULTICAST_TAG_SIZE          16
+#define MAX_MULTICAST_SECRET_SIZE   64
+
+// Each command goes out this many times back to back; receivers drop the copies.
+#define MULTICAST_REPEATS           2
+
+// Senders whose sequence numbers are tracked for deduplication
+#ifndef MAX_MULTICAST_PEERS
+#define MAX_MULTICAST_PEERS         16
+#endif
+
+// When both ends have wall-clock time, older datagrams are refused as replays. Without
+// a clock, replay protection rests on the boot epoch: a counter kept in flash that only
+// goes up, so a datagram from an epoch older than the last one seen from that sender is
+// refused. A sender evicted from the peer table is trusted afresh on its next datagram,
+// and one whose counter is lost with its file system is refused until peers restart.
+#define MULTICAST_MAX_AGE           30
+#define MULTICAST_EPOCH_FILE        "/cfg/mcepoch"
+
+typedef std::function<void(const char *topic, const uint8_t *payload, unsigned int length)> GizmoMulticastCallback;
+
+typedef struct {
+    uint32_t sender;
+    uint32_t epoch;
+    uint32_t sequence;
+    uint32_t lastSeen;
+} GizmoMulticastPeer;
+
+class GizmoMulticast {
+public:
+    GizmoMulticast(const char *secret, IPAddress group = MULTICAST_GROUP, uint16_t port = MULTICAST_PORT);
+
+    // (Re)joins the group on the current station address.
+    void begin();
+    void setCallback(GizmoMulticastCallback callback);
+
+    // Times are epoch seconds, or 0 while the clock is not set.
+    bool send(const char *topic, const uint8_t *payload, unsigned int length, uint32_t time);
+    void loop(uint32_t time);
+
+    uint32_t sent = 0;
+    uint32_t received = 0;
+    uint32_t duplicates = 0;
+    uint32_t rejected = 0;
+
+private:
+    void nextEpoch();
+    void receive(uint8_t *packet, int length, uint32_t time);
+    void sign(const uint8_t *data, size_t length, uint8_t *tag);
+    bool accept(uint32_t sender, uint32_t epoch, uint32_t sequence);
+
+    WiFiUDP udp;
+    IPAddress group;
+    uint16_t port;
+    br_hmac_key_context key;
+    GizmoMulticastCallback callback = NULL;
+
+    uint32_t id;
+    uint32_t epoch = 0;
+    uint32_t sequence = 0;
+    GizmoMulticastPeer peers[MAX_MULTICAST_PEERS];
+};
@@ -0,0 +1,131 @@
+#include <ESPGizmo.h>
+#include <ESPGizmoFS.h>
+
+void GizmoNetworks::clear() {
+    networkCount = 0;
+    scanTime = 0;
+}
+
+bool GizmoNetworks::add(const char *ssid, const char *passkey, uint8_t priority, bool primary) {
+    int i = find(ssid);
+    if (i < 0) {
+        if (networkCount == MAX_NETWORKS || !strlen(ssid)) {
+            return false;
+        }
+        i = networkCount++;
+        memset(&networks[i], 0, sizeof(GizmoNetwork));
+        strncpy(networks[i].ssid, ssid, MAX_SSID_SIZE - 1);
+        networks[i].rssi = RSSI_NOT_SEEN;
+    } else if (networks[i].primary && !primary) {
+        // The primary network is only changed through the network config.
+        return false;
+    }
+    strncpy(networks[i].passkey, passkey, MAX_PASSKEY_SIZE - 1);
+    networks[i].priority = priority;
+    networks[i].primary = primary;
+    return true;
+}
+
+bool GizmoNetworks::remove(const char *ssid) {
+    int i = find(ssid);
+    if (i < 0 || networks[i].primary) {
+        return false;
+    }
+    memmove(&networks[i], &networks[i + 1], sizeof(GizmoNetwork) * (networkCount - i - 1));
+    networkCount--;
+    return true;
+}
+
+int GizmoNetworks::find(const char *ssid) {
+    for (int i = 0; i < networkCount; i++) {
+        if (!strcmp(networks[i].ssid, ssid)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int GizmoNetworks::count() {
+    return networkCount;
+}
+
+GizmoNetwork *GizmoNetworks::get(int index) {
+    return index >= 0 && index < networkCount ? &networks[index] : NULL;
+}
+
+void GizmoNetworks::load(FS &fs) {
+    File f = fs.open(NETWORKS_CONFIG, "r");
+    if (f) {
+        char priority[4], ssid[MAX_SSID_SIZE], passkey[MAX_PASSKEY_SIZE];
+        int l;
+        while ((l = f.readBytesUntil('|', priority, 3)) > 0) {
+            priority[l] = '\0';
+            l = f.readBytesUntil('|', ssid, MAX_SSID_SIZE - 1);
+            ssid[l] = '\0';
+            l = f.readBytesUntil('|', passkey, MAX_PASSKEY_SIZE - 1);
+            passkey[l] = '\0';
+            f.readBytesUntil('\n', priority, 3);
+            add(ssid, passkey, atoi(priority), false);
+        }
+        f.close();
+    }
+}
+
+void GizmoNetworks::save(FS &fs) {
+    makeParentDirs(NETWORKS_CONFIG);
+    File f = fs.open(NETWORKS_CONFIG, "w");
+    if (f) {
+        for (int i = 0; i < networkCount; i++) {
+            if (!networks[i].primary) {
+                f.printf("%d|%s|%s|\n", networks[i].priority, networks[i].ssid, networks[i].passkey);
+            }
+        }
+        f.close();
+    }
+}
+
+void GizmoNetworks::updateFromScan(int found, uint64_t now) {
+    for (int i = 0; i < networkCount; i++) {
+        networks[i].rssi = RSSI_NOT_SEEN;
+    }
+    for (int j = 0; j < found; j++) {
+        int i = find(WiFi.SSID(j).c_str());
+        if (i >= 0 && WiFi.RSSI(j) > networks[i].rssi) {
+            networks[i].rssi = WiFi.RSSI(j);
+            networks[i].channel = WiFi.channel(j);
+            memcpy(networks[i].bssid, WiFi.BSSID(j), 6);
+        }
+    }
+    scanTime = now;
+}
+
+bool GizmoNetworks::isScanFresh(uint64_t now) {
+    return scanTime && now - scanTime < SCAN_CACHE_TIMEOUT;
+}
+
+int GizmoNetworks::best(uint32_t exclude) {
+    int best = -1;
+    for (int i = 0; i < networkCount; i++) {
+        GizmoNetwork *n = &networks[i];
+        if ((exclude & (1 << i)) || n->rssi == RSSI_NOT_SEEN) {
+            continue;
+        }
+        if (best < 0) {
+            best = i;
+            continue;
+        }
+
+        // Usable networks win by priority, then signal; otherwise just by signal.
+        GizmoNetwork *b = &networks[best];
+        bool usable = n->rssi >= ROAM_RSSI_THRESHOLD;
+        bool bestUsable = b->rssi >= ROAM_RSSI_THRESHOLD;
+        if (usable != bestUsable) {
+            if (usable) best = i;
+        } else if (usable && n->priority != b->priority) {
+            if (n->priority < b->priority) best = i;
+        } else if (n->rssi > b->rssi) {
+            best = i;
+        }
+    }
+    return best;
+}
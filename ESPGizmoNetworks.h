@@ -0,0 +1,59 @@
+#pragma once
+
+#include <ESP8266WiFi.h>
+#include <FS.h>
+
+#ifndef MAX_NETWORKS
+#define MAX_NETWORKS            6
+#endif
+#define NETWORKS_CONFIG         "/cfg/nets"
+
+// Networks weaker than this are only used when nothing better is in range,
+// and a connection this weak for ROAM_SAMPLES checks triggers a roaming scan.
+#define ROAM_RSSI_THRESHOLD     -75
+#define ROAM_HYSTERESIS         8
+#define ROAM_SAMPLES            3
+#define ROAM_CHECK_INTERVAL     10000
+
+#define SCAN_CACHE_TIMEOUT      60000
+#define NETWORK_CONNECT_TIMEOUT 10000
+
+#define RSSI_NOT_SEEN           -128
+
+typedef struct {
+    char ssid[MAX_SSID_SIZE];
+    char passkey[MAX_PASSKEY_SIZE];
+    uint8_t priority;
+    bool primary;
+
+    // Strongest access point seen for this network in the last scan
+    int32_t rssi;
+    int32_t channel;
+    uint8_t bssid[6];
+
+    uint32_t attempts;
+    uint32_t failures;
+} GizmoNetwork;
+
+class GizmoNetworks {
+public:
+    void clear();
+    // Adds or updates a network; an entry for the primary network is left alone.
+    bool add(const char *ssid, const char *passkey, uint8_t priority, bool primary);
+    bool remove(const char *ssid);
+    int find(const char *ssid);
+    int count();
+    GizmoNetwork *get(int index);
+
+    void load(FS &fs);
+    void save(FS &fs);
+
+    void updateFromScan(int found, uint64_t now);
+    bool isScanFresh(uint64_t now);
+    int best(uint32_t exclude);
+
+private:
+    GizmoNetwork networks[MAX_NETWORKS];
+    int networkCount = 0;
+    uint64_t scanTime = 0;
+};
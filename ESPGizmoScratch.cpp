@@ -0,0 +1,59 @@
+#include <ESPGizmoScratch.h>
+
+static uint8_t arena[SCRATCH_ARENA_SIZE] __attribute__((aligned(4)));
+static size_t arenaTop = 0;
+static size_t arenaHighWater = 0;
+static uint32_t heapFallbacks = 0;
+
+GizmoScratch::GizmoScratch(size_t size) : length(size) {
+    // Keep every lease word-aligned.
+    size_t rounded = (size + 3) & ~3;
+    if (arenaTop + rounded <= SCRATCH_ARENA_SIZE) {
+        buffer = arena + arenaTop;
+        reserved = rounded;
+        arenaTop += rounded;
+        if (arenaTop > arenaHighWater) {
+            arenaHighWater = arenaTop;
+        }
+    } else {
+        buffer = (uint8_t *) malloc(size);
+        reserved = 0;
+        heapFallbacks++;
+        if (!buffer) {
+            Serial.printf("Unable to allocate %u bytes of scratch\n", (unsigned int) size);
+            length = 0;
+        }
+    }
+}
+
+GizmoScratch::~GizmoScratch() {
+    if (reserved) {
+        arenaTop -= reserved;
+    } else {
+        free(buffer);
+    }
+}
+
+char *GizmoScratch::chars() {
+    return (char *) buffer;
+}
+
+uint8_t *GizmoScratch::bytes() {
+    return buffer;
+}
+
+size_t GizmoScratch::size() {
+    return length;
+}
+
+size_t scratchInUse() {
+    return arenaTop;
+}
+
+size_t scratchHighWater() {
+    return arenaHighWater;
+}
+
+uint32_t scratchHeapFallbacks() {
+    return heapFallbacks;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Shared scratch arena for large temporary buffers that would otherwise sit on the
+// 4 KB stack. Leases are handed out and returned in stack order, so scope them like
+// locals; a lease that doesn't fit falls back to the heap and is counted.
+#ifndef SCRATCH_ARENA_SIZE
+#define SCRATCH_ARENA_SIZE      2048
+#endif
+
+class GizmoScratch {
+public:
+    GizmoScratch(size_t size);
+    ~GizmoScratch();
+
+    char *chars();
+    uint8_t *bytes();
+    size_t size();
+
+private:
+    GizmoScratch(const GizmoScratch &);
+    GizmoScratch &operator=(const GizmoScratch &);
+
+    uint8_t *buffer;
+    size_t length;
+    size_t reserved;
+};
+
+size_t scratchInUse();
+size_t scratchHighWater();
+uint32_t scratchHeapFallbacks();
@@ -0,0 +1,83 @@
+#include <ESPGizmoSleep.h>
+
+static bool espRtcRead(uint32_t offset, uint32_t *data, size_t size) {
+    return ESP.rtcUserMemoryRead(offset, data, size);
+}
+
+static bool espRtcWrite(uint32_t offset, uint32_t *data, size_t size) {
+    return ESP.rtcUserMemoryWrite(offset, data, size);
+}
+
+static void espDeepSleep(uint64_t micros) {
+    ESP.deepSleep(micros);
+}
+
+static bool espWokeFromSleep() {
+    rst_info *info = ESP.getResetInfoPtr();
+    return info && info->reason == REASON_DEEP_SLEEP_AWAKE;
+}
+
+const GizmoSleepBackend espSleepBackend = {espRtcRead, espRtcWrite, espDeepSleep, espWokeFromSleep};
+
+uint32_t gizmoCRC32(const void *data, size_t length) {
+    const uint8_t *p = (const uint8_t *) data;
+    uint32_t crc = 0xffffffff;
+    while (length--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t stateCRC(GizmoRTCState *state) {
+    return gizmoCRC32(((uint8_t *) state) + sizeof(state->crc), sizeof(GizmoRTCState) - sizeof(state->crc));
+}
+
+bool loadRTCState(const GizmoSleepBackend *backend, GizmoRTCState *state) {
+    // Power-on leaves RTC memory with garbage, so only trust it after a deep sleep wake.
+    if (backend->wokeFromSleep() &&
+        backend->rtcRead(RTC_STATE_OFFSET, (uint32_t *) state, sizeof(GizmoRTCState)) &&
+        state->magic == RTC_STATE_MAGIC && state->crc == stateCRC(state)) {
+        return true;
+    }
+    memset(state, 0, sizeof(GizmoRTCState));
+    state->magic = RTC_STATE_MAGIC;
+    return false;
+}
+
+void saveRTCState(const GizmoSleepBackend *backend, GizmoRTCState *state) {
+    state->crc = stateCRC(state);
+    backend->rtcWrite(RTC_STATE_OFFSET, (uint32_t *) state, sizeof(GizmoRTCState));
+}
+
+bool queueRTCReading(GizmoRTCState *state, const char *topic, const char *payload) {
+    bool dropped = state->readingCount >= MAX_QUEUED_READINGS;
+    if (dropped) {
+        // Make room for the newest reading by dropping the oldest one.
+        memmove(&state->readings[0], &state->readings[1], sizeof(GizmoReading) * (MAX_QUEUED_READINGS - 1));
+        state->readingCount = MAX_QUEUED_READINGS - 1;
+    }
+
+    GizmoReading *reading = &state->readings[state->readingCount++];
+    reading->topic[0] = '\0';
+    strncat(reading->topic, topic, MAX_READING_TOPIC_SIZE - 1);
+    reading->payload[0] = '\0';
+    strncat(reading->payload, payload, MAX_READING_PAYLOAD_SIZE - 1);
+    return !dropped;
+}
+
+uint32_t publishRTCReadings(GizmoRTCState *state, GizmoReadingPublisher publisher) {
+    uint32_t sent = 0;
+    while (sent < state->readingCount &&
+           publisher(state->readings[sent].topic, state->readings[sent].payload)) {
+        sent++;
+    }
+    if (sent) {
+        state->readingCount -= sent;
+        memmove(&state->readings[0], &state->readings[sent], sizeof(GizmoReading) * state->readingCount);
+        state->sequence += sent;
+    }
+    return sent;
+}
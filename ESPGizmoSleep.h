@@ -0,0 +1,72 @@
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+
+#ifndef MAX_QUEUED_READINGS
+#define MAX_QUEUED_READINGS         6
+#endif
+#define MAX_READING_TOPIC_SIZE      32
+#define MAX_READING_PAYLOAD_SIZE    24
+
+// RTC user memory is 512 bytes, addressed in 4-byte blocks.
+#define RTC_STATE_OFFSET            0
+#define RTC_STATE_MAGIC             0x47534C50
+
+#define RTC_FLAG_NETWORK            0x01
+#define RTC_FLAG_BROKER             0x02
+
+// Platform hooks used by the duty-cycle mode; swap them out to simulate
+// RTC memory and deep sleep cycles when running on the host.
+typedef struct {
+    bool (*rtcRead)(uint32_t offset, uint32_t *data, size_t size);
+    bool (*rtcWrite)(uint32_t offset, uint32_t *data, size_t size);
+    void (*deepSleep)(uint64_t micros);
+    bool (*wokeFromSleep)();
+} GizmoSleepBackend;
+
+typedef struct {
+    char topic[MAX_READING_TOPIC_SIZE];
+    char payload[MAX_READING_PAYLOAD_SIZE];
+} GizmoReading;
+
+// State carried across deep sleep cycles; guarded by a CRC over everything after the crc field.
+typedef struct {
+    uint32_t crc;
+    uint32_t magic;
+    uint32_t wakeCount;
+    uint32_t sequence;
+    uint32_t lastAwakeTime;
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t flags;
+    uint8_t network;
+    uint8_t reserved[3];
+    uint32_t ip;
+    uint32_t gateway;
+    uint32_t mask;
+    uint32_t dns;
+    uint32_t brokerIP;
+    uint32_t brokerHostCRC;
+    uint32_t readingCount;
+    GizmoReading readings[MAX_QUEUED_READINGS];
+} GizmoRTCState;
+
+static_assert(sizeof(GizmoRTCState) % 4 == 0, "RTC state must be a whole number of RTC blocks");
+static_assert(sizeof(GizmoRTCState) <= 448, "RTC state must leave room for other RTC records");
+
+extern const GizmoSleepBackend espSleepBackend;
+
+// Sends one queued reading; returns false if it did not go out.
+typedef std::function<bool(const char *topic, const char *payload)> GizmoReadingPublisher;
+
+uint32_t gizmoCRC32(const void *data, size_t length);
+
+bool loadRTCState(const GizmoSleepBackend *backend, GizmoRTCState *state);
+void saveRTCState(const GizmoSleepBackend *backend, GizmoRTCState *state);
+
+// Queues a reading in the RTC state, dropping the oldest one when full; returns false if one was dropped.
+bool queueRTCReading(GizmoRTCState *state, const char *topic, const char *payload);
+// Publishes queued readings in order, stopping at the first failure so the rest stay
+// queued for the next wake; returns how many went out.
+uint32_t publishRTCReadings(GizmoRTCState *state, GizmoReadingPublisher publisher);
@@ -0,0 +1,80 @@
+#include <ESPGizmoTLS.h>
+
+bool GizmoSecureClient::setTrust(const char *fingerprint, fs::FS &fs, const char *caFile) {
+    setSession(&session);
+    if (fingerprint && strlen(fingerprint)) {
+        trusted = setFingerprint(fingerprint);
+        if (!trusted) {
+            Serial.printf("Invalid MQTT broker fingerprint %s\n", fingerprint);
+        }
+        return trusted;
+    }
+
+    File f = fs.open(caFile, "r");
+    if (f && f.size() < MAX_CA_FILE_SIZE) {
+        char *pem = (char *) malloc(f.size() + 1);
+        if (pem) {
+            int l = f.readBytes(pem, f.size());
+            pem[l] = '\0';
+            BearSSL::X509List *list = new BearSSL::X509List(pem);
+            free(pem);
+            f.close();
+            if (list->getCount() > 0) {
+                delete anchors;
+                anchors = list;
+                setTrustAnchors(anchors);
+                trusted = true;
+                return true;
+            }
+            delete list;
+            Serial.printf("No certificates in %s\n", caFile);
+        }
+    }
+    if (f) {
+        Serial.printf("Unable to load %s\n", caFile);
+        f.close();
+    }
+
+    Serial.printf("No MQTT broker fingerprint or %s; refusing to connect unverified\n", caFile);
+    trusted = false;
+    return false;
+}
+
+// Notes the session ID offered for resumption; the broker resumes by echoing it back.
+void GizmoSecureClient::offerSession() {
+    br_ssl_session_parameters *params = session.getSession();
+    offeredIDLength = params->session_id_len <= sizeof(offeredID) ? params->session_id_len : 0;
+    memcpy(offeredID, params->session_id, offeredIDLength);
+}
+
+int GizmoSecureClient::connect(IPAddress ip, uint16_t port) {
+    uint32_t start = millis();
+    offerSession();
+    return handshakeDone(BearSSL::WiFiClientSecure::connect(ip, port), start);
+}
+
+int GizmoSecureClient::connect(const char *host, uint16_t port) {
+    uint32_t start = millis();
+    offerSession();
+    return handshakeDone(BearSSL::WiFiClientSecure::connect(host, port), start);
+}
+
+int GizmoSecureClient::handshakeDone(int connected, uint32_t start) {
+    lastHandshakeTime = millis() - start;
+    lastHandshakeResumed = false;
+    if (connected) {
+        // The client copies the negotiated parameters into the session after each handshake.
+        br_ssl_session_parameters *params = session.getSession();
+        lastHandshakeResumed = offeredIDLength && params->session_id_len == offeredIDLength &&
+                               !memcmp(params->session_id, offeredID, offeredIDLength);
+        handshakes++;
+        Serial.printf("TLS handshake took %u ms%s\n", lastHandshakeTime,
+                      lastHandshakeResumed ? " with resumed session" : "");
+    } else {
+        char error[64];
+        failures++;
+        getLastSSLError(error, sizeof(error));
+        Serial.printf("TLS handshake failed after %u ms: %s\n", lastHandshakeTime, error);
+    }
+    return connected;
+}
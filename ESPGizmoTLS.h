@@ -0,0 +1,37 @@
+#pragma once
+
+#include <ESP8266WiFi.h>
+#include <FS.h>
+
+#define MAX_CA_FILE_SIZE        4096
+
+// TLS client for the MQTT connection. The BearSSL session is kept for the life of the
+// client so every reconnect after the first offers it for resumption and skips the
+// key exchange, which is most of the handshake time on an ESP8266.
+class GizmoSecureClient : public BearSSL::WiFiClientSecure {
+public:
+    // Trust the broker by SHA-1 fingerprint if given, else by the CA certificate in
+    // caFile. With neither, the client has nothing to verify the broker against and
+    // refuses to connect rather than hand credentials to whoever answers. The CA is parsed
+    // here only, so call this again when the file changes.
+    bool setTrust(const char *fingerprint, fs::FS &fs, const char *caFile);
+
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char *host, uint16_t port);
+
+    bool trusted = false;
+    uint32_t lastHandshakeTime = 0;
+    // Whether the broker took up the cached session on the last handshake
+    bool lastHandshakeResumed = false;
+    uint32_t handshakes = 0;
+    uint32_t failures = 0;
+
+private:
+    void offerSession();
+    int handshakeDone(int connected, uint32_t start);
+
+    BearSSL::Session session;
+    BearSSL::X509List *anchors = NULL;
+    uint8_t offeredID[32];
+    uint8_t offeredIDLength = 0;
+};
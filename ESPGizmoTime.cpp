@@ -0,0 +1,257 @@
+#include <ESPGizmoTime.h>
+
+#define NTP_PORT            123
+#define NTP_PACKET_SIZE     48
+#define NTP_UNIX_OFFSET     2208988800UL
+
+const GizmoDSTRule US_DST_RULE = {60, {2, 0, 3, 2, false}, {1, 0, 11, 1, false}};
+const GizmoDSTRule EU_DST_RULE = {60, {5, 0, 3, 1, true}, {5, 0, 10, 1, true}};
+
+static uint32_t lastMillis = 0;
+static uint32_t millisWraps = 0;
+
+uint64_t gizmoUptime() {
+    uint32_t ms = millis();
+    if (ms < lastMillis) {
+        millisWraps++;
+    }
+    lastMillis = ms;
+    return ((uint64_t) millisWraps << 32) | ms;
+}
+
+char *formatUint64(char *buf, uint64_t value) {
+    char tmp[21];
+    int i = 0;
+    do {
+        tmp[i++] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+    for (int j = 0; j < i; j++) {
+        buf[j] = tmp[i - j - 1];
+    }
+    buf[i] = '\0';
+    return buf;
+}
+
+// Days since 1970-01-01 for the given civil date.
+static int32_t daysFromCivil(int32_t y, uint32_t m, uint32_t d) {
+    y -= m <= 2;
+    int32_t era = (y >= 0 ? y : y - 399) / 400;
+    uint32_t yoe = (uint32_t) (y - era * 400);
+    uint32_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int32_t) doe - 719468;
+}
+
+static int32_t yearFromDays(int32_t z) {
+    z += 719468;
+    int32_t era = (z >= 0 ? z : z - 146096) / 146097;
+    uint32_t doe = (uint32_t) (z - era * 146097);
+    uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    uint32_t mp = (5 * doy + 2) / 153;
+    return (int32_t) yoe + era * 400 + (mp >= 10);
+}
+
+// Seconds since epoch, in local standard time, of the given transition.
+static int64_t transitionTime(int32_t year, const GizmoDSTTransition *t, int32_t standard) {
+    int32_t day;
+    if (t->week == 5) {
+        int32_t last = daysFromCivil(t->month == 12 ? year + 1 : year, t->month == 12 ? 1 : t->month + 1, 1) - 1;
+        int32_t dow = (last + 4) % 7;
+        day = last - (dow - t->dayOfWeek + 7) % 7;
+    } else {
+        int32_t first = daysFromCivil(year, t->month, 1);
+        int32_t dow = (first + 4) % 7;
+        day = first + (t->dayOfWeek - dow + 7) % 7 + (t->week - 1) * 7;
+    }
+    return (int64_t) day * 86400 + t->hour * 3600 + (t->utc ? standard : 0);
+}
+
+GizmoTime::GizmoTime() {
+}
+
+bool GizmoTime::addServer(const char *server) {
+    if (serverCount < MAX_TIME_SERVERS) {
+        servers[serverCount][0] = '\0';
+        strncat(servers[serverCount], server, MAX_TIME_SERVER_SIZE - 1);
+        serverCount++;
+        return true;
+    }
+    return false;
+}
+
+void GizmoTime::setTimeZone(int16_t offsetMinutes, const GizmoDSTRule *dstRule) {
+    tzOffset = offsetMinutes;
+    dst = dstRule;
+}
+
+void GizmoTime::begin() {
+    if (!serverCount) {
+        addServer(NTP_DEFAULT_SERVER);
+    }
+    if (!started) {
+        udp.begin(0);
+        started = true;
+    }
+    nextPoll = gizmoUptime();
+}
+
+bool GizmoTime::isSynced() {
+    return synced;
+}
+
+int64_t GizmoTime::currentOffset(uint64_t uptime) {
+    int64_t applied = (int64_t) ((uptime - slewStart) / NTP_SLEW_DIVISOR);
+    if (slew < 0) {
+        applied = applied > -slew ? slew : -applied;
+    } else {
+        applied = applied > slew ? slew : applied;
+    }
+    return offset + applied + (int64_t) (drift * (float) (uptime - lastSync) / 1e6f);
+}
+
+uint64_t GizmoTime::now() {
+    if (!synced) {
+        return 0;
+    }
+    uint64_t uptime = gizmoUptime();
+    return uptime + currentOffset(uptime);
+}
+
+int32_t GizmoTime::localOffset(uint64_t utc) {
+    int32_t standard = tzOffset * 60;
+    if (!dst || !dst->offset) {
+        return standard;
+    }
+
+    int64_t local = (int64_t) (utc / 1000) + standard;
+    int32_t year = yearFromDays((int32_t) (local / 86400));
+    int64_t start = transitionTime(year, &dst->start, standard);
+    int64_t end = transitionTime(year, &dst->end, standard);
+    bool inDST = start < end ? (local >= start && local < end) : (local >= start || local < end);
+    return inDST ? standard + dst->offset * 60 : standard;
+}
+
+uint64_t GizmoTime::localNow() {
+    uint64_t utc = now();
+    return utc ? utc + (int64_t) localOffset(utc) * 1000 : 0;
+}
+
+int32_t GizmoTime::getLastCorrection() {
+    return lastCorrection;
+}
+
+uint32_t GizmoTime::getPollInterval() {
+    return pollInterval;
+}
+
+float GizmoTime::getDrift() {
+    return drift;
+}
+
+void GizmoTime::sendRequest() {
+    uint8_t packet[NTP_PACKET_SIZE];
+    memset(packet, 0, NTP_PACKET_SIZE);
+    packet[0] = 0x23;   // LI 0, version 4, client mode
+
+    // Drop any stale response before asking again.
+    while (udp.parsePacket() > 0) {
+        udp.flush();
+    }
+
+    if (udp.beginPacket(servers[currentServer], NTP_PORT)) {
+        udp.write(packet, NTP_PACKET_SIZE);
+        if (udp.endPacket()) {
+            requestTime = gizmoUptime();
+            return;
+        }
+    }
+    Serial.printf("Unable to send NTP request to %s\n", servers[currentServer]);
+    currentServer = (currentServer + 1) % serverCount;
+    nextPoll = gizmoUptime() + NTP_RETRY_INTERVAL;
+}
+
+static uint64_t readTimestamp(const uint8_t *p) {
+    uint32_t seconds = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+    uint32_t fraction = ((uint32_t) p[4] << 24) | ((uint32_t) p[5] << 16) | ((uint32_t) p[6] << 8) | p[7];
+    return (uint64_t) (seconds - NTP_UNIX_OFFSET) * 1000 + (((uint64_t) fraction * 1000) >> 32);
+}
+
+bool GizmoTime::readResponse() {
+    if (udp.parsePacket() < NTP_PACKET_SIZE) {
+        return false;
+    }
+
+    uint64_t responseTime = gizmoUptime();
+    uint8_t packet[NTP_PACKET_SIZE];
+    udp.read(packet, NTP_PACKET_SIZE);
+
+    // Reject kiss-o'-death and unsynchronized servers.
+    if ((packet[0] & 0xc0) == 0xc0 || packet[1] == 0 || packet[1] > 15) {
+        Serial.printf("NTP server %s is not synchronized\n", servers[currentServer]);
+        currentServer = (currentServer + 1) % serverCount;
+        return true;
+    }
+
+    uint64_t received = readTimestamp(packet + 32);
+    uint64_t transmitted = readTimestamp(packet + 40);
+    int64_t delay = (int64_t) (responseTime - requestTime) - (int64_t) (transmitted - received);
+    if (delay < 0) {
+        delay = 0;
+    }
+
+    applySample((int64_t) (transmitted + delay / 2) - (int64_t) responseTime, responseTime);
+    return true;
+}
+
+void GizmoTime::applySample(int64_t sample, uint64_t uptime) {
+    int64_t correction = sample - currentOffset(uptime);
+    lastCorrection = (int32_t) correction;
+
+    if (!synced || correction > NTP_STEP_THRESHOLD || correction < -NTP_STEP_THRESHOLD) {
+        offset = sample;
+        slew = 0;
+        drift = 0;
+        synced = true;
+        pollInterval = NTP_MIN_POLL_INTERVAL;
+    } else {
+        // Fold in the elapsed interval at the old drift first, then learn the crystal
+        // drift from the residual and slew the rest in gradually.
+        offset = currentOffset(uptime);
+        if (uptime > lastSync) {
+            float observed = (float) correction * 1e6f / (float) (uptime - lastSync);
+            drift += observed / 4;
+        }
+        slew = correction;
+
+        if (correction < 50 && correction > -50) {
+            pollInterval = pollInterval * 2 > NTP_MAX_POLL_INTERVAL ? NTP_MAX_POLL_INTERVAL : pollInterval * 2;
+        } else if (correction > 250 || correction < -250) {
+            pollInterval = pollInterval / 2 < NTP_MIN_POLL_INTERVAL ? NTP_MIN_POLL_INTERVAL : pollInterval / 2;
+        }
+    }
+    slewStart = uptime;
+    lastSync = uptime;
+}
+
+void GizmoTime::loop(bool networkReady) {
+    if (!started) {
+        return;
+    }
+
+    uint64_t uptime = gizmoUptime();
+    if (requestTime) {
+        if (readResponse()) {
+            requestTime = 0;
+            nextPoll = uptime + pollInterval;
+        } else if (uptime - requestTime > NTP_RESPONSE_TIMEOUT) {
+            Serial.printf("No NTP response from %s\n", servers[currentServer]);
+            requestTime = 0;
+            currentServer = (currentServer + 1) % serverCount;
+            nextPoll = uptime + NTP_RETRY_INTERVAL;
+        }
+    } else if (networkReady && uptime >= nextPoll) {
+        sendRequest();
+    }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <ESP8266WiFi.h>
+#include <WiFiUdp.h>
+
+#define MAX_TIME_SERVERS        3
+#define MAX_TIME_SERVER_SIZE    32
+
+#define NTP_DEFAULT_SERVER      "pool.ntp.org"
+
+// Adaptive polling bounds; the interval doubles while corrections stay small.
+#define NTP_MIN_POLL_INTERVAL   64000
+#define NTP_MAX_POLL_INTERVAL   2048000
+#define NTP_RETRY_INTERVAL      16000
+#define NTP_RESPONSE_TIMEOUT    1500
+
+// Corrections larger than this step the clock; smaller ones are slewed.
+#define NTP_STEP_THRESHOLD      1000
+// Slew at most 1 ms for every NTP_SLEW_DIVISOR ms of uptime, keeping now() monotonic.
+#define NTP_SLEW_DIVISOR        2000
+
+// Week of month 5 means the last such weekday in the month. Both transitions are
+// given in local standard time, so a change at 2:00 daylight time is written as 1:00,
+// unless utc is set, as for the EU where every zone changes at 1:00 UTC.
+typedef struct {
+    uint8_t week;
+    uint8_t dayOfWeek;  // 0 = Sunday
+    uint8_t month;      // 1-12
+    uint8_t hour;       // local standard time, or UTC if utc is set
+    bool utc;
+} GizmoDSTTransition;
+
+typedef struct {
+    int16_t offset;     // minutes added while DST is in effect
+    GizmoDSTTransition start;
+    GizmoDSTTransition end;
+} GizmoDSTRule;
+
+extern const GizmoDSTRule US_DST_RULE;
+extern const GizmoDSTRule EU_DST_RULE;
+
+// Wrap-safe 64-bit milliseconds since boot; call at least once per millis() wrap (~49 days).
+uint64_t gizmoUptime();
+
+// Formats an unsigned 64-bit value in decimal; buf must hold at least 21 characters.
+char *formatUint64(char *buf, uint64_t value);
+
+class GizmoTime {
+public:
+    GizmoTime();
+
+    bool addServer(const char *server);
+    void setTimeZone(int16_t offsetMinutes, const GizmoDSTRule *dstRule);
+
+    void begin();
+    void loop(bool networkReady);
+
+    bool isSynced();
+    uint64_t now();
+    uint64_t localNow();
+    int32_t localOffset(uint64_t utc);
+
+    int32_t getLastCorrection();
+    uint32_t getPollInterval();
+    float getDrift();
+
+private:
+    WiFiUDP udp;
+    char servers[MAX_TIME_SERVERS][MAX_TIME_SERVER_SIZE];
+    int serverCount = 0;
+    int currentServer = 0;
+
+    int16_t tzOffset = 0;
+    const GizmoDSTRule *dst = NULL;
+
+    bool started = false;
+    bool synced = false;
+    uint64_t requestTime = 0;
+    uint64_t nextPoll = 0;
+    uint32_t pollInterval = NTP_MIN_POLL_INTERVAL;
+
+    // Epoch time in ms is uptime + offset + slew in progress + drift since last sync.
+    int64_t offset = 0;
+    int64_t slew = 0;
+    uint64_t slewStart = 0;
+    uint64_t lastSync = 0;
+    float drift = 0;
+    int32_t lastCorrection = 0;
+
+    int64_t currentOffset(uint64_t uptime);
+    void sendRequest();
+    bool readResponse();
+    void applySample(int64_t sample, uint64_t uptime);
+};
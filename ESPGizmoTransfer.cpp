@@ -0,0 +1,314 @@
+#include <ESPGizmoTransfer.h>
+#include <ESPGizmoFS.h>
+#include <ESPGizmoScratch.h>
+#include <bearssl/bearssl.h>
+
+#define MAX_MANIFEST_SIZE   160
+#define MAX_STATE_SIZE      (MAX_MANIFEST_SIZE + 16)
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static bool parseHex(const char *hex, uint8_t *out, size_t size) {
+    if (strlen(hex) != size * 2) {
+        return false;
+    }
+    for (size_t i = 0; i < size * 2; i++) {
+        char c = hex[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (v < 0) {
+            return false;
+        }
+        out[i / 2] = (out[i / 2] << 4) | v;
+    }
+    return true;
+}
+
+// Splits the next '|' terminated field off *cursor; NULL once the fields run out.
+static char *nextField(char **cursor) {
+    char *field = *cursor;
+    char *end = strchr(field, '|');
+    if (!end) {
+        return NULL;
+    }
+    *end = '\0';
+    *cursor = end + 1;
+    return field;
+}
+
+GizmoFileTransfer::GizmoFileTransfer(FS *fs, const char *prefix, const char *hostname) : fs(fs) {
+    snprintf(base, sizeof(base), TRANSFER_TOPIC, prefix && prefix[0] ? prefix : hostname);
+    snprintf(manifest, sizeof(manifest), "%s/manifest", base);
+    snprintf(chunk, sizeof(chunk), "%s/chunk", base);
+    path[0] = '\0';
+}
+
+void GizmoFileTransfer::setStatusCallback(GizmoTransferStatusCallback callback) {
+    this->callback = callback;
+}
+
+const char *GizmoFileTransfer::manifestTopic() {
+    return manifest;
+}
+
+const char *GizmoFileTransfer::chunkTopic() {
+    return chunk;
+}
+
+const char *GizmoFileTransfer::statusTopic(char *buf, size_t size, const char *hostname) {
+    snprintf(buf, size, "%s/status/%s", base, hostname);
+    return buf;
+}
+
+bool GizmoFileTransfer::handleMessage(const char *topic, const uint8_t *payload, unsigned int length) {
+    if (!strcmp(topic, chunk)) {
+        handleChunk(payload, length);
+    } else if (!strcmp(topic, manifest)) {
+        handleManifest(payload, length);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void GizmoFileTransfer::report(const char *format, ...) {
+    char status[64];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(status, sizeof(status), format, args);
+    va_end(args);
+    Serial.printf("File transfer: %s\n", status);
+    if (callback) {
+        callback(status);
+    }
+}
+
+void GizmoFileTransfer::reportNeed(bool force) {
+    uint32_t now = millis();
+    if (force || now - lastNeed > TRANSFER_NEED_INTERVAL) {
+        lastNeed = now;
+        report("%u need %u/%u", id, committed, chunks);
+    }
+}
+
+void GizmoFileTransfer::saveState(const char *state) {
+    File f = fs->open(TRANSFER_STATE, "w");
+    if (f) {
+        char hex[65];
+        for (int i = 0; i < 32; i++) {
+            sprintf(hex + i * 2, "%02x", digest[i]);
+        }
+        f.printf("%u|%s|%u|%u|%s|%s|\n", id, path, size, chunkSize, hex, state);
+        f.close();
+    }
+}
+
+bool GizmoFileTransfer::loadState(uint32_t expectedId, char *state, size_t stateSize) {
+    // Only the id and the trailing state matter; the rest repeats the manifest.
+    char line[MAX_STATE_SIZE];
+    File f = fs->open(TRANSFER_STATE, "r");
+    if (!f) {
+        return false;
+    }
+    int l = f.readBytesUntil('\n', line, sizeof(line) - 1);
+    f.close();
+    line[l] = '\0';
+
+    char *cursor = line;
+    char *field = nextField(&cursor);
+    if (!field || (uint32_t) strtoul(field, NULL, 10) != expectedId) {
+        return false;
+    }
+    for (int i = 0; i < 4 && field; i++) {
+        field = nextField(&cursor);
+    }
+    field = field ? nextField(&cursor) : NULL;
+    if (!field) {
+        return false;
+    }
+    state[0] = '\0';
+    strncat(state, field, stateSize - 1);
+    return true;
+}
+
+void GizmoFileTransfer::handleManifest(const uint8_t *payload, unsigned int length) {
+    char buf[MAX_MANIFEST_SIZE];
+    if (!length || length >= sizeof(buf)) {
+        // An empty retained manifest just clears the topic.
+        return;
+    }
+    memcpy(buf, payload, length);
+    buf[length] = '\0';
+
+    char *cursor = buf;
+    char *fields[5];
+    for (int i = 0; i < 5; i++) {
+        fields[i] = nextField(&cursor);
+        if (!fields[i]) {
+            Serial.printf("File transfer: malformed manifest\n");
+            return;
+        }
+    }
+    uint32_t newId = strtoul(fields[0], NULL, 10);
+    uint32_t newSize = strtoul(fields[2], NULL, 10);
+    uint32_t newChunkSize = strtoul(fields[3], NULL, 10);
+    uint8_t newDigest[32];
+    if (!isUserFilePath(fields[1]) || strlen(fields[1]) >= MAX_TRANSFER_PATH ||
+        newChunkSize < MIN_TRANSFER_CHUNK || newChunkSize > MAX_TRANSFER_CHUNK ||
+        !parseHex(fields[4], newDigest, sizeof(newDigest))) {
+        Serial.printf("File transfer: manifest %u rejected\n", newId);
+        return;
+    }
+
+    if (active && newId == id) {
+        // The sender is asking who still needs what.
+        reportNeed(true);
+        return;
+    }
+    if (active) {
+        // A newer transfer replaces the one in progress.
+        file.close();
+        active = false;
+    }
+
+    // A finished transfer is not taken again; a failed one starts over.
+    char state[12];
+    bool known = loadState(newId, state, sizeof(state));
+    if (known && !strcmp(state, "done")) {
+        report("%u done", newId);
+        return;
+    }
+    bool resume = known && !strcmp(state, "active");
+
+    id = newId;
+    strcpy(path, fields[1]);
+    size = newSize;
+    chunkSize = newChunkSize;
+    chunks = (size + chunkSize - 1) / chunkSize;
+    memcpy(digest, newDigest, sizeof(digest));
+    committed = 0;
+
+    if (resume && fs->exists(TRANSFER_TEMP_FILE)) {
+        // Resume after the last whole chunk that reached flash.
+        file = fs->open(TRANSFER_TEMP_FILE, "a");
+        if (file) {
+            committed = file.size() / chunkSize;
+            if (committed > chunks || !file.truncate(committed * chunkSize)) {
+                file.close();
+                committed = 0;
+            }
+        }
+    }
+    if (!committed) {
+        file = fs->open(TRANSFER_TEMP_FILE, "w");
+    }
+    if (!file) {
+        fail("open");
+        return;
+    }
+    active = true;
+    saveState("active");
+    Serial.printf("File transfer %u: %s, %u bytes in %u chunks, resuming at %u\n",
+                  id, path, size, chunks, committed);
+    if (committed == chunks) {
+        finish();
+    } else {
+        reportNeed(true);
+    }
+}
+
+void GizmoFileTransfer::handleChunk(const uint8_t *payload, unsigned int length) {
+    if (!active || length < TRANSFER_HEADER_SIZE || get32(payload) != id) {
+        return;
+    }
+    uint32_t index = get32(payload + 4);
+    if (index < committed) {
+        // Already have it; the sender is rewinding for someone else.
+        return;
+    }
+    if (index > committed) {
+        reportNeed(false);
+        return;
+    }
+
+    const uint8_t *data = payload + TRANSFER_HEADER_SIZE;
+    uint32_t dataLength = length - TRANSFER_HEADER_SIZE;
+    uint32_t expected = index + 1 < chunks ? chunkSize : size - index * chunkSize;
+    uint8_t hash[32];
+    br_sha256_context sha;
+    br_sha256_init(&sha);
+    br_sha256_update(&sha, data, dataLength);
+    br_sha256_out(&sha, hash);
+    if (dataLength != expected || memcmp(hash, payload + 8, sizeof(hash))) {
+        chunksRejected++;
+        reportNeed(true);
+        return;
+    }
+
+    if (file.write(data, dataLength) != dataLength) {
+        fail("write");
+        return;
+    }
+    // Make the chunk durable, so that a restart resumes after it.
+    file.flush();
+    committed++;
+    chunksReceived++;
+
+    if (committed == chunks) {
+        finish();
+    } else if (committed % TRANSFER_PROGRESS_CHUNKS == 0) {
+        reportNeed(true);
+    }
+}
+
+void GizmoFileTransfer::finish() {
+    file.close();
+    active = false;
+
+    uint8_t hash[32];
+    br_sha256_context sha;
+    br_sha256_init(&sha);
+    GizmoScratch buf(256);
+    if (!buf.size()) {
+        fail("memory");
+        return;
+    }
+    File f = fs->open(TRANSFER_TEMP_FILE, "r");
+    uint32_t total = 0;
+    while (f && f.available()) {
+        int l = f.read(buf.bytes(), buf.size());
+        if (l <= 0) {
+            break;
+        }
+        br_sha256_update(&sha, buf.bytes(), l);
+        total += l;
+    }
+    f.close();
+    br_sha256_out(&sha, hash);
+
+    if (total != size || memcmp(hash, digest, sizeof(hash))) {
+        fail("digest");
+        return;
+    }
+    makeParentDirs(path);
+    fs->remove(path);
+    if (!fs->rename(TRANSFER_TEMP_FILE, path)) {
+        fail("rename");
+        return;
+    }
+    filesCompleted++;
+    saveState("done");
+    report("%u done", id);
+}
+
+void GizmoFileTransfer::fail(const char *reason) {
+    if (file) {
+        file.close();
+    }
+    active = false;
+    fs->remove(TRANSFER_TEMP_FILE);
+    saveState("failed");
+    report("%u failed %s", id, reason);
+}
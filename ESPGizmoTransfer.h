@@ -0,0 +1,85 @@
+#pragma once
+
+#include <FS.h>
+#include <functional>
+
+// Chunked file transfer over MQTT, for sites where only the broker is reachable.
+//
+// The sender publishes a manifest, retained, to <base>/manifest:
+//     id|path|size|chunkSize|sha256|
+// where id is a decimal transfer number and sha256 the hex digest of the whole file.
+// It then publishes each chunk to <base>/chunk as
+//     id (4 bytes) | index (4 bytes) | SHA-256 of the data (32 bytes) | data
+// with integers big-endian. All devices sharing the base topic take the same broadcast.
+//
+// Chunks are appended to a temporary file as they arrive, strictly in order; on
+// <base>/status/<hostname> each device reports "<id> need <index>/<chunks>" whenever
+// it is missing a chunk, so the sender can rewind to the lowest one still needed.
+// The file is only moved into place once its whole-file digest matches; a restart
+// resumes from the last chunk committed to flash. Targets must pass isUserFilePath(),
+// which keeps transfers away from /cfg and the temporary file.
+#define TRANSFER_TOPIC              "gizmo/files/%s"
+#define TRANSFER_STATE              "/cfg/transfer"
+#define TRANSFER_TEMP_FILE          "/.transfer"
+
+#define MAX_TRANSFER_CHUNK          1024
+#define MIN_TRANSFER_CHUNK          64
+#define MAX_TRANSFER_PATH           48
+#define MAX_TRANSFER_TOPIC_SIZE     64
+#define TRANSFER_HEADER_SIZE        40
+
+// PubSubClient buffer needed to receive the largest chunk
+#define TRANSFER_BUFFER_SIZE        (MAX_TRANSFER_CHUNK + TRANSFER_HEADER_SIZE + MAX_TRANSFER_TOPIC_SIZE + 8)
+
+// Progress is also reported every this many chunks, and repeated requests for a
+// missing chunk no more often than TRANSFER_NEED_INTERVAL.
+#define TRANSFER_PROGRESS_CHUNKS    32
+#define TRANSFER_NEED_INTERVAL      1000
+
+typedef std::function<void(const char *status)> GizmoTransferStatusCallback;
+
+class GizmoFileTransfer {
+public:
+    // Devices without a topic prefix use their own hostname as the base, as for other per-device topics.
+    GizmoFileTransfer(FS *fs, const char *prefix, const char *hostname);
+
+    void setStatusCallback(GizmoTransferStatusCallback callback);
+
+    const char *manifestTopic();
+    const char *chunkTopic();
+    const char *statusTopic(char *buf, size_t size, const char *hostname);
+
+    // Takes a message if it belongs to the transfer; returns false otherwise.
+    bool handleMessage(const char *topic, const uint8_t *payload, unsigned int length);
+
+    uint32_t chunksReceived = 0;
+    uint32_t chunksRejected = 0;
+    uint32_t filesCompleted = 0;
+
+private:
+    void handleManifest(const uint8_t *payload, unsigned int length);
+    void handleChunk(const uint8_t *payload, unsigned int length);
+    void finish();
+    void fail(const char *reason);
+    void reportNeed(bool force);
+    void report(const char *format, ...);
+    void saveState(const char *state);
+    bool loadState(uint32_t expectedId, char *state, size_t size);
+
+    FS *fs;
+    char base[MAX_TRANSFER_TOPIC_SIZE];
+    char manifest[MAX_TRANSFER_TOPIC_SIZE];
+    char chunk[MAX_TRANSFER_TOPIC_SIZE];
+    GizmoTransferStatusCallback callback = NULL;
+
+    bool active = false;
+    uint32_t id = 0;
+    char path[MAX_TRANSFER_PATH];
+    uint32_t size = 0;
+    uint32_t chunkSize = 0;
+    uint32_t chunks = 0;
+    uint8_t digest[32];
+    uint32_t committed = 0;
+    uint32_t lastNeed = 0;
+    File file;
+};
@@ -0,0 +1,220 @@
+#include <ESPGizmoUpload.h>
+#include <ESPGizmoFS.h>
+
+bool GizmoFlashWriter::open(FS *_fs, const char *_name) {
+    fs = _fs;
+    name[0] = '\0';
+    strncat(name, _name, MAX_UPLOAD_NAME - 1);
+    pageFill = 0;
+    written = 0;
+    file = fs->open(UPLOAD_TEMP_FILE, "w");
+    return file;
+}
+
+bool GizmoFlashWriter::flushPage() {
+    size_t l = file.write(page, pageFill);
+    written += l;
+    bool ok = l == pageFill;
+    pageFill = 0;
+    return ok;
+}
+
+size_t GizmoFlashWriter::write(const uint8_t *data, size_t length) {
+    if (!file) {
+        return 0;
+    }
+
+    size_t consumed = 0;
+    if (pageFill) {
+        size_t n = length < FLASH_PAGE_SIZE - pageFill ? length : FLASH_PAGE_SIZE - pageFill;
+        memcpy(page + pageFill, data, n);
+        pageFill += n;
+        consumed = n;
+        if (pageFill == FLASH_PAGE_SIZE && !flushPage()) {
+            return 0;
+        }
+    }
+
+    // Whole pages go straight from the caller's buffer; only the tail is copied.
+    size_t direct = (length - consumed) & ~(FLASH_PAGE_SIZE - 1);
+    if (direct) {
+        size_t l = file.write(data + consumed, direct);
+        written += l;
+        if (l != direct) {
+            return 0;
+        }
+        consumed += direct;
+    }
+
+    if (consumed < length) {
+        memcpy(page, data + consumed, length - consumed);
+        pageFill = length - consumed;
+    }
+    return length;
+}
+
+bool GizmoFlashWriter::commit() {
+    if (!file) {
+        return false;
+    }
+    bool ok = !pageFill || flushPage();
+    file.close();
+    if (ok) {
+        makeParentDirs(name);
+        fs->remove(name);
+        ok = fs->rename(UPLOAD_TEMP_FILE, name);
+    }
+    if (!ok) {
+        fs->remove(UPLOAD_TEMP_FILE);
+    }
+    return ok;
+}
+
+void GizmoFlashWriter::abort() {
+    if (file) {
+        file.close();
+        fs->remove(UPLOAD_TEMP_FILE);
+    }
+}
+
+bool isTarFile(const char *name) {
+    size_t l = strlen(name);
+    return l > 4 && !strcmp(name + l - 4, ".tar");
+}
+
+bool isGzipFile(const char *name) {
+    size_t l = strlen(name);
+    return (l > 3 && !strcmp(name + l - 3, ".gz")) || (l > 4 && !strcmp(name + l - 4, ".tgz"));
+}
+
+static uint32_t parseOctal(const uint8_t *field, size_t size) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < size && field[i]; i++) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            value = (value << 3) | (field[i] - '0');
+        }
+    }
+    return value;
+}
+
+GizmoTarExtractor::GizmoTarExtractor(FS *_fs) {
+    fs = _fs;
+}
+
+GizmoTarExtractor::~GizmoTarExtractor() {
+    if (writing) {
+        writer.abort();
+    }
+}
+
+bool GizmoTarExtractor::parseHeader() {
+    // Two zero blocks end the archive; a single one is enough for us.
+    if (!header[0]) {
+        finished = true;
+        return true;
+    }
+
+    uint32_t checksum = parseOctal(header + 148, 8);
+    uint32_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : header[i];
+    }
+    if (sum != checksum) {
+        Serial.printf("Corrupt tar header\n");
+        return false;
+    }
+
+    remaining = parseOctal(header + 124, 12);
+    padding = (TAR_BLOCK_SIZE - (remaining % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+
+    char type = header[156];
+    if (type != '0' && type != '\0') {
+        // Directories, links and pax/GNU extension records are skipped.
+        return true;
+    }
+
+    // Neither field needs a terminator when full, so copy no more than each holds.
+    char name[MAX_UPLOAD_NAME];
+    const char *member = (const char *) header;
+    size_t memberLength = strnlen(member, 100);
+    if (memberLength >= 2 && member[0] == '.' && member[1] == '/') {
+        member += 2;
+        memberLength -= 2;
+    }
+    int l;
+    if (!memcmp(header + 257, "ustar", 5) && header[345]) {
+        const char *prefix = (const char *) header + 345;
+        l = snprintf(name, sizeof(name), "/%.*s/%.*s", (int) strnlen(prefix, 155), prefix, (int) memberLength, member);
+    } else {
+        l = snprintf(name, sizeof(name), "/%.*s", (int) memberLength, member);
+    }
+    if (l >= (int) sizeof(name)) {
+        Serial.printf("Tar entry name too long\n");
+        return false;
+    }
+    if (!isUserFilePath(name)) {
+        // Configuration, temporary files and anything outside the root are off limits.
+        Serial.printf("Skipping tar entry %s\n", name);
+        skipped++;
+        return true;
+    }
+
+    writing = writer.open(fs, name);
+    if (!writing) {
+        Serial.printf("Unable to extract %s\n", name);
+        return false;
+    }
+    if (!remaining) {
+        finishEntry();
+    }
+    return true;
+}
+
+void GizmoTarExtractor::finishEntry() {
+    if (writer.commit()) {
+        files++;
+    } else {
+        failed = true;
+    }
+    writing = false;
+}
+
+bool GizmoTarExtractor::write(const uint8_t *data, size_t length) {
+    while (length && !failed && !finished) {
+        size_t n;
+        if (remaining) {
+            n = length < remaining ? length : remaining;
+            if (writing && writer.write(data, n) != n) {
+                failed = true;
+                break;
+            }
+            remaining -= n;
+            if (!remaining && writing) {
+                finishEntry();
+            }
+        } else if (padding) {
+            n = length < padding ? length : padding;
+            padding -= n;
+        } else {
+            n = length < TAR_BLOCK_SIZE - headerFill ? length : TAR_BLOCK_SIZE - headerFill;
+            memcpy(header + headerFill, data, n);
+            headerFill += n;
+            if (headerFill == TAR_BLOCK_SIZE) {
+                headerFill = 0;
+                failed = !parseHeader();
+            }
+        }
+        data += n;
+        length -= n;
+    }
+    return !failed;
+}
+
+bool GizmoTarExtractor::end() {
+    if (writing) {
+        writer.abort();
+        writing = false;
+        failed = true;
+    }
+    return !failed && !remaining;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <FS.h>
+
+// Flash writes are issued in multiples of the flash page size.
+#define FLASH_PAGE_SIZE     256
+#define TAR_BLOCK_SIZE      512
+#define MAX_UPLOAD_NAME     64
+
+#define UPLOAD_TEMP_FILE    "/.upload"
+
+// Writes a file through a temporary file in page-aligned runs and renames it
+// into place on commit, so readers never see a partially written file.
+class GizmoFlashWriter {
+public:
+    bool open(FS *fs, const char *name);
+    size_t write(const uint8_t *data, size_t length);
+    bool commit();
+    void abort();
+
+    size_t written = 0;
+
+private:
+    FS *fs = NULL;
+    File file;
+    char name[MAX_UPLOAD_NAME];
+    uint8_t page[FLASH_PAGE_SIZE];
+    size_t pageFill = 0;
+
+    bool flushPage();
+};
+
+// Extracts regular files from a ustar/GNU tar stream as it arrives; entries that
+// isUserFilePath() refuses are skipped.
+class GizmoTarExtractor {
+public:
+    GizmoTarExtractor(FS *fs);
+    ~GizmoTarExtractor();
+
+    bool write(const uint8_t *data, size_t length);
+    bool end();
+
+    uint32_t files = 0;
+    uint32_t skipped = 0;
+    bool failed = false;
+
+private:
+    FS *fs;
+    GizmoFlashWriter writer;
+    bool writing = false;
+    bool finished = false;
+    uint8_t header[TAR_BLOCK_SIZE];
+    size_t headerFill = 0;
+    uint32_t remaining = 0;
+    uint32_t padding = 0;
+
+    bool parseHeader();
+    void finishEntry();
+};
+
+bool isTarFile(const char *name);
+bool isGzipFile(const char *name);
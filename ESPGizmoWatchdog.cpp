@@ -0,0 +1,150 @@
+#include <ESPGizmoWatchdog.h>
+#include <Ticker.h>
+
+typedef struct {
+    const char *stage;
+    uint32_t started;
+    uint32_t deadline;
+} GizmoStageFrame;
+
+static const GizmoSleepBackend *rtc = NULL;
+static Ticker ticker;
+
+// The top-level loop stage, and the nested stages open inside it
+static GizmoStageFrame loopFrame;
+static bool loopOpen = false;
+static GizmoStageFrame frames[MAX_STAGE_DEPTH];
+static int depth = 0;
+
+// Mirror of the record in RTC memory
+static GizmoStallRecord record;
+
+static GizmoStallRecord blame;
+static bool hasBlame = false;
+static GizmoStallRecord overrun;
+static bool hasOverrun = false;
+static uint32_t overruns = 0;
+
+static void saveRecord(size_t size) {
+    if (rtc) {
+        rtc->rtcWrite(RTC_WATCHDOG_OFFSET, (uint32_t *) &record, size);
+    }
+}
+
+// Points the RTC record at the innermost open stage, or marks it idle.
+static void recordInnermost() {
+    GizmoStageFrame *frame = depth ? &frames[(depth < MAX_STAGE_DEPTH ? depth : MAX_STAGE_DEPTH) - 1] :
+                             loopOpen ? &loopFrame : NULL;
+    record.magic = RTC_WATCHDOG_MAGIC;
+    record.open = frame != NULL;
+    if (!frame) {
+        // Only the header needs to change.
+        saveRecord(2 * sizeof(uint32_t));
+        return;
+    }
+    record.stage[0] = '\0';
+    strncat(record.stage, frame->stage, MAX_STAGE_NAME_SIZE - 1);
+    record.started = frame->started;
+    record.duration = 0;
+    record.deadline = frame->deadline;
+    saveRecord(sizeof(record));
+}
+
+static void openFrame(GizmoStageFrame *frame, const char *stage, uint32_t deadline) {
+    frame->stage = stage;
+    frame->started = millis();
+    frame->deadline = deadline;
+}
+
+static void closeFrame(GizmoStageFrame *frame) {
+    uint32_t elapsed = millis() - frame->started;
+    if (elapsed <= frame->deadline) {
+        return;
+    }
+    overruns++;
+    Serial.printf("Stage %s took %u ms, over its %u ms deadline\n", frame->stage, elapsed, frame->deadline);
+    if (!hasOverrun || elapsed > overrun.duration) {
+        overrun.stage[0] = '\0';
+        strncat(overrun.stage, frame->stage, MAX_STAGE_NAME_SIZE - 1);
+        overrun.started = frame->started;
+        overrun.duration = elapsed;
+        overrun.deadline = frame->deadline;
+        hasOverrun = true;
+    }
+}
+
+static void tick() {
+    // Runs whenever the loop yields; a stage that never yields leaves duration at 0.
+    if (record.open && millis() - record.started > record.deadline) {
+        record.duration = millis() - record.started;
+        saveRecord(sizeof(record));
+    }
+}
+
+void watchdogBegin(const GizmoSleepBackend *backend) {
+    GizmoStallRecord last;
+    uint32_t reason = ESP.getResetInfoPtr()->reason;
+    if (backend->rtcRead(RTC_WATCHDOG_OFFSET, (uint32_t *) &last, sizeof(last)) &&
+        last.magic == RTC_WATCHDOG_MAGIC && last.open &&
+        (reason == REASON_WDT_RST || reason == REASON_SOFT_WDT_RST || reason == REASON_EXCEPTION_RST)) {
+        last.stage[MAX_STAGE_NAME_SIZE - 1] = '\0';
+        blame = last;
+        hasBlame = true;
+        Serial.printf("Previous boot was reset in stage %s after %u ms\n", blame.stage, blame.duration);
+    }
+    rtc = backend;
+    recordInnermost();
+    ticker.attach_ms(WATCHDOG_TICK, tick);
+}
+
+void watchdogStage(const char *stage, uint32_t deadline) {
+    if (loopOpen) {
+        closeFrame(&loopFrame);
+    }
+    loopOpen = stage != NULL;
+    if (loopOpen) {
+        openFrame(&loopFrame, stage, deadline);
+    }
+    if (!depth) {
+        recordInnermost();
+    }
+}
+
+GizmoStage::GizmoStage(const char *stage, uint32_t deadline) {
+    // Stages nested deeper than the table are timed as part of their parent.
+    if (depth < MAX_STAGE_DEPTH) {
+        openFrame(&frames[depth], stage, deadline);
+    }
+    depth++;
+    if (depth <= MAX_STAGE_DEPTH) {
+        recordInnermost();
+    }
+}
+
+GizmoStage::~GizmoStage() {
+    depth--;
+    if (depth < MAX_STAGE_DEPTH) {
+        closeFrame(&frames[depth]);
+        recordInnermost();
+    }
+}
+
+bool watchdogBlame(GizmoStallRecord *out) {
+    if (hasBlame) {
+        *out = blame;
+    }
+    return hasBlame;
+}
+
+bool watchdogTakeOverrun(GizmoStallRecord *out) {
+    if (!hasOverrun) {
+        return false;
+    }
+    *out = overrun;
+    hasOverrun = false;
+    return true;
+}
+
+uint32_t watchdogOverruns() {
+    return overruns;
+}
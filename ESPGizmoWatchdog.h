@@ -0,0 +1,66 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ESPGizmoSleep.h>
+
+// Software stall watchdog. The loop is divided into named stages, each with a deadline.
+// The stage in progress is mirrored into RTC memory, so when a blocked stage ends in a
+// hardware or software watchdog reset, the next boot can tell which one it was.
+#define RTC_WATCHDOG_OFFSET         (448 / 4)   // RTC blocks, just past the sleep state
+#define RTC_WATCHDOG_MAGIC          0x47535457
+
+#define MAX_STAGE_NAME_SIZE         20
+#define MAX_STAGE_DEPTH             4
+
+#ifndef WATCHDOG_STAGE_DEADLINE
+#define WATCHDOG_STAGE_DEADLINE     1000
+#endif
+#ifndef WATCHDOG_CALLBACK_DEADLINE
+#define WATCHDOG_CALLBACK_DEADLINE  500
+#endif
+// Application code between calls to isNetworkAvailable()
+#ifndef WATCHDOG_LOOP_DEADLINE
+#define WATCHDOG_LOOP_DEADLINE      2000
+#endif
+// Downloads and scans that block for long but keep yielding
+#define WATCHDOG_LONG_DEADLINE      60000
+
+// A stage past its deadline has its duration refreshed in RTC memory this often,
+// whenever it yields.
+#define WATCHDOG_TICK               250
+
+typedef struct {
+    uint32_t magic;
+    uint32_t open;
+    char stage[MAX_STAGE_NAME_SIZE];
+    uint32_t started;       // ms since boot when the stage began
+    uint32_t duration;      // ms spent in it, as last seen
+    uint32_t deadline;
+} GizmoStallRecord;
+
+static_assert(sizeof(GizmoStallRecord) % 4 == 0, "Stall record must be a whole number of RTC blocks");
+static_assert(RTC_WATCHDOG_OFFSET * 4 + sizeof(GizmoStallRecord) <= 512, "Stall record must fit in RTC memory");
+
+// Reads the record left by the previous boot and starts refreshing the current one.
+void watchdogBegin(const GizmoSleepBackend *backend);
+
+// Ends the current top-level stage and starts the next, like bootMark(); NULL ends
+// the last one. Stage names are kept by pointer, so they must be string literals.
+void watchdogStage(const char *stage, uint32_t deadline = WATCHDOG_STAGE_DEADLINE);
+
+// Times a nested stage, such as an application callback, for as long as it is in scope.
+class GizmoStage {
+public:
+    GizmoStage(const char *stage, uint32_t deadline = WATCHDOG_STAGE_DEADLINE);
+    ~GizmoStage();
+
+private:
+    GizmoStage(const GizmoStage &);
+    GizmoStage &operator=(const GizmoStage &);
+};
+
+// The stage that was running when a watchdog or exception reset the previous boot
+bool watchdogBlame(GizmoStallRecord *record);
+// The longest overrun since the last call, from stages that did complete
+bool watchdogTakeOverrun(GizmoStallRecord *record);
+uint32_t watchdogOverruns();
@@ -0,0 +1,312 @@
+#include <ESPGizmoWebServer.h>
+
+static uint8_t pumpBuffer[HTTP_PUMP_SIZE];
+
+GizmoWebServer::GizmoWebServer(int port, bool _async) : ESP8266WebServer(port) {
+    async = _async;
+    for (int i = 0; i < MAX_HTTP_CONNECTIONS; i++) {
+        connections[i].state = CONNECTION_FREE;
+        connections[i].events = NULL;
+        connections[i].eventsUsed = 0;
+    }
+    if (async) {
+        const char *headerKeys[] = {"Connection"};
+        collectHeaders(headerKeys, 1);
+        // Handler responses advertise keep-alive too, so their connections can be parked.
+        enableKeepAlive(true);
+    }
+}
+
+bool GizmoWebServer::isAsync() {
+    return async;
+}
+
+int GizmoWebServer::activeConnections() {
+    int count = 0;
+    for (int i = 0; i < MAX_HTTP_CONNECTIONS; i++) {
+        count += connections[i].state != CONNECTION_FREE;
+    }
+    return count;
+}
+
+GizmoWebServer::Connection *GizmoWebServer::freeConnection() {
+    for (int i = 0; i < MAX_HTTP_CONNECTIONS; i++) {
+        if (connections[i].state == CONNECTION_FREE) {
+            return &connections[i];
+        }
+    }
+    return NULL;
+}
+
+bool GizmoWebServer::requestKeepAlive() {
+    return !hasHeader("Connection") || strcasecmp(header("Connection").c_str(), "close");
+}
+
+bool GizmoWebServer::detach(GizmoConnectionState state, File *file) {
+    Connection *c = freeConnection();
+    if (!c) {
+        return false;
+    }
+    c->state = state;
+    c->client = _currentClient;
+    if (file) {
+        c->file = *file;
+    }
+    c->lastProgress = millis();
+    detached = true;
+    return true;
+}
+
+void GizmoWebServer::sendFile(File &file, const char *type, const char *cacheHeader, bool gzipped) {
+    if (!async || !file || !freeConnection()) {
+        if (cacheHeader) {
+            sendHeader("Cache-Control", cacheHeader);
+        }
+        streamFile(file, type);
+        file.close();
+        return;
+    }
+
+    bool keepAlive = requestKeepAlive();
+    char headers[256];
+    snprintf(headers, sizeof(headers),
+             "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %u\r\n%s%s%s%sConnection: %s\r\n\r\n",
+             type, (unsigned int) file.size(), gzipped ? "Content-Encoding: gzip\r\n" : "",
+             cacheHeader ? "Cache-Control: " : "", cacheHeader ? cacheHeader : "", cacheHeader ? "\r\n" : "",
+             keepAlive ? "keep-alive" : "close");
+    _currentClient.write((const uint8_t *) headers, strlen(headers));
+    // Without keep-alive the file is still sent; the connection then lingers until the client closes it.
+    detach(keepAlive ? CONNECTION_SENDING : CONNECTION_LINGER, &file);
+}
+
+void GizmoWebServer::beginEvents() {
+    if (eventClientCount >= MAX_EVENT_CLIENTS || !freeConnection()) {
+        send(503, "text/plain", "too many event clients");
+        return;
+    }
+
+    char *buffer = (char *) malloc(EVENT_BUFFER_SIZE);
+    if (!buffer) {
+        send(503, "text/plain", "out of memory");
+        return;
+    }
+
+    const char *headers = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+                          "Cache-Control: no-cache\r\nConnection: keep-alive\r\n\r\n";
+    _currentClient.write((const uint8_t *) headers, strlen(headers));
+    Connection *c = freeConnection();
+    detach(CONNECTION_EVENTS, NULL);
+    c->events = buffer;
+    c->eventsUsed = 0;
+    c->dropped = 0;
+    eventClientCount++;
+}
+
+int GizmoWebServer::eventClients() {
+    return eventClientCount;
+}
+
+bool GizmoWebServer::queueEvent(Connection *c, const char *event, const char *data) {
+    // Measure first so an event is either queued whole or dropped whole; the
+    // closing sprintf writes a terminator past the event, so keep a byte for it.
+    size_t length = strlen(event) + strlen(data) + 16;
+    for (const char *p = data; *p; p++) {
+        length += *p == '\n' ? 6 : 0;
+    }
+    if (c->eventsUsed + length >= EVENT_BUFFER_SIZE) {
+        c->dropped++;
+        return false;
+    }
+
+    char *out = c->events + c->eventsUsed;
+    out += sprintf(out, "event: %s\ndata: ", event);
+    for (const char *p = data; *p; p++) {
+        if (*p == '\n') {
+            out += sprintf(out, "\ndata: ");
+        } else if (*p != '\r') {
+            *out++ = *p;
+        }
+    }
+    out += sprintf(out, "\n\n");
+    c->eventsUsed = out - c->events;
+    return true;
+}
+
+void GizmoWebServer::sendEvent(const char *event, const char *data) {
+    for (int i = 0; i < MAX_HTTP_CONNECTIONS && eventClientCount; i++) {
+        Connection *c = &connections[i];
+        if (c->state == CONNECTION_EVENTS) {
+            if (c->dropped) {
+                char count[12];
+                snprintf(count, sizeof(count), "%u", c->dropped);
+                if (queueEvent(c, "dropped", count)) {
+                    c->dropped = 0;
+                }
+            }
+            queueEvent(c, event, data);
+        }
+    }
+}
+
+void GizmoWebServer::pumpEvents(Connection *c, uint32_t now) {
+    if (!c->eventsUsed && now - c->lastProgress > EVENT_PING_INTERVAL) {
+        c->eventsUsed = sprintf(c->events, ": ping\n\n");
+    }
+    if (!c->eventsUsed) {
+        return;
+    }
+
+    // A slow client only ever gets what fits its send window; the rest waits in its buffer.
+    size_t space = c->client.availableForWrite();
+    size_t n = space < c->eventsUsed ? space : c->eventsUsed;
+    if (n) {
+        n = c->client.write((const uint8_t *) c->events, n);
+        memmove(c->events, c->events + n, c->eventsUsed - n);
+        c->eventsUsed -= n;
+        c->lastProgress = now;
+    } else if (now - c->lastProgress > HTTP_TRANSFER_TIMEOUT) {
+        c->client.stop();
+        c->state = CONNECTION_FREE;
+    }
+}
+
+void GizmoWebServer::adoptKeepAlive() {
+    // Hand a parked connection with a new request back to the request parser.
+    for (int i = 0; i < MAX_HTTP_CONNECTIONS; i++) {
+        Connection *c = &connections[i];
+        if (c->state == CONNECTION_KEEPALIVE && c->client.available()) {
+            _currentClient = c->client;
+            _currentStatus = HC_WAIT_READ;
+            _statusChange = millis();
+            c->client = WiFiClient();
+            c->state = CONNECTION_FREE;
+            return;
+        }
+    }
+}
+
+void GizmoWebServer::pumpConnections() {
+    uint32_t now = millis();
+    for (int i = 0; i < MAX_HTTP_CONNECTIONS; i++) {
+        Connection *c = &connections[i];
+        if (c->state == CONNECTION_FREE) {
+            continue;
+        }
+
+        if (!c->client.connected()) {
+            c->state = CONNECTION_FREE;
+        } else if (c->state == CONNECTION_EVENTS) {
+            pumpEvents(c, now);
+        } else if (c->file) {
+            // Only write what fits the send window so handleClient() never blocks.
+            size_t space = c->client.availableForWrite();
+            if (space) {
+                int n = c->file.read(pumpBuffer, space < HTTP_PUMP_SIZE ? space : HTTP_PUMP_SIZE);
+                if (n > 0) {
+                    c->client.write(pumpBuffer, n);
+                    c->lastProgress = now;
+                }
+                if (n <= 0 || !c->file.available()) {
+                    c->file.close();
+                    c->lastProgress = now;
+                    if (c->state == CONNECTION_SENDING) {
+                        c->state = CONNECTION_KEEPALIVE;
+                    }
+                }
+            }
+            if (now - c->lastProgress > HTTP_TRANSFER_TIMEOUT) {
+                c->client.stop();
+                c->state = CONNECTION_FREE;
+            }
+        } else if (c->state == CONNECTION_KEEPALIVE && now - c->lastProgress > HTTP_KEEPALIVE_TIMEOUT) {
+            c->client.stop();
+            c->state = CONNECTION_FREE;
+        } else if (c->state == CONNECTION_LINGER && now - c->lastProgress > HTTP_LINGER_TIMEOUT) {
+            c->client.stop();
+            c->state = CONNECTION_FREE;
+        }
+
+        if (c->state == CONNECTION_FREE) {
+            if (c->file) {
+                c->file.close();
+            }
+            if (c->events) {
+                free(c->events);
+                c->events = NULL;
+                eventClientCount--;
+            }
+            c->client = WiFiClient();
+        }
+    }
+}
+
+void GizmoWebServer::handleClient() {
+    if (async && _currentStatus == HC_NONE) {
+        adoptKeepAlive();
+    }
+
+    ESP8266WebServer::handleClient();
+
+    // A response that is complete but not yet closed would otherwise hold the
+    // single request slot for up to two seconds; let it drain on its own, and
+    // park it for the client's next request unless it asked to close.
+    if (async && !detached && _currentStatus == HC_WAIT_CLOSE) {
+        detach(requestKeepAlive() ? CONNECTION_KEEPALIVE : CONNECTION_LINGER, NULL);
+    }
+    if (detached) {
+        _currentClient = WiFiClient();
+        _currentStatus = HC_NONE;
+        detached = false;
+    }
+
+    pumpConnections();
+}
+
+const char *contentType(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (!ext) return "application/octet-stream";
+    if (!strcmp(ext, ".html") || !strcmp(ext, ".htm")) return "text/html";
+    if (!strcmp(ext, ".css")) return "text/css";
+    if (!strcmp(ext, ".js")) return "application/javascript";
+    if (!strcmp(ext, ".json")) return "application/json";
+    if (!strcmp(ext, ".png")) return "image/png";
+    if (!strcmp(ext, ".jpg") || !strcmp(ext, ".jpeg")) return "image/jpeg";
+    if (!strcmp(ext, ".gif")) return "image/gif";
+    if (!strcmp(ext, ".svg")) return "image/svg+xml";
+    if (!strcmp(ext, ".ico")) return "image/x-icon";
+    if (!strcmp(ext, ".txt")) return "text/plain";
+    return "application/octet-stream";
+}
+
+GizmoStaticHandler::GizmoStaticHandler(GizmoWebServer *_server, FS &_fs, const char *_uri, const char *_path,
+                                       const char *_cacheHeader) : fs(_fs) {
+    server = _server;
+    uri = _uri;
+    path = _path;
+    cacheHeader = _cacheHeader;
+}
+
+bool GizmoStaticHandler::canHandle(HTTPMethod method, const String &requestUri) {
+    return method == HTTP_GET && !strncmp(requestUri.c_str(), uri, strlen(uri));
+}
+
+bool GizmoStaticHandler::handle(ESP8266WebServer &, HTTPMethod method, const String &requestUri) {
+    if (!canHandle(method, requestUri)) {
+        return false;
+    }
+
+    char file[64], gz[68];
+    snprintf(file, sizeof(file), "%s%s", path, requestUri.c_str() + strlen(uri));
+    if (file[strlen(file) - 1] == '/') {
+        strncat(file, "index.html", sizeof(file) - strlen(file) - 1);
+    }
+
+    snprintf(gz, sizeof(gz), "%s.gz", file);
+    bool gzipped = fs.exists(gz);
+    File f = fs.open(gzipped ? gz : file, "r");
+    if (!f) {
+        return false;
+    }
+    server->sendFile(f, contentType(file), cacheHeader, gzipped);
+    return true;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <ESP8266WebServer.h>
+#include <FS.h>
+
+// Connections the event-driven backend keeps in flight besides the one being parsed
+#ifndef MAX_HTTP_CONNECTIONS
+#define MAX_HTTP_CONNECTIONS    6
+#endif
+#define HTTP_PUMP_SIZE          536
+
+#define HTTP_TRANSFER_TIMEOUT   10000
+#define HTTP_KEEPALIVE_TIMEOUT  5000
+#define HTTP_LINGER_TIMEOUT     2000
+
+// Server-sent event subscribers; each gets a buffer of at most EVENT_BUFFER_SIZE
+// bytes and events that don't fit are dropped and counted rather than queued.
+#ifndef MAX_EVENT_CLIENTS
+#define MAX_EVENT_CLIENTS       3
+#endif
+#ifndef EVENT_BUFFER_SIZE
+#define EVENT_BUFFER_SIZE       1024
+#endif
+#define EVENT_PING_INTERVAL     15000
+
+static_assert(EVENT_BUFFER_SIZE <= 65535, "Event buffer fill is tracked in 16 bits");
+static_assert(EVENT_BUFFER_SIZE >= 16, "Event buffer must hold at least a keep-alive ping");
+
+typedef enum {
+    CONNECTION_FREE,
+    CONNECTION_SENDING,
+    CONNECTION_KEEPALIVE,
+    CONNECTION_LINGER,
+    CONNECTION_EVENTS,
+} GizmoConnectionState;
+
+// ESP8266WebServer that streams server-sent events and, when async, takes finished and long-running
+// connections off the single request slot of the base class. Static files
+// are streamed a TCP segment at a time from handleClient(), idle keep-alive
+// connections are parked, and responses are left to drain while the next
+// client is served. Handler registration and the request API are unchanged.
+class GizmoWebServer : public ESP8266WebServer {
+public:
+    GizmoWebServer(int port, bool async);
+
+    void handleClient();
+    bool isAsync();
+    int activeConnections();
+
+    // Sends the file; asynchronously when a connection slot is free.
+    void sendFile(File &file, const char *contentType, const char *cacheHeader, bool gzipped);
+
+    // Turns the current request into a server-sent event stream.
+    void beginEvents();
+    void sendEvent(const char *event, const char *data);
+    int eventClients();
+
+private:
+    typedef struct {
+        GizmoConnectionState state;
+        WiFiClient client;
+        File file;
+        uint32_t lastProgress;
+        char *events;
+        uint16_t eventsUsed;
+        uint32_t dropped;
+    } Connection;
+
+    Connection connections[MAX_HTTP_CONNECTIONS];
+    bool async;
+    bool detached = false;
+    int eventClientCount = 0;
+
+    Connection *freeConnection();
+    bool requestKeepAlive();
+    bool detach(GizmoConnectionState state, File *file);
+    void adoptKeepAlive();
+    void pumpConnections();
+    void pumpEvents(Connection *c, uint32_t now);
+    bool queueEvent(Connection *c, const char *event, const char *data);
+};
+
+class GizmoStaticHandler : public RequestHandler {
+public:
+    GizmoStaticHandler(GizmoWebServer *server, FS &fs, const char *uri, const char *path, const char *cacheHeader);
+
+    bool canHandle(HTTPMethod method, const String &uri) override;
+    bool handle(ESP8266WebServer &server, HTTPMethod method, const String &uri) override;
+
+private:
+    GizmoWebServer *server;
+    FS &fs;
+    const char *uri;
+    const char *path;
+    const char *cacheHeader;
+};
+
+const char *contentType(const char *path);
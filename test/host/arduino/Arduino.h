@@ -0,0 +1,55 @@
+#pragma once
+
+// Just enough of the Arduino core to build ESPGizmo's platform-independent pieces on
+// the host. Time can be real or simulated; simulated time only moves when the test
+// advances it, so long runs take no longer than the work they do.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t b) = 0;
+    virtual size_t write(const uint8_t *data, size_t length);
+    size_t printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class HardwareSerial : public Print {
+public:
+    size_t write(uint8_t b) override;
+    size_t write(const uint8_t *data, size_t length) override;
+};
+
+extern HardwareSerial Serial;
+
+uint32_t millis();
+void delay(uint32_t ms);
+void yield();
+
+// Host only: switches to simulated time and moves it forward.
+void hostUseSimulatedTime(bool simulated);
+void hostAdvance(uint32_t ms);
+// Host only: Serial output is dropped unless enabled.
+void hostEchoSerial(bool echo);
+
+// The few ESP calls behind espSleepBackend; RTC memory never survives and every boot
+// is a power-on, so host tests bring their own backend.
+#define REASON_DEEP_SLEEP_AWAKE 5
+
+struct rst_info {
+    uint32_t reason;
+};
+
+class EspClass {
+public:
+    bool rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size);
+    bool rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size);
+    void deepSleep(uint64_t micros);
+    rst_info *getResetInfoPtr();
+};
+
+extern EspClass ESP;
@@ -0,0 +1,94 @@
+#include <Arduino.h>
+#include <stdarg.h>
+#include <time.h>
+
+HardwareSerial Serial;
+
+static bool simulated = false;
+static uint32_t simulatedMillis = 0;
+static bool echo = false;
+
+size_t Print::write(const uint8_t *data, size_t length) {
+    size_t n = 0;
+    while (n < length && write(data[n])) {
+        n++;
+    }
+    return n;
+}
+
+size_t Print::printf(const char *fmt, ...) {
+    char buf[512];
+    va_list args;
+    va_start(args, fmt);
+    int l = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (l < 0) {
+        return 0;
+    }
+    return write((const uint8_t *) buf, (size_t) l < sizeof(buf) ? l : sizeof(buf) - 1);
+}
+
+size_t HardwareSerial::write(uint8_t b) {
+    return write(&b, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t *data, size_t length) {
+    if (echo) {
+        fwrite(data, 1, length, stdout);
+        fflush(stdout);
+    }
+    return length;
+}
+
+uint32_t millis() {
+    if (simulated) {
+        return simulatedMillis;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t) (ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000);
+}
+
+void delay(uint32_t ms) {
+    if (simulated) {
+        simulatedMillis += ms;
+    } else {
+        struct timespec ts = {(time_t) (ms / 1000), (long) (ms % 1000) * 1000000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+void yield() {
+}
+
+void hostUseSimulatedTime(bool on) {
+    simulated = on;
+}
+
+void hostAdvance(uint32_t ms) {
+    simulatedMillis += ms;
+}
+
+void hostEchoSerial(bool on) {
+    echo = on;
+}
+
+EspClass ESP;
+
+static rst_info powerOn = {0};
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size) {
+    return false;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size) {
+    return false;
+}
+
+void EspClass::deepSleep(uint64_t micros) {
+    exit(0);
+}
+
+rst_info *EspClass::getResetInfoPtr() {
+    return &powerOn;
+}
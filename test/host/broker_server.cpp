@@ -0,0 +1,143 @@
+// Runs the local broker's session logic on a host TCP port so that standard MQTT
+// clients can be pointed at it. Usage: broker_server <port>
+//
+// The broker's local handler answers "ping" on gizmo/host/cmd with a retained "pong"
+// on gizmo/host/reply, standing in for the device's own handler.
+
+#include <ESPGizmoBroker.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+class SocketLink : public GizmoBrokerLink {
+public:
+    SocketLink(int fd) : fd(fd) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    }
+
+    ~SocketLink() {
+        stop();
+    }
+
+    int available() override {
+        uint8_t b;
+        return fd >= 0 && recv(fd, &b, 1, MSG_PEEK) > 0;
+    }
+
+    int read(uint8_t *buffer, size_t size) override {
+        ssize_t n = fd >= 0 ? recv(fd, buffer, size, 0) : -1;
+        return n < 0 ? -1 : (int) n;
+    }
+
+    size_t write(const uint8_t *data, size_t length) override {
+        size_t sent = 0;
+        while (fd >= 0 && sent < length) {
+            ssize_t n = send(fd, data + sent, length - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EAGAIN) {
+                usleep(1000);
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            sent += n;
+        }
+        return sent;
+    }
+
+    bool connected() override {
+        uint8_t b;
+        if (fd < 0) {
+            return false;
+        }
+        ssize_t n = recv(fd, &b, 1, MSG_PEEK);
+        return n > 0 || (n < 0 && errno == EAGAIN);
+    }
+
+    void stop() override {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+private:
+    int fd;
+};
+
+class SocketListener : public GizmoBrokerListener {
+public:
+    SocketListener(uint16_t port) : port(port) {}
+
+    void begin() override {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (sockaddr *) &address, sizeof(address)) || listen(fd, 8)) {
+            perror("broker_server");
+            exit(1);
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    }
+
+    void stop() override {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    GizmoBrokerLink *accept() override {
+        int client = fd >= 0 ? ::accept(fd, NULL, NULL) : -1;
+        return client >= 0 ? new SocketLink(client) : NULL;
+    }
+
+private:
+    uint16_t port;
+    int fd = -1;
+};
+
+static volatile bool running = true;
+
+static void terminate(int) {
+    running = false;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+        return 2;
+    }
+    signal(SIGTERM, terminate);
+    signal(SIGINT, terminate);
+    hostEchoSerial(true);
+
+    GizmoBroker broker(new SocketListener(atoi(argv[1])));
+    broker.setLocalCallback([&broker](const char *topic, const uint8_t *payload, unsigned int length) {
+        if (!strcmp(topic, "gizmo/host/cmd") && length == 4 && !memcmp(payload, "ping", 4)) {
+            broker.publish("gizmo/host/reply", (const uint8_t *) "pong", 4, true);
+        }
+    });
+    broker.begin();
+    printf("ready\n");
+    fflush(stdout);
+
+    while (running) {
+        broker.loop();
+        usleep(1000);
+    }
+    broker.stop();
+    printf("delivered %u rejected %u dropped %u\n", broker.delivered, broker.rejected, broker.dropped);
+    return 0;
+}
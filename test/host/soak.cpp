@@ -0,0 +1,590 @@
+// Soak run for fault recovery, on simulated time so that a day takes seconds.
+// Usage: soak [hours]
+//
+// The device is a model of ESPGizmo's loop built from the pieces that run on the host:
+// GizmoFaults takes the same fault script the control topic would, GizmoHealth with
+// defaultRecoveryPolicy picks recovery actions, and the local GizmoBroker plays the
+// MQTT broker over in-memory links. Stand-ins for the access point and the update
+// server complete it. Every second the device publishes a numbered reading, and the
+// broker side checks that each one it was sent arrives.
+//
+// The model is hand-written: it shares ESPGizmo's fault, health and broker code and its
+// timing constants, but not the loop in ESPGizmo.cpp, so a regression there is not
+// caught here. Within the model it exits non-zero when a wifi or broker fault takes more
+// than SOAK_MAX_RECOVERY_SLACK beyond the outage itself to recover from, when a fault
+// that never took the device offline is counted as a recovery, when a reading the
+// device sent is lost, when an update does not complete, or when the heap in use
+// grows by more than SOAK_MAX_HEAP_DRIFT.
+
+#include <ESPGizmoBroker.h>
+#include <ESPGizmoFaults.h>
+#include <ESPGizmoHealth.h>
+#include <malloc.h>
+#include <memory>
+#include <vector>
+
+#define SOAK_STEP                   10
+#define SOAK_READING_INTERVAL       1000
+#define SOAK_EVENT_INTERVAL         600000
+#define SOAK_ASSOCIATE_TIME         3000
+#define SOAK_RESTART_TIME           8000
+#define SOAK_KEEP_ALIVE             15
+#define SOAK_UPDATE_SIZE            8192
+
+#define SOAK_MAX_RECOVERY_SLACK     20000
+#define SOAK_MAX_HEAP_DRIFT         512
+#define SOAK_HEAP                   81920
+
+#define READING_TOPIC               "soak/reading"
+#define PROBE_TOPIC                 "soak/probe"
+
+static int failures = 0;
+
+static void fail(const char *what, uint32_t value) {
+    printf("FAIL %s (%u) at %u s\n", what, value, millis() / 1000);
+    failures++;
+}
+
+// One direction of an in-memory TCP connection.
+struct Pipe {
+    uint8_t data[1024];
+    size_t head = 0;
+    size_t length = 0;
+
+    size_t write(const uint8_t *p, size_t n) {
+        size_t i = 0;
+        for (; i < n && length < sizeof(data); i++) {
+            data[(head + length++) % sizeof(data)] = p[i];
+        }
+        return i;
+    }
+
+    int read(uint8_t *p, size_t n) {
+        size_t i = 0;
+        for (; i < n && length; i++, length--) {
+            p[i] = data[head];
+            head = (head + 1) % sizeof(data);
+        }
+        return i;
+    }
+};
+
+// A connection between the device and the broker; either end may close it.
+struct Connection {
+    Pipe toBroker;
+    Pipe toDevice;
+    bool open = true;
+};
+
+class MemoryLink : public GizmoBrokerLink {
+public:
+    MemoryLink(std::shared_ptr<Connection> connection) : connection(connection) {}
+
+    int available() override {
+        return connection->toBroker.length;
+    }
+
+    int read(uint8_t *buffer, size_t size) override {
+        return connection->toBroker.read(buffer, size);
+    }
+
+    size_t write(const uint8_t *data, size_t length) override {
+        return connection->open ? connection->toDevice.write(data, length) : 0;
+    }
+
+    bool connected() override {
+        return connection->open;
+    }
+
+    void stop() override {
+        connection->open = false;
+    }
+
+private:
+    std::shared_ptr<Connection> connection;
+};
+
+class MemoryListener : public GizmoBrokerListener {
+public:
+    ~MemoryListener() {
+        delete pending;
+    }
+
+    void begin() override {
+    }
+
+    void stop() override {
+    }
+
+    GizmoBrokerLink *accept() override {
+        GizmoBrokerLink *link = pending;
+        pending = NULL;
+        return link;
+    }
+
+    void connect(std::shared_ptr<Connection> connection) {
+        delete pending;
+        pending = new MemoryLink(connection);
+    }
+
+private:
+    GizmoBrokerLink *pending = NULL;
+};
+
+// The access point: associating takes a while and fails while a wifi fault holds it off.
+struct Network {
+    bool up = true;
+    bool associated = false;
+    uint32_t associating = 0;
+
+    void associate() {
+        if (!associated && !associating) {
+            associating = millis() + SOAK_ASSOCIATE_TIME;
+        }
+    }
+
+    void drop() {
+        associated = false;
+        associating = 0;
+    }
+
+    void loop() {
+        if (associating && millis() >= associating) {
+            associating = 0;
+            associated = up;
+        }
+    }
+};
+
+// Serves one file; a download fault cuts the next transfer short.
+struct UpdateServer {
+    uint8_t image[SOAK_UPDATE_SIZE];
+
+    UpdateServer() {
+        for (size_t i = 0; i < sizeof(image); i++) {
+            image[i] = (uint8_t) (i * 31 + 7);
+        }
+    }
+
+    size_t get(uint8_t *buffer, uint32_t limit) {
+        size_t length = limit && limit < sizeof(image) ? limit : sizeof(image);
+        memcpy(buffer, image, length);
+        return length;
+    }
+};
+
+class Device {
+public:
+    Device(MemoryListener *listener, Network *network, UpdateServer *server) :
+            listener(listener), network(network), server(server) {
+        heapBase = mallinfo2().uordblks;
+    }
+
+    GizmoFaults faults;
+    GizmoHealth health;
+    bool online = false;
+    uint32_t sequence = 0;
+    uint32_t sent = 0;
+    uint32_t dropped = 0;
+    uint32_t updates = 0;
+    uint32_t updateFailures = 0;
+
+    void loop() {
+        uint32_t now = millis();
+        if (restartAt) {
+            if (now < restartAt) {
+                return;
+            }
+            restartAt = 0;
+            network->associate();
+        }
+
+        handleFaults();
+        network->loop();
+        if (!network->associated && !wifiFaultHeld) {
+            network->associate();
+        }
+        handleMQTT();
+
+        if (now >= nextReading) {
+            nextReading = now + SOAK_READING_INTERVAL;
+            publishReading();
+        }
+        if (now >= nextProbe) {
+            nextProbe = now + HEALTH_PROBE_INTERVAL;
+            probeHealth();
+            applyRecovery(defaultRecoveryPolicy(&health));
+        }
+        if (updateRequested && online) {
+            updateRequested = false;
+            update();
+        }
+    }
+
+    void requestUpdate() {
+        updateRequested = true;
+    }
+
+    void sampleHeap() {
+        // Report it as an ESP8266 would, as free heap out of SOAK_HEAP.
+        faults.sampleHeap(SOAK_HEAP - (mallinfo2().uordblks - heapBase));
+    }
+
+private:
+    MemoryListener *listener;
+    Network *network;
+    UpdateServer *server;
+    size_t heapBase;
+
+    std::shared_ptr<Connection> mqtt;
+    uint8_t rx[256];
+    size_t rxLength = 0;
+    bool wifiFaultHeld = false;
+    bool updateRequested = false;
+    uint32_t restartAt = 0;
+    uint32_t lastReconnectAttempt = 0;
+    uint32_t lastPing = 0;
+    uint32_t nextReading = 0;
+    uint32_t nextProbe = HEALTH_PROBE_INTERVAL;
+    uint32_t brokerProbeTime = 0;
+    uint32_t brokerProbeSequence = 0;
+
+    bool connected() {
+        return mqtt && mqtt->open;
+    }
+
+    void setOnline(bool state) {
+        if (state != online) {
+            online = state;
+            if (online) {
+                faults.recovered(millis());
+            }
+        }
+    }
+
+    void disconnect() {
+        if (mqtt) {
+            mqtt->open = false;
+            mqtt.reset();
+        }
+        rxLength = 0;
+        setOnline(false);
+    }
+
+    void handleFaults() {
+        uint32_t now = millis();
+        if (faults.take(FAULT_WIFI)) {
+            network->up = false;
+            network->drop();
+            disconnect();
+            wifiFaultHeld = true;
+        }
+        if (wifiFaultHeld && !faults.active(FAULT_WIFI, now)) {
+            wifiFaultHeld = false;
+            network->up = true;
+            network->associate();
+        }
+        if (faults.take(FAULT_BROKER) && mqtt) {
+            // Drop the socket without a DISCONNECT, as a broker restart would.
+            mqtt->open = false;
+        }
+        uint32_t stall = faults.take(FAULT_STALL);
+        if (stall) {
+            delay(stall);
+        }
+        faults.settle(millis(), online && connected());
+    }
+
+    void send(uint8_t type, const uint8_t *body, size_t length) {
+        uint8_t header[5] = {type};
+        size_t h = 1;
+        size_t remaining = length;
+        do {
+            header[h] = remaining & 0x7f;
+            remaining >>= 7;
+            header[h++] |= remaining ? 0x80 : 0;
+        } while (remaining);
+        if (connected() && (mqtt->toBroker.write(header, h) != h || mqtt->toBroker.write(body, length) != length)) {
+            fail("device socket overflow", length);
+        }
+    }
+
+    static size_t putString(uint8_t *p, const char *s) {
+        size_t l = strlen(s);
+        p[0] = l >> 8;
+        p[1] = l;
+        memcpy(p + 2, s, l);
+        return 2 + l;
+    }
+
+    void sendPublish(const char *topic, const char *payload) {
+        uint8_t body[128];
+        size_t l = putString(body, topic);
+        memcpy(body + l, payload, strlen(payload));
+        send(0x30, body, l + strlen(payload));
+    }
+
+    void reconnect() {
+        uint32_t now = millis();
+        if (lastReconnectAttempt && now - lastReconnectAttempt < MQTT_RECONNECT_FREQUENCY) {
+            return;
+        }
+        lastReconnectAttempt = now;
+        if (faults.active(FAULT_BROKER, now) || faults.active(FAULT_DNS, now)) {
+            return;
+        }
+        disconnect();
+        mqtt = std::make_shared<Connection>();
+        listener->connect(mqtt);
+        static const uint8_t connect[] = {0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, 0, SOAK_KEEP_ALIVE,
+                                          0, 6, 'g', 'i', 'z', 'm', 'o', '1'};
+        send(0x10, connect, sizeof(connect));
+        lastPing = now;
+    }
+
+    void handleMQTT() {
+        if (!network->associated) {
+            if (mqtt) {
+                disconnect();
+            }
+            return;
+        }
+        if (!connected()) {
+            if (online || mqtt) {
+                disconnect();
+            }
+            reconnect();
+            return;
+        }
+
+        int n;
+        while ((n = mqtt->toDevice.read(rx + rxLength, sizeof(rx) - rxLength)) > 0) {
+            rxLength += n;
+        }
+        // Everything the broker sends the device here fits a one-byte length.
+        while (rxLength >= 2 && rxLength >= 2u + rx[1]) {
+            handlePacket(rx[0], rx + 2, rx[1]);
+            rxLength -= 2 + rx[1];
+            memmove(rx, rx + 2 + rx[1], rxLength);
+        }
+
+        if (online && millis() - lastPing > SOAK_KEEP_ALIVE * 1000 / 2) {
+            lastPing = millis();
+            send(0xc0, NULL, 0);
+        }
+    }
+
+    void handlePacket(uint8_t type, uint8_t *body, size_t length) {
+        if (type == 0x20 && length == 2 && body[1] == 0) {
+            uint8_t subscribe[64] = {0, 1};
+            size_t l = 2 + putString(subscribe + 2, PROBE_TOPIC);
+            subscribe[l++] = 0;
+            send(0x82, subscribe, l);
+            lastReconnectAttempt = 0;
+            setOnline(true);
+        } else if ((type & 0xf0) == 0x30 && brokerProbeTime) {
+            char seq[12];
+            size_t topicLength = (body[0] << 8) | body[1];
+            size_t l = length - 2 - topicLength;
+            snprintf(seq, sizeof(seq), "%.*s", (int) l, (char *) body + 2 + topicLength);
+            if ((uint32_t) atol(seq) == brokerProbeSequence) {
+                health.broker.record(millis() - brokerProbeTime);
+                brokerProbeTime = 0;
+            }
+        }
+    }
+
+    void publishReading() {
+        char payload[12];
+        snprintf(payload, sizeof(payload), "%u", ++sequence);
+        if (online && connected()) {
+            sendPublish(READING_TOPIC, payload);
+            sent++;
+        } else {
+            dropped++;
+        }
+    }
+
+    void probeHealth() {
+        health.gateway.sent++;
+        if (network->associated) {
+            health.gateway.record(2);
+            health.pendingReassociations = 0;
+        } else {
+            health.gateway.lost();
+        }
+
+        if (brokerProbeTime) {
+            health.broker.lost();
+            brokerProbeTime = 0;
+        }
+        health.broker.sent++;
+        if (online && connected()) {
+            char seq[12];
+            snprintf(seq, sizeof(seq), "%u", ++brokerProbeSequence);
+            sendPublish(PROBE_TOPIC, seq);
+            brokerProbeTime = millis();
+        } else {
+            health.broker.lost();
+        }
+    }
+
+    void applyRecovery(GizmoRecovery recovery) {
+        switch (recovery) {
+            case RECOVERY_REASSOCIATE:
+                health.reassociations++;
+                health.pendingReassociations++;
+                health.gateway.consecutiveLosses = 0;
+                network->drop();
+                network->associate();
+                break;
+            case RECOVERY_RECONNECT_MQTT:
+                health.mqttReconnects++;
+                health.broker.consecutiveLosses = 0;
+                disconnect();
+                lastReconnectAttempt = 0;
+                break;
+            case RECOVERY_RESTART:
+                health.restarts++;
+                disconnect();
+                network->drop();
+                restartAt = millis() + SOAK_RESTART_TIME;
+                break;
+            case RECOVERY_NONE:
+                break;
+        }
+    }
+
+    // As updateFiles(): one attempt and up to FILE_UPDATE_RETRIES more, then give up.
+    void update() {
+        std::unique_ptr<uint8_t[]> buffer(new uint8_t[SOAK_UPDATE_SIZE]);
+        for (int t = 0; t <= FILE_UPDATE_RETRIES; t++) {
+            if (!faults.active(FAULT_DNS, millis())) {
+                size_t length = server->get(buffer.get(), faults.take(FAULT_DOWNLOAD));
+                if (length == SOAK_UPDATE_SIZE && !memcmp(buffer.get(), server->image, length)) {
+                    updates++;
+                    return;
+                }
+            }
+            delay(FILE_UPDATE_RETRY_DELAY);
+        }
+        updateFailures++;
+    }
+};
+
+// What happens at each event slot, in turn; outage is how long a link fault keeps the
+// device off, or 0 for faults it should ride through.
+typedef struct {
+    const char *faults[2];
+    uint32_t outage;
+    bool update;
+} SoakEvent;
+
+static const SoakEvent script[] = {
+    {{"wifi 15000"}, 15000, false},
+    {{"broker 8000"}, 8000, false},
+    {{"dns 20000"}, 0, false},
+    {{"broker 0", "dns 20000"}, 20000, false},
+    {{"download 3000"}, 0, true},
+    {{"stall 2000"}, 0, false},
+    {{"wifi 150000"}, 150000, false},
+    {{"dns 2000"}, 0, true},
+};
+
+#define SCRIPT_EVENTS   (sizeof(script) / sizeof(script[0]))
+
+int main(int argc, char **argv) {
+    uint32_t hours = argc > 1 ? atoi(argv[1]) : 24;
+    hostUseSimulatedTime(true);
+    // Printing first also gets stdout's buffer allocated before the heap baseline.
+    printf("Soaking for %u simulated hours\n", hours);
+
+    uint32_t readings = hours * 3600 * (1000 / SOAK_READING_INTERVAL) + 1;
+    std::vector<uint8_t> seen(readings + 1, 0);
+    uint32_t received = 0;
+
+    Network network;
+    UpdateServer server;
+    MemoryListener *listener = new MemoryListener();
+    GizmoBroker broker(listener);
+    broker.setLocalCallback([&](const char *topic, const uint8_t *payload, unsigned int length) {
+        if (!strcmp(topic, READING_TOPIC)) {
+            char seq[12];
+            snprintf(seq, sizeof(seq), "%.*s", (int) length, (const char *) payload);
+            uint32_t n = atol(seq);
+            if (n && n <= readings && !seen[n]) {
+                seen[n] = 1;
+                received++;
+            }
+        }
+    });
+    broker.begin();
+
+    Device device(listener, &network, &server);
+    uint32_t end = hours * 3600000;
+    uint32_t nextEvent = SOAK_EVENT_INTERVAL / 2;
+    uint32_t event = 0;
+    uint32_t outage = 0;
+    uint32_t recoveries = 0;
+    size_t baseline = 0;
+
+    while (millis() < end) {
+        uint32_t now = millis();
+        if (now >= nextEvent) {
+            if (outage) {
+                fail("no recovery from scripted outage", outage);
+            }
+            const SoakEvent *e = &script[event++ % SCRIPT_EVENTS];
+            for (int i = 0; i < 2 && e->faults[i]; i++) {
+                device.faults.inject(e->faults[i], now);
+            }
+            if (e->update) {
+                device.requestUpdate();
+            }
+            outage = e->outage;
+            nextEvent += SOAK_EVENT_INTERVAL;
+        }
+
+        device.loop();
+        broker.loop();
+
+        if (device.faults.recoveries != recoveries) {
+            recoveries = device.faults.recoveries;
+            if (!outage) {
+                fail("recovery counted for a fault that kept the device online", device.faults.lastRecovery);
+            } else if (device.faults.lastRecovery > outage + SOAK_MAX_RECOVERY_SLACK) {
+                fail("slow recovery", device.faults.lastRecovery);
+            }
+            outage = 0;
+        }
+
+        // Sample the heap a minute before each event, once the device has settled online.
+        if (device.online && now % SOAK_EVENT_INTERVAL == SOAK_EVENT_INTERVAL / 2 - 60000) {
+            device.sampleHeap();
+            struct mallinfo2 info = mallinfo2();
+            if (!baseline) {
+                baseline = info.uordblks;
+            } else if (info.uordblks > baseline + SOAK_MAX_HEAP_DRIFT) {
+                fail("heap drift", (uint32_t) (info.uordblks - baseline));
+                baseline = info.uordblks;
+            }
+        }
+        hostAdvance(SOAK_STEP);
+    }
+
+    if (device.sent != received) {
+        fail("readings sent but never delivered", device.sent - received);
+    }
+    if (device.updateFailures || !device.updates) {
+        fail("updates failed", device.updateFailures);
+    }
+
+    char report[160], summary[256];
+    device.faults.report(report, sizeof(report), device.dropped);
+    device.health.summary(summary, sizeof(summary));
+    printf("%u h: %s\n", hours, report);
+    printf("readings %u sent %u delivered %u; updates %u\n", device.sequence, device.sent, received, device.updates);
+    printf("health %s\n", summary);
+    printf("%d failure(s)\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+"""Drives the local broker, built for the host as broker_server, with the paho MQTT
+client: QoS 0/1/2 publishes, retained messages, wildcard and oversubscribed
+SUBSCRIBEs, unsubscribe, keep-alive, a full session table and an oversize packet.
+
+Usage: test_broker.py <path to broker_server>
+"""
+
+import queue
+import socket
+import subprocess
+import sys
+import time
+
+try:
+    import paho.mqtt.client as mqtt
+except ImportError:
+    sys.exit("test_broker.py needs paho-mqtt (pip install paho-mqtt)")
+
+MAX_BROKER_SUBSCRIPTIONS = 6
+MAX_BROKER_SESSIONS = 4
+TIMEOUT = 2
+
+failures = 0
+
+
+def check(condition, what):
+    global failures
+    print("%s %s" % ("ok  " if condition else "FAIL", what))
+    if not condition:
+        failures += 1
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+class Peer:
+    def __init__(self, port, name, keepalive=30):
+        self.messages = queue.Queue()
+        self.subacks = queue.Queue()
+        self.disconnected = False
+        self.client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id=name,
+                                  protocol=mqtt.MQTTv311)
+        self.client.on_message = lambda c, u, m: self.messages.put((m.topic, m.payload, m.retain))
+        self.client.on_subscribe = lambda c, u, mid, codes, p: self.subacks.put(codes)
+        self.client.on_disconnect = self.on_disconnect
+        self.client.connect("127.0.0.1", port, keepalive)
+        self.client.loop_start()
+        deadline = time.time() + TIMEOUT
+        while not self.client.is_connected() and time.time() < deadline:
+            time.sleep(0.01)
+
+    def on_disconnect(self, client, userdata, flags, reason, properties):
+        self.disconnected = True
+
+    def subscribe(self, *filters):
+        self.client.subscribe([(f, 0) for f in filters])
+        return self.subacks.get(timeout=TIMEOUT)
+
+    def publish(self, topic, payload, qos=0, retain=False):
+        info = self.client.publish(topic, payload, qos=qos, retain=retain)
+        info.wait_for_publish(TIMEOUT)
+        return info.is_published()
+
+    def receive(self, timeout=TIMEOUT):
+        try:
+            return self.messages.get(timeout=timeout)
+        except queue.Empty:
+            return None
+
+    def close(self):
+        self.client.loop_stop()
+        self.client.disconnect()
+
+
+def main():
+    port = free_port()
+    broker = subprocess.Popen([sys.argv[1], str(port)], stdout=subprocess.PIPE, text=True)
+    broker.stdout.readline()
+    try:
+        run(port)
+    finally:
+        broker.terminate()
+        broker.wait()
+    print("%d failure(s)" % failures)
+    sys.exit(1 if failures else 0)
+
+
+def run(port):
+    a = Peer(port, "a")
+    b = Peer(port, "b")
+    check(a.client.is_connected() and b.client.is_connected(), "peers connect")
+
+    codes = a.subscribe("gizmo/#", "gizmo/host/reply")
+    check([c.value for c in codes] == [0, 0], "SUBACK grants both filters")
+
+    for qos in (0, 1, 2):
+        check(b.publish("gizmo/x", "q%d" % qos, qos=qos), "QoS %d publish is acknowledged" % qos)
+        got = a.receive()
+        check(got is not None and got[:2] == ("gizmo/x", b"q%d" % qos), "QoS %d publish is delivered" % qos)
+
+    b.publish("gizmo/host/cmd", "ping")
+    got = [a.receive(), a.receive(), a.receive()]
+    check(("gizmo/host/reply", b"pong", False) in got, "local handler reply reaches subscribers")
+
+    c = Peer(port, "c")
+    c.subscribe("+/host/reply")
+    check(c.receive() == ("gizmo/host/reply", b"pong", True), "retained message replays on subscribe")
+    b.publish("gizmo/host/reply", "", retain=True)
+    c.close()
+
+    c = Peer(port, "c2")
+    c.subscribe("gizmo/host/reply")
+    check(c.receive(0.5) is None, "empty retained publish clears the topic")
+    c.close()
+
+    a.client.unsubscribe("gizmo/#")
+    time.sleep(0.2)
+    while a.receive(0.1):
+        pass
+    b.publish("gizmo/x", "after")
+    check(a.receive(0.5) is None, "unsubscribed filter no longer delivers")
+
+    d = Peer(port, "d")
+    filters = ["many/%d" % i for i in range(MAX_BROKER_SUBSCRIPTIONS + 2)]
+    codes = [c.value for c in d.subscribe(*filters)]
+    check(len(codes) == len(filters), "SUBACK has a return code per filter")
+    check(codes == [0] * MAX_BROKER_SUBSCRIPTIONS + [0x80, 0x80], "filters past the table are refused with 0x80")
+    b.publish("many/0", "first")
+    check(d.receive() == ("many/0", b"first", False), "session stays usable after a partly refused SUBSCRIBE")
+    d.close()
+    time.sleep(0.2)
+
+    # paho checks its keep-alive about once a second, so leave it room within the
+    # broker's one and a half intervals.
+    k = Peer(port, "k", keepalive=3)
+    time.sleep(7)
+    check(k.client.is_connected() and not k.disconnected, "keep-alive pings hold the session open")
+
+    extra = [Peer(port, "x%d" % i) for i in range(MAX_BROKER_SESSIONS - 3)]
+    over = Peer(port, "over")
+    time.sleep(0.5)
+    check(not over.client.is_connected(), "connection past the session table is refused")
+    for p in extra + [over, k]:
+        p.close()
+    time.sleep(0.2)
+
+    e = Peer(port, "e")
+    e.publish("gizmo/big", "x" * 400)
+    time.sleep(0.5)
+    check(e.disconnected, "oversize packet closes the session")
+    e.close()
+
+    a.close()
+    b.close()
+
+
+if __name__ == "__main__":
+    main()
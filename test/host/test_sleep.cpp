@@ -0,0 +1,126 @@
+// Runs the duty-cycle bookkeeping through several simulated deep sleep cycles:
+// wake, queue readings, publish them against a broker that sometimes refuses,
+// then sleep, with RTC memory and deep sleep played by an in-memory backend.
+
+#include <ESPGizmoSleep.h>
+
+#define RTC_MEMORY_SIZE 512
+
+static uint32_t rtcMemory[RTC_MEMORY_SIZE / 4];
+static bool asleep = false;
+static uint64_t sleptFor = 0;
+
+static bool memoryRtcRead(uint32_t offset, uint32_t *data, size_t size) {
+    if (offset * 4 + size > RTC_MEMORY_SIZE) {
+        return false;
+    }
+    memcpy(data, &rtcMemory[offset], size);
+    return true;
+}
+
+static bool memoryRtcWrite(uint32_t offset, uint32_t *data, size_t size) {
+    if (offset * 4 + size > RTC_MEMORY_SIZE) {
+        return false;
+    }
+    memcpy(&rtcMemory[offset], data, size);
+    return true;
+}
+
+static void memoryDeepSleep(uint64_t micros) {
+    asleep = true;
+    sleptFor = micros;
+}
+
+static bool memoryWokeFromSleep() {
+    return asleep;
+}
+
+static const GizmoSleepBackend memoryBackend = {memoryRtcRead, memoryRtcWrite, memoryDeepSleep, memoryWokeFromSleep};
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+    if (!ok) {
+        failures++;
+    }
+}
+
+// Stands in for the broker; refuses everything after the first `accept` publishes.
+struct Broker {
+    int accept = 1000;
+    int published = 0;
+    char last[MAX_READING_PAYLOAD_SIZE] = "";
+
+    GizmoReadingPublisher publisher() {
+        return [this](const char *topic, const char *payload) {
+            if (published >= accept) {
+                return false;
+            }
+            published++;
+            strcpy(last, payload);
+            return true;
+        };
+    }
+};
+
+// One wake: what the library does between beginSetup() and sleep().
+static bool wake(GizmoRTCState *state) {
+    bool warm = loadRTCState(&memoryBackend, state);
+    state->wakeCount++;
+    asleep = false;
+    return warm;
+}
+
+static void sleep(GizmoRTCState *state) {
+    saveRTCState(&memoryBackend, state);
+    memoryDeepSleep(60 * 1000000ULL);
+}
+
+int main() {
+    GizmoRTCState state;
+
+    check(!wake(&state) && state.wakeCount == 1 && !state.readingCount, "power-on starts cold");
+    queueRTCReading(&state, "sensor/t", "21.5");
+    queueRTCReading(&state, "sensor/t", "21.6");
+    queueRTCReading(&state, "sensor/t", "21.7");
+    Broker flaky;
+    flaky.accept = 1;
+    uint32_t sent = publishRTCReadings(&state, flaky.publisher());
+    check(sent == 1 && state.sequence == 1, "a failed publish stops the run");
+    check(state.readingCount == 2 && !strcmp(state.readings[0].payload, "21.6"), "unsent readings stay queued in order");
+    sleep(&state);
+    check(sleptFor == 60 * 1000000ULL, "sleeps for the duty cycle");
+
+    check(wake(&state) && state.wakeCount == 2, "wakes warm from RTC memory");
+    check(state.readingCount == 2 && state.sequence == 1, "queue survives deep sleep");
+    queueRTCReading(&state, "sensor/t", "21.8");
+    Broker down;
+    down.accept = 0;
+    check(publishRTCReadings(&state, down.publisher()) == 0 && state.readingCount == 3, "nothing is lost while the broker is down");
+    sleep(&state);
+
+    wake(&state);
+    Broker up;
+    sent = publishRTCReadings(&state, up.publisher());
+    check(sent == 3 && !state.readingCount && state.sequence == 4, "next wake sends the backlog");
+    check(!strcmp(up.last, "21.8"), "backlog goes out oldest first");
+    sleep(&state);
+
+    wake(&state);
+    bool kept = true;
+    char payload[8];
+    for (int i = 0; i <= MAX_QUEUED_READINGS; i++) {
+        snprintf(payload, sizeof(payload), "%d", i);
+        kept = queueRTCReading(&state, "sensor/t", payload) && kept;
+    }
+    check(!kept && state.readingCount == MAX_QUEUED_READINGS && !strcmp(state.readings[0].payload, "1"),
+          "a full queue drops the oldest reading");
+    sleep(&state);
+
+    rtcMemory[5] ^= 1;
+    check(!wake(&state) && !state.readingCount && state.wakeCount == 1, "corrupt RTC memory starts cold");
+
+    printf("%d failure(s)\n", failures);
+    return failures ? 1 : 0;
+}